@@ -29,6 +29,7 @@
 
 #import <Cocoa/Cocoa.h>
 #import "SerialViewController.h"
+#import "SendHexIOSession.h"
 
 @interface FatFsSerialViewController : SerialViewController
 @property (nonatomic, strong) NSString* progressTextTemplate;
@@ -40,9 +41,10 @@
 @property (nonatomic) uint32_t blocksSent;
 
 
-- (void)sendHexFile:(NSURL*)inURL;
+- (void)sendBlockPackets:(HexLineSource)inPacketSource hexLines:(HexLineSource)inLineSource maxLineLength:(NSUInteger)inMaxLineLength;
 - (void)fatFsCreated:(uint32_t)inBlockSize blockCount:(uint32_t)inBlockCount;
 
 @property (nonatomic) BOOL eraseBeforeWrite;
+@property (nonatomic) BOOL compressTransfer;
 
 @end
@@ -29,6 +29,7 @@
 
 #import "FatFsSerialViewController.h"
 #import "SendHexIOSession.h"
+#import "SendPacketIOSession.h"
 
 @interface FatFsSerialViewController ()
 
@@ -40,6 +41,7 @@
 - (void)dealloc
 {
 	[self unbind:@"eraseBeforeWrite"];
+	[self unbind:@"compressTransfer"];
 }
 
 /****************************** viewDidLoad ***********************************/
@@ -47,20 +49,25 @@
 {
     [super viewDidLoad];
 	[self bind:@"eraseBeforeWrite" toObject:[NSUserDefaults standardUserDefaults] withKeyPath:@"eraseBeforeWrite" options:NULL];
+	[self bind:@"compressTransfer" toObject:[NSUserDefaults standardUserDefaults] withKeyPath:@"compressTransfer" options:NULL];
 	self.progressMax = 1;
 	self.progressTextTemplate = @"%d of %d"; //[NSString stringWithString:self.progressText];
 	self.progressText = @""; // [NSString string];
 }
 
-/******************************* sendHexFile **********************************/
-- (void)sendHexFile:(NSURL*)inDocURL
+/**************************** sendBlockPackets ********************************/
+/*
+*	Sends binary packets from inPacketSource, or hex lines from inLineSource if
+*	the loader doesn't accept packets.
+*/
+- (void)sendBlockPackets:(HexLineSource)inPacketSource hexLines:(HexLineSource)inLineSource maxLineLength:(NSUInteger)inMaxLineLength
 {
 	if ([self portIsOpen:YES])
 	{
-		NSError* error;
-		NSData *dataToSend = [NSData dataWithContentsOfURL:inDocURL options:0 error:&error];
-		self.serialPortSession = [[SendHexIOSession alloc] initWithData:dataToSend port:self.serialPort];
+		self.serialPortSession = [[SendPacketIOSession alloc] initWithPacketSource:inPacketSource hexLineSource:inLineSource port:self.serialPort];
+		self.serialPortSession.delegate = self;	// For resend warnings
 		((SendHexIOSession*)self.serialPortSession).eraseBeforeWrite = self.eraseBeforeWrite;
+		((SendHexIOSession*)self.serialPortSession).maxLineLength = inMaxLineLength;
 		[self.serialPortSession begin];
 	}
 }
@@ -89,12 +96,38 @@
 	self.progressValue = ((SendHexIOSession*)self.serialPortSession).currentAddress;
 }
 
+/*************************** postTransferSummary ******************************/
+/*
+*	The ratio is of the image loaded to the bytes sent, so it includes the
+*	nulls not sent as well as any compression.  The effective rate is of the
+*	image loaded.
+*/
+- (void)postTransferSummary:(SendHexIOSession*)inSession
+{
+	if (self.progressMax > 1 &&
+		inSession.bytesSent &&
+		inSession.seconds > 0)
+	{
+		[self appendNewLine];
+		[self postInfoString:[NSString stringWithFormat:
+			@"Sent the %.0f byte image as %llu bytes (%.1f:1) in %.1f seconds, %.0f bytes/s effective",
+				self.progressMax, (unsigned long long)inSession.bytesSent,
+				self.progressMax / inSession.bytesSent, inSession.seconds,
+				self.progressMax / inSession.seconds]];
+	}
+}
+
 /****************************** sessionIsDone *********************************/
 -(BOOL)sessionIsDone
 {
 	[self updateProgress];
+	SendHexIOSession*	session = (SendHexIOSession*)self.serialPortSession;
 	BOOL wasStopped = [self.serialPortSession wasStopped];
 	BOOL isDone = [super sessionIsDone];
+	if (isDone && session.completed)
+	{
+		[self postTransferSummary:session];
+	}
 	if (isDone && wasStopped)
 	{
 		[self appendNewLine];
@@ -29,14 +29,72 @@
 
 #import "FatFsToHexWindowController.h"
 #include "StorageAccess.h"
+#include <memory>
 
 @interface FatFsToHexWindowController ()
-
+// Set while exporting an image loaded by convertImage rather than the files.
+@property (nonatomic) BOOL exportImportedImage;
+// Set while exporting the delta against the baseline loaded by exportDelta.
+@property (nonatomic) BOOL exportDelta;
+// The buildInputs of the FS in StorageAccess, nil if it wasn't built from the files.
+@property (nonatomic, strong) NSArray *builtInputs;
+/*
+*	The root files being built, a copy of the table's taken when the job
+*	started.  The table may change while the job runs.
+*/
+@property (nonatomic, strong) NSArray *buildFiles;
+// Set while a job started by runJob is running.
+@property (nonatomic) BOOL jobRunning;
+@property (nonatomic, strong) NSTimer *jobTimer;
+// Set by buildFatFs on the job's thread, read by the job's progress timer.
+@property (atomic) uint64_t buildBytes;
+@property (atomic) double buildSeconds;
 @end
 
 @implementation FatFsToHexWindowController
 NSString *const kLastExportTypeKey = @"lastExportType";
 
+// formatTuning values, must match the tags of the FAT tuning popup items.
+enum EFormatTuning
+{
+	eTuneOff,
+	eTuneFewestBlocks,
+	eTuneFewestEraseUnits
+};
+
+// hexProfile values, must match the tags of the hex target popup items.
+enum EHexProfile
+{
+	eHexProfileATmegaSerial,
+	eHexProfileSDCopier,
+	eHexProfileGeneric
+};
+
+/*
+*	Hex record format for each target.  The loader sketches buffer 512 byte
+*	blocks so records can't span a 512 byte boundary.  The sketches'
+*	HEX_RECORD_LEN must match the record length.  maxLineLength is the longest
+*	line the serial sender will send (0 = not used for serial.)  nullRuns
+*	enables the null run record, which only the loader sketches understand.
+*/
+struct SHexProfile
+{
+	uint8_t		recordLength;
+	uint32_t	recordBoundary;
+	uint32_t	maxLineLength;
+	bool		nullRuns;
+};
+static const SHexProfile kHexProfiles[] =
+{
+	{16, 512, 64, true},	// HexLoader, limited by the 64 byte serial ring buffer
+	{64, 512, 0, true},		// HexCopier reading FLASH.HEX from an SD card
+	{255, 0, 0, false}		// Any Intel HEX reader, records don't span a FAT block
+};
+
+// The loader sketches erase the 64KB block containing the first block written
+// to it, so a hex delta must include every used block of each 64KB block.
+static const uint32_t	kLoaderEraseBlockSize = 0x10000;
+
 - (void)windowDidLoad
 {
     [super windowDidLoad];
@@ -90,6 +148,38 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 		saveAsMenuItem.target = self;
 		saveAsMenuItem.action = @selector(saveas:);
 	}
+
+	NSMenuItem *convertMenuItem = [[[NSApplication sharedApplication].mainMenu itemAtIndex:1].submenu itemWithTag:333];
+	if (convertMenuItem)
+	{
+		// Assign this object as the target.
+		convertMenuItem.target = self;
+		convertMenuItem.action = @selector(convertImage:);
+	}
+
+	NSMenuItem *deltaMenuItem = [[[NSApplication sharedApplication].mainMenu itemAtIndex:1].submenu itemWithTag:335];
+	if (deltaMenuItem)
+	{
+		// Assign this object as the target.
+		deltaMenuItem.target = self;
+		deltaMenuItem.action = @selector(exportDelta:);
+	}
+
+	NSMenuItem *exportAllMenuItem = [[[NSApplication sharedApplication].mainMenu itemAtIndex:1].submenu itemWithTag:336];
+	if (exportAllMenuItem)
+	{
+		// Assign this object as the target.
+		exportAllMenuItem.target = self;
+		exportAllMenuItem.action = @selector(exportAllFormats:);
+	}
+
+	NSMenuItem *writeMenuItem = [[[NSApplication sharedApplication].mainMenu itemAtIndex:1].submenu itemWithTag:337];
+	if (writeMenuItem)
+	{
+		// Assign this object as the target.
+		writeMenuItem.target = self;
+		writeMenuItem.action = @selector(writeToImageFile:);
+	}
 	if (self.fatFsTableViewController == nil)
 	{
 		_fatFsTableViewController = [[FatFsTableViewController alloc] initWithNibName:@"FatFsTableViewController" bundle:nil];
@@ -116,6 +206,9 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 		NSPopUpButton* formatPopupBtn = [_formatViewController.view viewWithTag:2];
 		formatPopupBtn.action = @selector(changeFormat:);
 		formatPopupBtn.target = self;
+		NSPopUpButton* compressionPopupBtn = [_formatViewController.view viewWithTag:3];
+		compressionPopupBtn.action = @selector(changeFormat:);
+		compressionPopupBtn.target = self;
 	}
 	// Create an instance of StorageAccess
 	StorageAccess::Create();
@@ -126,12 +219,192 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 /****************************** createFatFs ***********************************/
 - (BOOL)createFatFs
 {
-	__block BOOL	success = StorageAccess::GetInstance()->Format();
+	BOOL	success;
+	NSInteger	formatTuning = ((NSNumber*)[[NSUserDefaults standardUserDefaults] objectForKey:@"formatTuning"]).integerValue;
+	if (formatTuning == eTuneOff)
+	{
+		success = [self createFatFs:FM_ANY allocUnitSize:0];
+	} else
+	{
+		success = [self tuneFatFs:formatTuning];
+	}
+	if (success)
+	{
+		[self.fatFsSerialViewController postInfoString:[NSString stringWithFormat:@"FatFs created: %u blocks used, highest block %u, %u erase units of %u bytes",
+			StorageAccess::GetInstance()->GetUsedBlockCount(), StorageAccess::GetInstance()->GetHighestBlockIndex(),
+			StorageAccess::GetInstance()->GetEraseUnitCount(), StorageAccess::GetInstance()->GetEraseUnitSize()]];
+	}
+	
+	//fprintf(stderr, "Highest block used = 0x%X of 0x%X\n", StorageAccess::GetInstance()->GetHighestBlockIndex(), StorageAccess::GetInstance()->GetMaxBlockIndex());
+	return(success);
+}
+
+/******************************* buildInputs **********************************/
+/*
+*	Returns everything the FS built by createFatFs depends on: the settings
+*	used to create it and the path, size and modification date of each file
+*	and folder to be added, in the order added.  outFileBytes is set to the
+*	total size of the files.
+*/
+- (NSArray*)buildInputs:(uint64_t*)outFileBytes
+{
+	*outFileBytes = 0;
+	NSUserDefaults*	defaults = [NSUserDefaults standardUserDefaults];
+	NSMutableArray*	inputs = [NSMutableArray array];
+	for (NSString* key in @[@"volumeName", @"blockSize", @"pageSize", @"volumeSize",
+		@"formatTuning", @"eraseUnitLayout", @"compactFs", @"exportNamesAsIndex"])
+	{
+		id	value = [defaults objectForKey:key];
+		[inputs addObject:value ? value : [NSNull null]];
+	}
+	for (NSDictionary* rootFile in self.buildFiles)
+	{
+		NSURL* rootURL = [NSURL URLByResolvingBookmarkData:
+					[rootFile objectForKey:@"sourceBM"]
+						options:NSURLBookmarkResolutionWithoutUI+NSURLBookmarkResolutionWithoutMounting+NSURLBookmarkResolutionWithSecurityScope
+							relativeToURL:NULL bookmarkDataIsStale:NULL error:NULL];
+		if (rootURL == nil)
+		{
+			[inputs addObject:[NSNull null]];
+			continue;
+		}
+		[rootURL startAccessingSecurityScopedResource];
+		NSMutableArray*	fileURLs = [NSMutableArray arrayWithObject:rootURL];
+		if ([rootURL hasDirectoryPath])
+		{
+			[fileURLs addObjectsFromArray:[[[NSFileManager defaultManager] enumeratorAtURL:rootURL
+				includingPropertiesForKeys:@[NSURLFileSizeKey, NSURLContentModificationDateKey]
+					options:NSDirectoryEnumerationSkipsHiddenFiles
+						errorHandler:nil] allObjects]];
+		}
+		for (NSURL* fileURL in fileURLs)
+		{
+			NSNumber*	fileSize = nil;
+			NSDate*		modificationDate = nil;
+			[fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:nil];
+			[fileURL getResourceValue:&modificationDate forKey:NSURLContentModificationDateKey error:nil];
+			[inputs addObject:fileURL.path];
+			[inputs addObject:fileSize ? fileSize : [NSNull null]];
+			*outFileBytes += fileSize.unsignedLongLongValue;
+			[inputs addObject:modificationDate ? modificationDate : [NSNull null]];
+		}
+		[rootURL stopAccessingSecurityScopedResource];
+	}
+	return(inputs);
+}
+
+/******************************** buildFatFs **********************************/
+/*
+*	Creates the FS unless the FS in StorageAccess was built from the same
+*	inputs, e.g. when a project is exported as hex then as fimg, then sent.
+*	The exporters and the sender only read the blocks, so once built the FS
+*	doesn't change until it's rebuilt or an image is imported.
+*/
+- (BOOL)buildFatFs
+{
+	uint64_t	fileBytes;
+	NSArray*	inputs = [self buildInputs:&fileBytes];
+	if (self.builtInputs &&
+		[inputs isEqualToArray:self.builtInputs])
+	{
+		[self.fatFsSerialViewController postInfoString:@"FatFs unchanged, using the FS already built"];
+		return(YES);
+	}
+	self.builtInputs = nil;
+	self.buildBytes = fileBytes;
+	CFAbsoluteTime	startTime = CFAbsoluteTimeGetCurrent();
+	BOOL	success = [self createFatFs];
+	self.buildSeconds = CFAbsoluteTimeGetCurrent() - startTime;
+	if (success)
+	{
+		self.builtInputs = inputs;
+	}
+	return(success);
+}
+
+/******************************* tuneFatFs ************************************/
+/*
+*	Test formats the FS using each FAT type and cluster size combination that
+*	FatFs supports for the volume, adding the actual files each time.  The
+*	combination with the fewest used blocks (eTuneFewestBlocks) or the fewest
+*	erase units (eTuneFewestEraseUnits) is then used to create the final FS.
+*	The blocks are all in memory so each test format is relatively cheap.
+*/
+- (BOOL)tuneFatFs:(NSInteger)inCriterion
+{
+	StorageAccess*	storageAccess = StorageAccess::GetInstance();
+	static const BYTE	kFormats[] = {FM_FAT, FM_FAT32};
+	static const char*	kFatTypeNames[] = {"", "FAT12", "FAT16", "FAT32", "exFAT"};
+	NSUInteger	blockSize = ((NSNumber*)[[NSUserDefaults standardUserDefaults] objectForKey:@"blockSize"]).unsignedIntegerValue;
+	BYTE		bestFormat = FM_ANY;
+	DWORD		bestAllocUnitSize = 0;
+	uint32_t	bestScore = 0xFFFFFFFF;
+	uint32_t	bestTieBreaker = 0xFFFFFFFF;
+	BOOL		lastWasBest = NO;
+	NSMutableString*	report = [NSMutableString stringWithString:@"FAT tuning (type, cluster, used blocks, erase units, highest block):"];
+	for (NSUInteger formatIndex = 0; formatIndex < sizeof(kFormats)/sizeof(BYTE); formatIndex++)
+	{
+		/*
+		*	f_mkfs supports clusters of up to 128 blocks.  Clusters larger
+		*	than 64KB aren't supported by most FAT implementations.
+		*/
+		for (DWORD allocUnitSize = (DWORD)blockSize; allocUnitSize <= blockSize*128 && allocUnitSize <= 0x10000; allocUnitSize *= 2)
+		{
+			lastWasBest = NO;
+			if (storageAccess->JobCancelled())
+			{
+				return(NO);
+			}
+			if (![self createFatFs:kFormats[formatIndex] allocUnitSize:allocUnitSize])
+			{
+				continue;	// Not a valid combination for this volume size, or the files don't fit.
+			}
+			uint32_t	usedBlocks = storageAccess->GetUsedBlockCount();
+			uint32_t	eraseUnits = storageAccess->GetEraseUnitCount();
+			uint32_t	score = inCriterion == eTuneFewestEraseUnits ? eraseUnits : usedBlocks;
+			uint32_t	tieBreaker = inCriterion == eTuneFewestEraseUnits ? usedBlocks : eraseUnits;
+			BYTE		fatType = storageAccess->GetFatType();
+			[report appendFormat:@"\n\t%s, %u, %u, %u, %u", fatType < sizeof(kFatTypeNames)/sizeof(char*) ? kFatTypeNames[fatType] : "?",
+				storageAccess->GetClusterSize(), usedBlocks, eraseUnits, storageAccess->GetHighestBlockIndex()];
+			if (score < bestScore ||
+				(score == bestScore && tieBreaker < bestTieBreaker))
+			{
+				bestScore = score;
+				bestTieBreaker = tieBreaker;
+				bestFormat = kFormats[formatIndex];
+				bestAllocUnitSize = allocUnitSize;
+				lastWasBest = YES;
+			}
+		}
+	}
+	if (storageAccess->JobCancelled())
+	{
+		return(NO);
+	}
+	if (bestScore == 0xFFFFFFFF)
+	{
+		[self.fatFsSerialViewController postWarningString:@"FAT tuning failed, using the FatFs default format"];
+		return([self createFatFs:FM_ANY allocUnitSize:0]);
+	}
+	[report appendFormat:@"\nUsing %s with %u byte clusters",
+		bestFormat == FM_FAT ? "FAT12/16" : "FAT32", (uint32_t)bestAllocUnitSize];
+	[self.fatFsSerialViewController postInfoString:report];
+	return(lastWasBest ? YES : [self createFatFs:bestFormat allocUnitSize:bestAllocUnitSize]);
+}
+
+/****************************** createFatFs ***********************************/
+- (BOOL)createFatFs:(BYTE)inFormatOptions allocUnitSize:(DWORD)inAllocUnitSize
+{
+	__block BOOL	success = StorageAccess::GetInstance()->Format(inFormatOptions, inAllocUnitSize);
 	if (success)
 	{
+		if (StorageAccess::GetInstance()->GetEraseUnitLayout())
+		{
+			StorageAccess::GetInstance()->SetSmallFileBytes([self smallFileBytes:StorageAccess::GetInstance()->GetEraseUnitSize()]);
+		}
 		BOOL exportNamesAsIndex = ((NSNumber*)[[NSUserDefaults standardUserDefaults] objectForKey:@"exportNamesAsIndex"]).boolValue;
 		__block NSInteger	nameAsIndex = exportNamesAsIndex ? 0:-1; // -1 means don't export name as index, use actual name
-		NSArray*	rootFiles = self.fatFsTableViewController.rootFiles;
+		NSArray*	rootFiles = self.buildFiles;
 		__block NSInteger	dirNameAsIndex = nameAsIndex;
 		[rootFiles enumerateObjectsUsingBlock:
 			^(NSDictionary* inDictionary, NSUInteger inIndex, BOOL *outStop)
@@ -162,7 +435,10 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 					}
 					if (success)
 					{
-						[[self fatFsTableViewController] setDosName:[NSString stringWithUTF8String:dosName] forIndex:inIndex];
+						NSString*	dosNameStr = [NSString stringWithUTF8String:dosName];
+						dispatch_async(dispatch_get_main_queue(), ^{
+							[[self fatFsTableViewController] setDosName:dosNameStr forIndex:inIndex];
+						});
 					} else
 					{
 						*outStop = YES;
@@ -175,20 +451,64 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 					*outStop = YES;
 				}
 			}];
+		/*
+		*	Compaction packs the used clusters into a single run, so the
+		*	erase unit alignment of large files (if any) is lost.
+		*/
+		if (success &&
+			((NSNumber*)[[NSUserDefaults standardUserDefaults] objectForKey:@"compactFs"]).boolValue)
+		{
+			success = StorageAccess::GetInstance()->Compact();
+		}
 	}
-	
-	if (success)
-	{
-		// Update the serial progress bar even though it's not known how the
-		// created FS will be used.  By doing this the serial progress bar text
-		// will be updated to show the number of blocks in the current FS.
-		[self.fatFsSerialViewController fatFsCreated:StorageAccess::GetInstance()->GetBlockSize() blockCount:StorageAccess::GetInstance()->GetHighestBlockIndex() +1];
-	}
-	
-	//fprintf(stderr, "Highest block used = 0x%X of 0x%X\n", StorageAccess::GetInstance()->GetHighestBlockIndex(), StorageAccess::GetInstance()->GetMaxBlockIndex());
 	return(success);
 }
 
+/****************************** smallFileBytes ********************************/
+/*
+*	Returns the total size of the files to be added that are smaller than
+*	inEraseUnitSize.  Used by the erase unit layout to determine how much space
+*	is available to fill the gaps before erase unit aligned files.
+*/
+- (uint64_t)smallFileBytes:(uint32_t)inEraseUnitSize
+{
+	__block uint64_t	smallFileBytes = 0;
+	[self.buildFiles enumerateObjectsUsingBlock:
+		^(NSDictionary* inDictionary, NSUInteger inIndex, BOOL *outStop)
+		{
+			NSURL* rootURL = [NSURL URLByResolvingBookmarkData:
+						[inDictionary objectForKey:@"sourceBM"]
+							options:NSURLBookmarkResolutionWithoutUI+NSURLBookmarkResolutionWithoutMounting+NSURLBookmarkResolutionWithSecurityScope
+								relativeToURL:NULL bookmarkDataIsStale:NULL error:NULL];
+			if (rootURL)
+			{
+				[rootURL startAccessingSecurityScopedResource];
+				NSArray*	fileURLs = @[rootURL];
+				if ([rootURL hasDirectoryPath])
+				{
+					fileURLs = [[[NSFileManager defaultManager] enumeratorAtURL:rootURL
+						includingPropertiesForKeys:@[NSURLIsDirectoryKey, NSURLFileSizeKey]
+							options:NSDirectoryEnumerationSkipsHiddenFiles
+								errorHandler:nil] allObjects];
+				}
+				for (NSURL* fileURL in fileURLs)
+				{
+					NSNumber*	isDirectory = nil;
+					NSNumber*	fileSize = nil;
+					[fileURL getResourceValue:&isDirectory forKey:NSURLIsDirectoryKey error:nil];
+					[fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:nil];
+					if (![isDirectory boolValue] &&
+						fileSize.unsignedLongLongValue < inEraseUnitSize)
+					{
+						smallFileBytes += fileSize.unsignedLongLongValue;
+					}
+				}
+				[rootURL stopAccessingSecurityScopedResource];
+			}
+		}];
+	return(smallFileBytes);
+}
+
 /********************************* addFile ************************************/
 - (BOOL)addFile:(NSURL*)inURL fatPath:(NSString*)inFatPath dosName:(char*)outDosName nameAsIndex:(NSInteger)inNameAsIndex
 {
@@ -315,81 +635,362 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 /********************************* sendFatFs **********************************/
 - (IBAction)sendFatFs:(id)sender
 {
-	if ([self.fatFsSerialViewController portIsOpen:YES])
+	if ([self.fatFsSerialViewController portIsOpen:YES] &&
+		[self canStartJob])
 	{
-		NSError *error;
-		NSString *globallyUniqueString = [[NSProcessInfo processInfo] globallyUniqueString];
-		NSString *tempDirectoryPath = [NSTemporaryDirectory() stringByAppendingPathComponent:globallyUniqueString];
-		NSURL *tempDirectoryURL = [NSURL fileURLWithPath:tempDirectoryPath isDirectory:YES];
-		[[NSFileManager defaultManager] createDirectoryAtURL:tempDirectoryURL withIntermediateDirectories:YES attributes:nil error:&error];
-		if (error)
+		[self runJob:@"Build" work:^BOOL{
+			return([self buildFatFs]);
+		} completion:^(BOOL inSuccess) {
+			if (inSuccess)
+			{
+				[self sendBuiltFatFs];
+			}
+		}];
+	}
+}
+
+/****************************** sendBuiltFatFs ********************************/
+- (void)sendBuiltFatFs
+{
+	/*
+	*	Records are generated from the block map as the loader asks for
+	*	them so nothing is written to a temp file and re-read.
+	*	The serial HexLoader is always the target when sending.  Binary
+	*	packets are sent when the HexLoader accepts them, hex otherwise.
+	*/
+	StorageAccess*	storageAccess = StorageAccess::GetInstance();
+	storageAccess->SetHexRecordFormat(kHexProfiles[eHexProfileATmegaSerial].recordLength,
+									kHexProfiles[eHexProfileATmegaSerial].recordBoundary,
+									kHexProfiles[eHexProfileATmegaSerial].nullRuns);
+	std::shared_ptr<SHexRecordCursor>	cursor = std::make_shared<SHexRecordCursor>();
+	storageAccess->BeginHexRecords(*cursor);
+	std::shared_ptr<SBlockPacketCursor>	packetCursor = std::make_shared<SBlockPacketCursor>();
+	storageAccess->BeginBlockPackets(*packetCursor);
+	packetCursor->compress = self.fatFsSerialViewController.compressTransfer;
+	[self.fatFsSerialViewController sendBlockPackets:^NSData*(uint32_t* outAddress)
 		{
-			[self.fatFsSerialViewController postErrorString:error.localizedDescription];
-		} else
+			uint8_t		frame[StorageAccess::kMaxPacketFrameSize];
+			uint32_t	address = 0;
+			size_t		frameLength = StorageAccess::GetInstance()->GetNextBlockPacket(*packetCursor, frame, address);
+			if (frameLength == 0)
+			{
+				return(nil);
+			}
+			if (!packetCursor->done)
+			{
+				*outAddress = address;
+			}
+			return([NSData dataWithBytes:frame length:frameLength]);
+		}
+		hexLines:^NSData*(uint32_t* outAddress)
 		{
-			NSURL* docURL = [NSURL fileURLWithPath:@"temp.hex" relativeToURL:tempDirectoryURL];
-			if ([self exportHexFile:docURL])
+			char		line[StorageAccess::kMaxHexLineSize];
+			uint32_t	address = 0;
+			size_t		lineLength = StorageAccess::GetInstance()->GetNextHexRecord(*cursor, line, address);
+			if (lineLength == 0)
 			{
-				[self.fatFsSerialViewController sendHexFile:docURL];
+				return(nil);
 			}
-			[[NSFileManager defaultManager] removeItemAtURL:tempDirectoryURL error:&error];
-			if (error)
+			if (!cursor->done)
 			{
-				[self.fatFsSerialViewController postErrorString:error.localizedDescription];
+				*outAddress = address;
 			}
+			return([NSData dataWithBytes:line length:lineLength]);
 		}
-	}
+		maxLineLength:kHexProfiles[eHexProfileATmegaSerial].maxLineLength];
 }
 
 /******************************* stopFatFsSend ********************************/
+/*
+*	Action of the Stop button.  Cancels the running job, if any, otherwise
+*	stops sending.
+*/
 - (IBAction)stopFatFsSend:(id)sender
 {
-	[self.fatFsSerialViewController stop];
+	if (self.jobRunning)
+	{
+		StorageAccess::GetInstance()->CancelJob();
+	} else
+	{
+		[self.fatFsSerialViewController stop];
+	}
+}
+
+/******************************** canStartJob *********************************/
+/*
+*	Jobs and serial sends both use the StorageAccess image, and a send reads
+*	it from the main thread for as long as the session lasts.  Only one of
+*	them may run at a time.
+*/
+- (BOOL)canStartJob
+{
+	BOOL	canStart = NO;
+	if (self.jobRunning)
+	{
+		[self.fatFsSerialViewController postWarningString:@"Wait for the current job to finish, or stop it"];
+	} else if (self.fatFsSerialViewController.serialPortSession)
+	{
+		[self.fatFsSerialViewController postWarningString:@"Wait for the current send to finish, or stop it"];
+	} else
+	{
+		canStart = YES;
+	}
+	return(canStart);
+}
+
+/********************************** runJob ************************************/
+/*
+*	Runs inWork, building the FS and/or exporting it, on a worker thread so
+*	the UI stays responsive on large volumes.  While it runs, the serial
+*	progress bar shows its progress and the Stop button cancels it.  The
+*	build reads a copy of the root files, so the table may be edited.
+*	inCompletion is called on the main thread with inWork's result, NO if the
+*	job was cancelled.  inWork may post to the log but must not touch any
+*	other UI.
+*/
+- (void)runJob:(NSString*)inName work:(BOOL (^)(void))inWork completion:(void (^)(BOOL inSuccess))inCompletion
+{
+	StorageAccess*	storageAccess = StorageAccess::GetInstance();
+	storageAccess->BeginJob();
+	self.jobRunning = YES;
+	self.buildFiles = [NSArray arrayWithArray:self.fatFsTableViewController.rootFiles];
+	self.buildBytes = 0;
+	self.buildSeconds = 0;
+	self.jobTimer = [NSTimer scheduledTimerWithTimeInterval:0.1 target:self selector:@selector(updateJobProgress:) userInfo:nil repeats:YES];
+	CFAbsoluteTime	startTime = CFAbsoluteTimeGetCurrent();
+	dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+		BOOL	success = inWork();
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[self.jobTimer invalidate];
+			self.jobTimer = nil;
+			self.jobRunning = NO;
+			self.buildFiles = nil;
+			BOOL	cancelled = storageAccess->JobCancelled();
+			if (cancelled)
+			{
+				[self.fatFsSerialViewController postWarningString:[NSString stringWithFormat:@"%@ stopped by user", inName]];
+			} else
+			{
+				[self.fatFsSerialViewController postInfoString:[NSString stringWithFormat:@"%@ took %.2f seconds, %.2f building the FS",
+					inName, CFAbsoluteTimeGetCurrent() - startTime, self.buildSeconds]];
+			}
+			// Show the number of blocks in the current FS in the progress bar.
+			[self.fatFsSerialViewController fatFsCreated:storageAccess->GetBlockSize() blockCount:storageAccess->GetHighestBlockIndex() +1];
+			inCompletion(success && !cancelled);
+		});
+	});
+}
+
+/***************************** updateJobProgress ******************************/
+- (void)updateJobProgress:(NSTimer*)inTimer
+{
+	SJobProgress	progress;
+	StorageAccess::GetInstance()->GetJobProgress(progress);
+	FatFsSerialViewController*	serialViewController = self.fatFsSerialViewController;
+	if (progress.blocksToExport)
+	{
+		serialViewController.progressMax = progress.blocksToExport;
+		serialViewController.progressValue = progress.blocksExported;
+		serialViewController.progressText = [NSString stringWithFormat:@"Exported %llu of %llu blocks, %.1f MB",
+			progress.blocksExported, progress.blocksToExport, progress.bytesWritten / 1048576.0];
+	} else
+	{
+		uint64_t	buildBytes = self.buildBytes;
+		serialViewController.progressMax = buildBytes ? buildBytes : 1;
+		// Tuning adds the files several times
+		serialViewController.progressValue = progress.bytesAdded < buildBytes ? progress.bytesAdded : buildBytes;
+		serialViewController.progressText = [NSString stringWithFormat:@"Building: %u files added, %.1f MB",
+			progress.filesAdded, progress.bytesAdded / 1048576.0];
+	}
+}
+
+/******************************** beginExport *********************************/
+/*
+*	Creates the FS, unless exporting an imported image.  When exporting a
+*	delta, the block map is then replaced by the units of inDeltaUnitSize
+*	bytes that differ from the baseline, and the units are logged.  The
+*	exporter calls EndDelta when done.
+*/
+- (BOOL)beginExport:(uint32_t)inDeltaUnitSize
+{
+	BOOL	success = self.exportImportedImage || [self buildFatFs];
+	if (success &&
+		self.exportDelta)
+	{
+		SDeltaSummary	summary;
+		success = StorageAccess::GetInstance()->BeginDelta(inDeltaUnitSize, summary);
+		if (success)
+		{
+			NSMutableString*	report = [NSMutableString stringWithFormat:@"Delta: %zu of %u erase units of %u bytes differ, %u blocks",
+				summary.units.size(), summary.unitCount, summary.unitSize, summary.blockCount];
+			const size_t	kMaxUnitsListed = 32;
+			for (size_t i = 0; i < summary.units.size() && i < kMaxUnitsListed; i++)
+			{
+				[report appendFormat:i ? @", 0x%X" : @": 0x%X", summary.units[i] * summary.unitSize];
+			}
+			if (summary.units.size() > kMaxUnitsListed)
+			{
+				[report appendString:@"…"];
+			}
+			[self.fatFsSerialViewController postInfoString:report];
+		} else
+		{
+			[self.fatFsSerialViewController postErrorString:@"Unable to create the delta, the baseline's block size doesn't match"];
+		}
+	}
+	return(success);
 }
 
 /******************************* exportHexFile ********************************/
 - (BOOL)exportHexFile:(NSURL*)inDocURL
+{
+	NSInteger	profile = ((NSNumber*)[[NSUserDefaults standardUserDefaults] objectForKey:@"hexProfile"]).integerValue;
+	return([self exportHexFile:inDocURL profile:profile]);
+}
+
+/******************************* exportHexFile ********************************/
+- (BOOL)exportHexFile:(NSURL*)inDocURL profile:(NSInteger)inProfile
 {
 	BOOL	success = NO;
 	if (inDocURL)
 	{
-		if ([self createFatFs])
+		if ([self beginExport:kLoaderEraseBlockSize])
 		{
+			if (inProfile < eHexProfileATmegaSerial ||
+				inProfile > eHexProfileGeneric)
+			{
+				inProfile = eHexProfileATmegaSerial;
+			}
+			StorageAccess::GetInstance()->SetHexRecordFormat(kHexProfiles[inProfile].recordLength,
+														kHexProfiles[inProfile].recordBoundary,
+														kHexProfiles[inProfile].nullRuns);
 			char*	path = [self allocUTF8StrFor:inDocURL.path];
 			success = StorageAccess::GetInstance()->SaveToHexFile(path);
 			delete [] path;
+			StorageAccess::GetInstance()->EndDelta();
 		}
 	}
 	return(success);
 }
 
 /****************************** exportBinaryFile ******************************/
+/*
+*	A delta can't be exported as fimg, see StorageAccess::Export.
+*	exportFatFs disables fimg for a delta, so this is only a backstop.
+*/
 - (BOOL)exportBinaryFile:(NSURL*)inDocURL
 {
 	BOOL	success = NO;
-	if (inDocURL)
+	if (self.exportDelta)
+	{
+		[self.fatFsSerialViewController postErrorString:@"A delta can't be exported as fimg, export it as hex or sfimg"];
+	} else if (inDocURL)
 	{
-		if ([self createFatFs])
+		if ([self beginExport:StorageAccess::GetInstance()->GetEraseUnitSize()])
 		{
 			char*	path = [self allocUTF8StrFor:inDocURL.path];
 			success = StorageAccess::GetInstance()->SaveToFile(path);
 			delete [] path;
+			StorageAccess::GetInstance()->EndDelta();
+		}
+	}
+	return(success);
+}
+
+/****************************** exportSparseFile ******************************/
+- (BOOL)exportSparseFile:(NSURL*)inDocURL
+{
+	BOOL	success = NO;
+	if (inDocURL)
+	{
+		if ([self beginExport:StorageAccess::GetInstance()->GetEraseUnitSize()])
+		{
+			char*	path = [self allocUTF8StrFor:inDocURL.path];
+			success = StorageAccess::GetInstance()->SaveToSparseFile(path);
+			delete [] path;
+			StorageAccess::GetInstance()->EndDelta();
 		}
 	}
 	return(success);
 }
 
 /****************************** changeFormat **********************************/
+/*
+*	Action of the format and compression popups.  Sets the save panel's file
+*	type from both.  A compressed file keeps the format's extension, e.g.
+*	Untitled.hex.gz, so it can be identified when it's imported.
+*/
 - (IBAction)changeFormat:(id)sender
 {
-	NSPopUpButton* formatPopupBtn = sender;
-	NSUInteger typeIndex = formatPopupBtn.indexOfSelectedItem;
-	_savePanel.allowedFileTypes = @[[@[@"hex", @"fimg"] objectAtIndex:typeIndex]];
+	NSArray*	exportTypes = @[@"hex", @"fimg", @"sfimg"];
+	NSPopUpButton* formatPopupBtn = [_formatViewController.view viewWithTag:2];
+	NSPopUpButton* compressionPopupBtn = [_formatViewController.view viewWithTag:3];
+	NSString*	fileType = [exportTypes objectAtIndex:formatPopupBtn.indexOfSelectedItem];
+	NSString*	name = _savePanel.nameFieldStringValue;
+	if ([name.pathExtension caseInsensitiveCompare:@"gz"] == NSOrderedSame)
+	{
+		name = name.stringByDeletingPathExtension;
+	}
+	if ([exportTypes containsObject:name.pathExtension.lowercaseString])
+	{
+		name = name.stringByDeletingPathExtension;
+	}
+	name = [name stringByAppendingPathExtension:fileType];
+	if (compressionPopupBtn.selectedTag)
+	{
+		_savePanel.allowedFileTypes = @[@"gz"];
+		_savePanel.nameFieldStringValue = [name stringByAppendingPathExtension:@"gz"];
+	} else
+	{
+		_savePanel.allowedFileTypes = @[fileType];
+		_savePanel.nameFieldStringValue = name;
+	}
+}
+
+/****************************** postExportStats *******************************/
+- (void)postExportStats:(NSURL*)inDocURL
+{
+	const SExportStats&	stats = StorageAccess::GetInstance()->GetExportStats();
+	NSString*	report;
+	if (stats.fileBytes != stats.dataBytes)
+	{
+		report = [NSString stringWithFormat:@"Exported %@: %llu bytes compressed to %llu (%.1f%%) in %.2f seconds",
+			inDocURL.lastPathComponent, stats.dataBytes, stats.fileBytes,
+			stats.dataBytes ? (stats.fileBytes * 100.0) / stats.dataBytes : 0, stats.seconds];
+	} else
+	{
+		report = [NSString stringWithFormat:@"Exported %@: %llu bytes in %.2f seconds",
+			inDocURL.lastPathComponent, stats.fileBytes, stats.seconds];
+	}
+	if (stats.crc)
+	{
+		report = [report stringByAppendingFormat:@", CRC-32 %08X", stats.crc];
+	}
+	[self.fatFsSerialViewController postInfoString:report];
+}
+
+/********************************* endExport **********************************/
+/*
+*	Called when an export started by exportFatFs is done or cancelled.
+*/
+- (void)endExport
+{
+	self.exportImportedImage = NO;
+	if (self.exportDelta)
+	{
+		self.exportDelta = NO;
+		StorageAccess::GetInstance()->ClearBaseline();
+	}
 }
 
 /******************************** exportFatFs *********************************/
 - (IBAction)exportFatFs:(id)sender
 {
+	if (![self canStartJob])
+	{
+		[self endExport];
+		return;
+	}
 	NSURL*	docURL = NULL;
 	NSData*	docURLBM = [[NSUserDefaults standardUserDefaults] objectForKey:@"docURLBM"];
 	if (docURLBM)
@@ -406,7 +1007,7 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 		_savePanel.directoryURL = baseURL;
 		_savePanel.accessoryView = _formatViewController.view;
 		NSString* lastExportType = [[NSUserDefaults standardUserDefaults] objectForKey:kLastExportTypeKey];
-		__block NSArray* exportTypes = @[@"hex", @"fimg"]; // << must match menu item order in popup button
+		__block NSArray* exportTypes = @[@"hex", @"fimg", @"sfimg"]; // << must match menu item order in popup button
 		__block NSURL* exportURL = nil;
 		NSPopUpButton* formatPopupBtn = [_formatViewController.view viewWithTag:2];
 		__block NSUInteger typeIndex = [exportTypes indexOfObject:lastExportType];
@@ -414,33 +1015,346 @@ NSString *const kLastExportTypeKey = @"lastExportType";
 		{
 			typeIndex = 0;
 		}
+		// fimg can't hold a delta, see StorageAccess::Export
+		formatPopupBtn.autoenablesItems = NO;
+		[formatPopupBtn itemAtIndex:1].enabled = !self.exportDelta;
+		if (self.exportDelta &&
+			typeIndex == 1)
+		{
+			typeIndex = 2;
+		}
 		[formatPopupBtn selectItemAtIndex:typeIndex];
-		_savePanel.allowedFileTypes = @[[exportTypes objectAtIndex:typeIndex]];
+		NSPopUpButton* compressionPopupBtn = [_formatViewController.view viewWithTag:3];
 		_savePanel.nameFieldStringValue = initialName;
+		[self changeFormat:formatPopupBtn];
 		[_savePanel beginSheetModalForWindow:self.window completionHandler:^(NSInteger result)
 		{
-			if (result == NSModalResponseOK)
+			if (result == NSModalResponseOK &&
+				[self canStartJob])
 			{
 				exportURL = _savePanel.URL;
 				typeIndex = formatPopupBtn.indexOfSelectedItem;
 				[[NSUserDefaults standardUserDefaults] setObject:[exportTypes objectAtIndex:typeIndex] forKey:kLastExportTypeKey];
 				[self.savePanel orderOut:nil];
 				[exportURL startAccessingSecurityScopedResource];
-				switch (typeIndex)
+				StorageAccess::GetInstance()->SetCompressionLevel((int)compressionPopupBtn.selectedTag);
+				StorageAccess::GetInstance()->SetImageRange((EImageRange)[[NSUserDefaults standardUserDefaults] integerForKey:@"exportRange"]);
+				StorageAccess::GetInstance()->SetAtomicSave([[NSUserDefaults standardUserDefaults] boolForKey:@"atomicSave"]);
+				StorageAccess::GetInstance()->SetSyncOnSave([[NSUserDefaults standardUserDefaults] boolForKey:@"syncOnSave"]);
+				BOOL	saveManifest = [[NSUserDefaults standardUserDefaults] boolForKey:@"exportManifest"];
+				StorageAccess::GetInstance()->SetComputeManifest(saveManifest);
+				[self runJob:@"Export" work:^BOOL{
+					switch (typeIndex)
+					{
+						case 0:
+							return([self exportHexFile:exportURL]);
+						case 1:
+							return([self exportBinaryFile:exportURL]);
+						case 2:
+							return([self exportSparseFile:exportURL]);
+					}
+					return(NO);
+				} completion:^(BOOL inSuccess) {
+					[exportURL stopAccessingSecurityScopedResource];
+					if (inSuccess)
+					{
+						[self postExportStats:exportURL];
+						if (saveManifest)
+						{
+							[self saveManifestFor:exportURL];
+						}
+					}
+					[self endExport];
+				}];
+			} else
+			{
+				[self endExport];
+			}
+		}];
+	}
+}
+
+/****************************** saveManifestFor *******************************/
+/*
+*	Saves the checksum manifest of the export at inExportURL.  The sandbox
+*	only allows writing the file chosen in the export panel, so the manifest
+*	location is confirmed with a second save panel, next to the export by
+*	default.
+*/
+- (void)saveManifestFor:(NSURL*)inExportURL
+{
+	NSSavePanel*	savePanel = [NSSavePanel savePanel];
+	if (savePanel)
+	{
+		savePanel.directoryURL = inExportURL.URLByDeletingLastPathComponent;
+		savePanel.allowedFileTypes = @[@"manifest"];
+		savePanel.nameFieldStringValue = [inExportURL.lastPathComponent stringByAppendingPathExtension:@"manifest"];
+		savePanel.message = @"Save the checksum manifest of the export";
+		[savePanel beginSheetModalForWindow:self.window completionHandler:^(NSInteger result)
+		{
+			if (result == NSModalResponseOK)
+			{
+				NSURL*	manifestURL = savePanel.URL;
+				[manifestURL startAccessingSecurityScopedResource];
+				char*	path = [self allocUTF8StrFor:manifestURL.path];
+				BOOL	success = StorageAccess::GetInstance()->SaveManifest(path);
+				delete [] path;
+				[manifestURL stopAccessingSecurityScopedResource];
+				if (!success)
+				{
+					[self.fatFsSerialViewController postErrorString:[NSString stringWithFormat:@"Unable to save %@", manifestURL.lastPathComponent]];
+				}
+			}
+		}];
+	}
+}
+
+/****************************** exportAllFormats ******************************/
+/*
+*	Exports the FS as hex, fimg and sfimg, plus the checksum manifest when
+*	that option is set, from a single build of the FS.  The files are named
+*	after the project.  The sandbox only allows writing files the user chose,
+*	so the folder is chosen rather than each file.  The export panel's hex
+*	target and compression settings are used.
+*/
+- (IBAction)exportAllFormats:(id)sender
+{
+	NSOpenPanel*	openPanel = [self canStartJob] ? [NSOpenPanel openPanel] : nil;
+	if (openPanel)
+	{
+		[openPanel setCanChooseDirectories:YES];
+		[openPanel setCanChooseFiles:NO];
+		[openPanel setCanCreateDirectories:YES];
+		[openPanel setAllowsMultipleSelection:NO];
+		openPanel.prompt = @"Export";
+		openPanel.message = @"Choose the folder to export the hex, fimg and sfimg files to";
+		[openPanel beginSheetModalForWindow:self.window completionHandler:^(NSInteger result)
+		{
+			if (result == NSModalResponseOK &&
+				openPanel.URLs.count == 1 &&
+				[self canStartJob])
+			{
+				[openPanel orderOut:nil];
+				NSURL*	folderURL = openPanel.URLs[0];
+				NSString*	name = self.archiveURL.path.length ? self.archiveURL.path.lastPathComponent.stringByDeletingPathExtension : @"Untitled";
+				NSString*	suffix = @"";
+				NSUserDefaults*	defaults = [NSUserDefaults standardUserDefaults];
+				int	compressionLevel = (int)[defaults integerForKey:@"exportCompression"];
+				if (compressionLevel)
 				{
-					case 0:
-						[self exportHexFile:exportURL];
-						break;
-					case 1:
-						[self exportBinaryFile:exportURL];
-						break;
+					suffix = @".gz";
 				}
-				[exportURL stopAccessingSecurityScopedResource];
+				NSURL*	hexURL = [folderURL URLByAppendingPathComponent:[name stringByAppendingFormat:@".hex%@", suffix]];
+				NSURL*	binaryURL = [folderURL URLByAppendingPathComponent:[name stringByAppendingFormat:@".fimg%@", suffix]];
+				NSURL*	sparseURL = [folderURL URLByAppendingPathComponent:[name stringByAppendingFormat:@".sfimg%@", suffix]];
+				NSURL*	manifestURL = [folderURL URLByAppendingPathComponent:[name stringByAppendingPathExtension:@"manifest"]];
+				BOOL	saveManifest = [defaults boolForKey:@"exportManifest"];
+				NSInteger	profile = [defaults integerForKey:@"hexProfile"];
+				if (profile < eHexProfileATmegaSerial ||
+					profile > eHexProfileGeneric)
+				{
+					profile = eHexProfileATmegaSerial;
+				}
+				StorageAccess*	storageAccess = StorageAccess::GetInstance();
+				storageAccess->SetHexRecordFormat(kHexProfiles[profile].recordLength,
+												kHexProfiles[profile].recordBoundary,
+												kHexProfiles[profile].nullRuns);
+				storageAccess->SetCompressionLevel(compressionLevel);
+				storageAccess->SetImageRange((EImageRange)[defaults integerForKey:@"exportRange"]);
+				storageAccess->SetAtomicSave([defaults boolForKey:@"atomicSave"]);
+				storageAccess->SetSyncOnSave([defaults boolForKey:@"syncOnSave"]);
+				storageAccess->SetComputeManifest(false);
+				[folderURL startAccessingSecurityScopedResource];
+				[self runJob:@"Export" work:^BOOL{
+					BOOL	success = [self buildFatFs];
+					if (success)
+					{
+						char*	hexPath = [self allocUTF8StrFor:hexURL.path];
+						char*	binaryPath = [self allocUTF8StrFor:binaryURL.path];
+						char*	sparsePath = [self allocUTF8StrFor:sparseURL.path];
+						char*	manifestPath = [self allocUTF8StrFor:manifestURL.path];
+						SExportSinks	sinks = {hexPath, binaryPath, sparsePath, saveManifest ? manifestPath : NULL};
+						success = storageAccess->Export(sinks);
+						delete [] hexPath;
+						delete [] binaryPath;
+						delete [] sparsePath;
+						delete [] manifestPath;
+					}
+					return(success);
+				} completion:^(BOOL inSuccess) {
+					[folderURL stopAccessingSecurityScopedResource];
+					if (inSuccess)
+					{
+						[self postExportStats:folderURL];
+					} else if (!storageAccess->JobCancelled())
+					{
+						[self.fatFsSerialViewController postErrorString:[NSString stringWithFormat:@"Unable to export %@ to %@", name, folderURL.lastPathComponent]];
+					}
+				}];
+			}
+		}];
+	}
+}
+
+/***************************** writeToImageFile *******************************/
+/*
+*	Writes the FS over an existing image file, see
+*	StorageAccess::WriteToDevice.  Only the used blocks are written, unless
+*	the panel's checkbox to zero the unused blocks is checked.  Each range
+*	written is read back and verified.  The app is sandboxed, and the
+*	sandbox only allows opening files the user chose in a panel.  Raw devices
+*	(/dev/rdisk*) are owned by root, so they can't be opened from here.
+*/
+- (IBAction)writeToImageFile:(id)sender
+{
+	NSOpenPanel*	openPanel = [self canStartJob] ? [NSOpenPanel openPanel] : nil;
+	if (openPanel)
+	{
+		[openPanel setCanChooseDirectories:NO];
+		[openPanel setCanChooseFiles:YES];
+		[openPanel setAllowsMultipleSelection:NO];
+		openPanel.prompt = @"Write";
+		openPanel.message = @"Choose the image file to write the FS over";
+		NSButton*	zeroUnusedBtn = [NSButton checkboxWithTitle:@"Zero the blocks the FS doesn't use" target:nil action:nil];
+		[zeroUnusedBtn bind:NSValueBinding toObject:[NSUserDefaultsController sharedUserDefaultsController]
+			withKeyPath:@"values.writeZeroUnused" options:nil];
+		openPanel.accessoryView = zeroUnusedBtn;
+		openPanel.accessoryViewDisclosed = YES;
+		[openPanel beginSheetModalForWindow:self.window completionHandler:^(NSInteger result)
+		{
+			if (result == NSModalResponseOK &&
+				openPanel.URLs.count == 1 &&
+				[self canStartJob])
+			{
+				[openPanel orderOut:nil];
+				NSURL*	imageURL = openPanel.URLs[0];
+				StorageAccess*	storageAccess = StorageAccess::GetInstance();
+				bool	zeroUnused = [[NSUserDefaults standardUserDefaults] boolForKey:@"writeZeroUnused"];
+				[imageURL startAccessingSecurityScopedResource];
+				[self runJob:@"Write" work:^BOOL{
+					BOOL	success = [self buildFatFs];
+					if (success)
+					{
+						char*	imagePath = [self allocUTF8StrFor:imageURL.path];
+						success = storageAccess->WriteToDevice(imagePath, zeroUnused, true);
+						delete [] imagePath;
+					}
+					return(success);
+				} completion:^(BOOL inSuccess) {
+					[imageURL stopAccessingSecurityScopedResource];
+					if (inSuccess)
+					{
+						[self.fatFsSerialViewController postInfoString:[NSString stringWithFormat:@"Wrote and verified %u blocks on %@%@",
+							storageAccess->GetUsedBlockCount(), imageURL.lastPathComponent, zeroUnused ? @", unused blocks zeroed" : @""]];
+					} else if (!storageAccess->JobCancelled())
+					{
+						[self.fatFsSerialViewController postErrorString:[NSString stringWithFormat:@"Unable to write or verify %@", imageURL.lastPathComponent]];
+					}
+				}];
 			}
 		}];
 	}
 }
 
+/******************************** convertImage ********************************/
+/*
+*	Loads an existing hex, binary or sparse image, then exports it using the export
+*	panel, e.g. to change the hex target or to convert between formats.  Any
+*	of the formats may be gzip compressed.
+*/
+- (IBAction)convertImage:(id)sender
+{
+	NSOpenPanel*	openPanel = [self canStartJob] ? [NSOpenPanel openPanel] : nil;
+	if (openPanel)
+	{
+		[openPanel setCanChooseDirectories:NO];
+		[openPanel setCanChooseFiles:YES];
+		[openPanel setAllowsMultipleSelection:NO];
+		openPanel.allowedFileTypes = @[@"hex", @"fimg", @"sfimg", @"gz"];
+		[openPanel beginSheetModalForWindow:self.window completionHandler:^(NSInteger result)
+		{
+			if (result == NSModalResponseOK)
+			{
+				NSArray* urls = [openPanel URLs];
+				if ([urls count] == 1 &&
+					[self canStartJob] &&
+					[self importImage:urls[0]])
+				{
+					[openPanel orderOut:nil];
+					self.exportImportedImage = YES;
+					[self exportFatFs:sender];
+				}
+			}
+		}];
+	}
+}
+
+/******************************** exportDelta *********************************/
+/*
+*	Loads the image last programmed into the target as the baseline, then
+*	exports only the erase units of the FS that differ from it using the
+*	export panel.
+*/
+- (IBAction)exportDelta:(id)sender
+{
+	NSOpenPanel*	openPanel = [self canStartJob] ? [NSOpenPanel openPanel] : nil;
+	if (openPanel)
+	{
+		[openPanel setCanChooseDirectories:NO];
+		[openPanel setCanChooseFiles:YES];
+		[openPanel setAllowsMultipleSelection:NO];
+		openPanel.allowedFileTypes = @[@"hex", @"fimg", @"sfimg", @"gz"];
+		openPanel.message = @"Choose the baseline image, the image the target was last programmed with";
+		[openPanel beginSheetModalForWindow:self.window completionHandler:^(NSInteger result)
+		{
+			if (result == NSModalResponseOK)
+			{
+				NSArray* urls = [openPanel URLs];
+				if ([urls count] == 1 &&
+					[self canStartJob])
+				{
+					NSURL*	baselineURL = urls[0];
+					[baselineURL startAccessingSecurityScopedResource];
+					char*	path = [self allocUTF8StrFor:baselineURL.path];
+					BOOL	success = StorageAccess::GetInstance()->LoadBaseline(path);
+					delete [] path;
+					[baselineURL stopAccessingSecurityScopedResource];
+					if (success)
+					{
+						[openPanel orderOut:nil];
+						self.exportDelta = YES;
+						[self exportFatFs:sender];
+					} else
+					{
+						[self.fatFsSerialViewController postErrorString:[NSString stringWithFormat:@"Unable to load %@, not a valid FAT volume image", baselineURL.lastPathComponent]];
+					}
+				}
+			}
+		}];
+	}
+}
+
+/******************************** importImage *********************************/
+- (BOOL)importImage:(NSURL*)inDocURL
+{
+	[inDocURL startAccessingSecurityScopedResource];
+	char*	path = [self allocUTF8StrFor:inDocURL.path];
+	self.builtInputs = nil;	// The FS is replaced, even if the load fails
+	BOOL	success = StorageAccess::GetInstance()->LoadFromImageFile(path);
+	delete [] path;
+	[inDocURL stopAccessingSecurityScopedResource];
+	if (success)
+	{
+		[self.fatFsSerialViewController postInfoString:[NSString stringWithFormat:@"Image loaded: %u blocks of %u bytes used, highest block %u",
+			StorageAccess::GetInstance()->GetUsedBlockCount(), StorageAccess::GetInstance()->GetBlockSize(),
+			StorageAccess::GetInstance()->GetHighestBlockIndex()]];
+	} else
+	{
+		[self.fatFsSerialViewController postErrorString:[NSString stringWithFormat:@"Unable to load %@, not a valid FAT volume image", inDocURL.lastPathComponent]];
+	}
+	return(success);
+}
+
 /********************************* saveas *************************************/
 - (IBAction)saveas:(id)sender
 {
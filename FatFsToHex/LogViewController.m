@@ -96,6 +96,14 @@
 */
 - (LogViewController*)postErrorString:(NSString*)inString
 {
+	if (![NSThread isMainThread])
+	{
+		// The text view is only updated on the main thread, see post
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[self postErrorString:inString];
+		});
+		return(self);
+	}
 	[[[[[[[[self setColor:self.redColor] appendString:@"["] appendDate] appendString:@"] Error:"] setColor:self.blackColor] appendFormat:@"   %@", inString] appendNewLine] post];
 	return(self);
 }
@@ -107,6 +115,14 @@
 */
 - (LogViewController*)postWarningString:(NSString*)inString
 {
+	if (![NSThread isMainThread])
+	{
+		// The text view is only updated on the main thread, see post
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[self postWarningString:inString];
+		});
+		return(self);
+	}
 	[[[[[[[[self setColor:self.yellowColor] appendString:@"["] appendDate] appendString:@"] Warning:"] setColor:self.blackColor] appendFormat:@"   %@", inString] appendNewLine] post];
 	return(self);
 }
@@ -118,6 +134,14 @@
 */
 - (LogViewController*)postInfoString:(NSString*)inString
 {
+	if (![NSThread isMainThread])
+	{
+		// The text view is only updated on the main thread, see post
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[self postInfoString:inString];
+		});
+		return(self);
+	}
 	[[[[[[[[self setColor:self.greenColor] appendString:@"["] appendDate] appendString:@"]"] setColor:self.blackColor] appendFormat:@"   %@", inString] appendNewLine] post];
 	return(self);
 }
@@ -29,14 +29,38 @@
 
 #import "SerialPortIOSession.h"
 
+/*
+*	Returns the next hex line to send, or nil when there are no more lines.
+*	*outAddress is set to the target address of the line's data.
+*/
+typedef NSData* (^HexLineSource)(uint32_t* outAddress);
+
 @interface SendHexIOSession : SerialPortIOSession
 
-@property (nonatomic) NSUInteger offset;
 @property (nonatomic) BOOL eraseBeforeWrite;
 @property (nonatomic) uint32_t currentAddress;
+@property (nonatomic) NSUInteger maxLineLength;	// 0 = no limit
+@property (nonatomic, copy) HexLineSource lineSource;
+/*
+*	When pipelined, up to the loader's advertised line credit (window) of lines
+*	are kept in flight rather than one line per '*'.  Loaders that don't
+*	answer the pipelined mode command are sent one line at a time.
+*/
+@property (nonatomic) BOOL pipelined;
+@property (nonatomic) NSUInteger window;
+@property (nonatomic) NSUInteger maxRetries;	// Resends after a loader error
+// Totals for the transfer summary, including resent lines
+@property (nonatomic, readonly) uint64_t bytesSent;
+@property (nonatomic, readonly) NSTimeInterval seconds;	// From begin to the last '*'
+@property (nonatomic, readonly) BOOL completed;	// Every line was acknowledged
 
-- (instancetype)initWithData:(NSData *)inData port:(ORSSerialPort *)inPort;
+- (instancetype)initWithLineSource:(HexLineSource)inLineSource port:(ORSSerialPort *)inPort;
 - (void)begin;
 - (NSData*)didReceiveData:(NSData *)inData;
 
+// Overridden by sessions sending something other than hex lines
+- (uint8_t)modeCommand;
+- (void)fallBack;
+- (BOOL)lineStartsSegment:(NSData*)inLine;
+
 @end
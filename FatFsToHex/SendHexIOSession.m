@@ -30,15 +30,62 @@
 #import <Cocoa/Cocoa.h>
 #import "SendHexIOSession.h"
 
+enum ESendHexState
+{
+	eAwaitingCredit,	// Sent W/w, waiting for the loader's line credit
+	eAwaitingModeAck,	// Sent the mode command, waiting for the first '*'
+	eSending,			// Each '*' acknowledges the oldest line in flight
+	eReadingError		// Reading a '?' error message up to its newline
+};
+
+/*
+*	Pipelined mode command timeout before falling back to H/h, and the time
+*	given the loader to flush its serial buffer after reporting an error.
+*/
+static const double		kCreditTimeout = 2.0;
+static const double		kErrorFlushDelay = 1.5;
+static const NSUInteger	kMaxWindow = 9;
+
+@interface SendHexIOSession ()
+{
+	/*
+	*	Lines sent since the resume point.  Line indexes are counted from the
+	*	start of the session.  _linesBase is the index of _sentLines[0].
+	*/
+	NSMutableArray<NSData*>*	_sentLines;
+	NSMutableData*	_sentAddresses;		// uint32_t currentAddress of each line
+	NSMutableIndexSet*	_segmentStarts;	// Indexes of the ExLinAddr lines sent
+	NSUInteger	_linesBase;
+	NSUInteger	_linesSent;
+	NSUInteger	_linesAcked;
+	NSUInteger	_credits;
+	NSUInteger	_retries;
+	NSUInteger	_failedAtLine;
+	NSUInteger	_generation;
+	BOOL		_sourceExhausted;
+	NSTimeInterval	_beginTime;
+	uint8_t		_state;
+	NSData*		_messageData;
+}
+@end
+
 @implementation SendHexIOSession
 
-/****************************** initWithData **********************************/
-- (instancetype)initWithData:(NSData *)inData port:(ORSSerialPort *)inPort
+/*************************** initWithLineSource *******************************/
+/*
+*	Lines are pulled from inLineSource as the loader requests them rather than
+*	being scanned out of a complete hex file held in memory.
+*/
+- (instancetype)initWithLineSource:(HexLineSource)inLineSource port:(ORSSerialPort *)inPort
 {
-	self = [super initWithData:inData port:inPort];
+	self = [super initWithData:nil port:inPort];
 	if (self)
 	{
-		_offset = 0;
+		_lineSource = [inLineSource copy];
+		_maxLineLength = 0;
+		_pipelined = YES;
+		_window = 1;
+		_maxRetries = 3;
 	}
 	return(self);
 }
@@ -48,223 +95,346 @@
 {
 	[super begin];
 	self.currentAddress = 0;
-	uint8_t command = self.eraseBeforeWrite ? 'H':'h';
+	_sentLines = [NSMutableArray array];
+	_sentAddresses = [NSMutableData data];
+	_segmentStarts = [NSMutableIndexSet indexSet];
+	_linesBase = 0;
+	_linesSent = 0;
+	_linesAcked = 0;
+	_retries = 0;
+	_failedAtLine = 0;
+	_sourceExhausted = NO;
+	_bytesSent = 0;
+	_seconds = 0;
+	_completed = NO;
+	_beginTime = [NSDate timeIntervalSinceReferenceDate];
+	[self sendModeCommand];
+}
+
+/***************************** sendModeCommand ********************************/
+/*
+*	W/w asks the loader for its line credit, the number of lines it can have
+*	in flight without overrunning its serial buffer.  The loader answers with
+*	the credit as a single digit followed by the usual '*'.  A loader that
+*	doesn't know W/w ignores it, in which case H/h is sent after kCreditTimeout
+*	and lines are sent one at a time.
+*/
+- (void)sendModeCommand
+{
+	uint8_t command = [self modeCommand];
+	_credits = 0;
+	_generation++;
+	if (_pipelined)
+	{
+		_state = eAwaitingCredit;
+		NSUInteger	generation = _generation;
+		__weak SendHexIOSession*	weakSelf = self;
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kCreditTimeout * NSEC_PER_SEC)),
+			dispatch_get_main_queue(), ^(void){
+			[weakSelf creditTimedOut:generation];
+		});
+	} else
+	{
+		_state = eAwaitingModeAck;
+	}
 	[self.serialPort sendData:[NSData dataWithBytes:&command length:1]];
 }
 
+/******************************** modeCommand *********************************/
+- (uint8_t)modeCommand
+{
+	if (_pipelined)
+	{
+		return(self.eraseBeforeWrite ? 'W':'w');
+	}
+	return(self.eraseBeforeWrite ? 'H':'h');
+}
+
+/********************************** fallBack **********************************/
+/*
+*	Called when the loader doesn't answer the mode command with a line credit.
+*/
+- (void)fallBack
+{
+	_pipelined = NO;
+	_window = 1;
+}
+
+/***************************** lineStartsSegment ******************************/
+/*
+*	Returns YES if inLine is the first line of a 64KB segment, i.e. an
+*	extended linear address record.  currentAddress is the line's address.
+*/
+- (BOOL)lineStartsSegment:(NSData*)inLine
+{
+	const uint8_t*	lineBytes = (const uint8_t*)inLine.bytes;
+	return(inLine.length > 8 &&
+		lineBytes[7] == '0' &&
+		lineBytes[8] == '4');
+}
+
+/****************************** creditTimedOut ********************************/
+- (void)creditTimedOut:(NSUInteger)inGeneration
+{
+	if (!self.isDone &&
+		inGeneration == _generation &&
+		_state == eAwaitingCredit)
+	{
+		[self fallBack];
+		[self sendModeCommand];
+	}
+}
+
 /***************************** didReceiveData *********************************/
 - (NSData*)didReceiveData:(NSData *)inData
 {
 	if (!self.isDone)
 	{
 		//fprintf(stderr, "%.*s\n", (int)inData.length, inData.bytes);
-		int	status = 0;
-		if (inData.length >= 1)
+		const uint8_t*	recievedData = inData.bytes;
+		NSUInteger	length = inData.length;
+		BOOL		acksOnly = length > 0;
+		
+		for (NSUInteger i = 0; i < length && !self.isDone; i++)
 		{
-			const uint8_t*	recievedData = inData.bytes;
-			NSUInteger	length = inData.length;
-			
-			for (NSUInteger i = 0; i < length && status >= 0; i++)
+			uint8_t	thisChar = recievedData[i];
+			if (thisChar != '*')
 			{
-				switch (recievedData[i])
-				{
-					case '*':	// Process next line request
-						status = 1;
-						continue;
-					case '=':	// Ignore erase block successful char
-					case '+':	// Ignore debug char
-					case '-':	// Ignore debug char
-						continue;
-					default:	// Some error occured or garbage char returned
-						status = -1;
-						self.done = YES;
-						break;
-				}
+				acksOnly = NO;
 			}
-		}
-		if (status == 1)
-		{
-			if (inData.length == 1)
+			if (_state == eReadingError)
 			{
-				inData = [NSData data];	// Don't need to see the '*'
+				if (thisChar == '\n')
+				{
+					[self errorMessageRead];
+				}
+				continue;
 			}
-			// Find the end of the current line.
-			const uint8_t* bytesStart = (const uint8_t*)self.data.bytes + _offset;
-			const uint8_t* bytes = bytesStart;
-			const uint8_t* bytesEnd =  (const uint8_t*)self.data.bytes + self.data.length;
-			if (bytes < bytesEnd)
+			switch (thisChar)
 			{
-				for (; bytes < bytesEnd; bytes++)
-				{
-					if (*bytes != '\n')
+				case '*':	// Line processed, or mode change successful
+					if (_state == eSending)
+					{
+						/*
+						*	Each '*' returns the credit of the oldest line in
+						*	flight.  Any '*' beyond the lines sent (e.g. the
+						*	"* success!" following the EOF) is ignored.
+						*/
+						if (_linesAcked < _linesSent)
+						{
+							_linesAcked++;
+							_credits++;
+							[self trimSentLines];
+						}
+					} else if (_state == eAwaitingModeAck)
 					{
+						_state = eSending;
+						_credits = _window;
+					}
+					[self sendLines];
+					continue;
+				case '=':	// Ignore erase block successful char
+				case '+':	// Ignore debug char
+				case '-':	// Ignore debug char
+					continue;
+				case '?':	// Error message follows
+					[self errorStarted];
+					continue;
+				default:
+					if (_state == eAwaitingCredit &&
+						thisChar >= '1' && thisChar <= '9')
+					{
+						_window = MIN((NSUInteger)(thisChar - '0'), kMaxWindow);
+						_state = eAwaitingModeAck;
 						continue;
 					}
+					// Garbage char returned
+					self.done = YES;
 					break;
-				}
-				NSRange	lineRange = NSMakeRange(_offset, (bytes - bytesStart) +1);
-				NSData*	lineData = [self.data subdataWithRange:lineRange];
-				//fprintf(stderr, "Sent %d bytes at offset %d\n%.*s\n", (int)lineData.length, (int)_offset, (int)lineData.length, lineData.bytes);
-				_offset += lineRange.length;
-				//fprintf(stderr, "lineRange.length = %d\n", (int)lineRange.length);
-				[self processHexLine:lineData];
-				[self.serialPort sendData:lineData];
-			} else
-			{
-				//fprintf(stderr, "done - bytes >= bytesEnd\n");
-				self.done = YES;
 			}
 		}
+		if (_messageData)
+		{
+			inData = _messageData;
+			_messageData = nil;
+		} else if (acksOnly)
+		{
+			inData = [NSData data];	// Don't need to see the '*'s
+		}
 	}
 	return(inData);
 }
 
-/***************************** processHexLine *********************************/
+/********************************* sendLines **********************************/
 /*
-*	Used to update a progress bar by extracting the current address of the line
-*	being sent.
+*	Sends lines until the credit is used up.  The session is done once the
+*	source is exhausted and every line sent has been acknowledged.
 */
-- (void)processHexLine:(NSData *)inLineData
+- (void)sendLines
 {
-	enum EIntelHexRecordType
-	{
-		eRecordTypeData,		// 0
-		eRecordTypeEOF,			// 1
-		eRecordTypeExSegAddr,	// 2
-		eRecordTypeStSegAddr,	// 3
-		eRecordTypeExLinAddr,	// 4
-		eRecordTypeStLinAddr	// 5
-	};
-	enum EIntelHexStatus
+	while (_state == eSending &&
+		!self.isDone)
 	{
-		eProcessing,
-		eDone,
-		eError
-	};
-	enum EIntelHexLineState
-	{
-		// Start code   Byte count   Address H/L   Record type   Data   Checksum
-		eGetByteCount,
-		eGetAddressH,
-		eGetAddressL,
-		eGetRecordType,
-		eGetData,
-		eGetChecksum
-	};
+		if (_credits == 0)
+		{
+			break;
+		}
+		NSData*	lineData = [self nextLine];
+		if (lineData == nil)
+		{
+			if (_linesAcked == _linesSent)
+			{
+				//fprintf(stderr, "done - no more lines\n");
+				_seconds = [NSDate timeIntervalSinceReferenceDate] - _beginTime;
+				_completed = YES;
+				self.done = YES;
+			}
+			break;
+		}
+		/*
+		*	If the line won't fit in the loader's line buffer THEN
+		*	stop the loader rather than have it fail mid-line.
+		*/
+		if (_maxLineLength &&
+			lineData.length > _maxLineLength)
+		{
+			uint8_t command = 'S';
+			[self.serialPort sendData:[NSData dataWithBytes:&command length:1]];
+			self.done = YES;
+			_messageData = [[NSString stringWithFormat:@"\n?Hex line of %d bytes exceeds the target's maximum of %d\n",
+						(int)lineData.length, (int)_maxLineLength] dataUsingEncoding:NSUTF8StringEncoding];
+			break;
+		}
+		_linesSent++;
+		_credits--;
+		_bytesSent += lineData.length;
+		[self.serialPort sendData:lineData];
+	}
+}
 
-	const uint8_t* bytePtr = (const uint8_t*)inLineData.bytes;
-	const uint8_t* bytesEnd =  (const uint8_t*)inLineData.bytes + inLineData.length;
-	uint8_t	    thisChar;
-	uint8_t		thisByte = 0;
-	uint8_t		state = 0;
-	uint8_t		status = eProcessing;
-	uint32_t	byteCount = 0;
-	uint32_t	addressOffset = 0;
-	uint32_t	baseAddress = self.currentAddress & 0xFFFF0000;
-	uint8_t		recordType = eRecordTypeData;
-	uint8_t		checksum = 0;
-	uint8_t		hiLow = 1;
-	uint32_t	dataIndex = 0;
-	
-	if (bytePtr < bytesEnd)
+/********************************* nextLine ***********************************/
+/*
+*	Returns the next line to send, replaying the lines kept since the resume
+*	point before pulling new lines from the source.  currentAddress is updated
+*	for the progress bar.
+*/
+- (NSData*)nextLine
+{
+	NSData*	lineData = nil;
+	NSUInteger	sentIndex = _linesSent - _linesBase;
+	if (sentIndex < _sentLines.count)
 	{
-		thisChar = *(bytePtr++);
-		if (thisChar != ':')
-		{
-			status = eError;
-		} else
+		lineData = _sentLines[sentIndex];
+		self.currentAddress = ((const uint32_t*)_sentAddresses.bytes)[sentIndex];
+	} else if (!_sourceExhausted)
+	{
+		uint32_t	lineAddress = self.currentAddress;
+		lineData = _lineSource(&lineAddress);
+		if (lineData)
 		{
-			while(status == eProcessing &&
-					bytePtr < bytesEnd)
+			self.currentAddress = lineAddress;
+			/*
+			*	Keep the line in case the loader reports an error and the
+			*	segment needs to be resent.
+			*/
+			if ([self lineStartsSegment:lineData])
 			{
-				thisChar = *(bytePtr++);
-				hiLow++;	// nibble toggle
-				/*
-				*	If this is the high nibble THEN
-				*	process the complete byte
-				*/
-				if (hiLow & 1)
-				{
-					thisByte = (thisByte << 4) + (thisChar <= '9' ? (thisChar - '0') : (thisChar - ('A' - 10)));
-					checksum += thisByte;
-					switch (state)
-					{
-						case eGetByteCount:
-						{
-							byteCount = thisByte;
-							addressOffset = 0;
-							state++;
-							continue;
-						}
-						case eGetAddressH:
-						case eGetAddressL:
-							addressOffset = (addressOffset << 8) + thisByte;
-							state++;
-							continue;
-						case eGetRecordType:
-							recordType = thisByte;
-							state++;
-							dataIndex = 0;
-							if (recordType == eRecordTypeData)
-							{
-								continue;
-							} else if (recordType == eRecordTypeExLinAddr)
-							{
-								addressOffset = 0;	// The data contains the address
-								if (byteCount != 2)
-								{
-									// byteCount for RecordTypeExLinAddr not 2
-									status = eError;
-								}
-							} else if (recordType == eRecordTypeEOF)
-							{
-								state++;	// Skip eGetData
-							} else
-							{
-								// Unsupported type
-								status = eError;
-							}
-							continue;
-						case eGetData:
-							if (recordType == eRecordTypeExLinAddr)
-							{
-								addressOffset = (addressOffset << 8) + thisByte;
-							}
-							dataIndex++;
-							if (dataIndex < byteCount)
-							{
-								continue;
-							}
-							state++;
-							continue;
-						case eGetChecksum:
-							if (checksum == 0)
-							{
-								state = 0;
-								if (recordType == eRecordTypeExLinAddr)
-								{
-									baseAddress = addressOffset << 16;
-								}
-								status = eDone;
-								break;
-							}
-							// Checksum error
-							status = eError;
-							break;
-					}
-					break;
-				} else
-				{
-					thisByte = thisChar <= '9' ? (thisChar - '0') : (thisChar - ('A' - 10));
-				}
+				[_segmentStarts addIndex:_linesSent];
 			}
+			uint32_t	address = self.currentAddress;
+			[_sentLines addObject:lineData];
+			[_sentAddresses appendBytes:&address length:sizeof(uint32_t)];
+		} else
+		{
+			_sourceExhausted = YES;
+		}
+	}
+	return(lineData);
+}
+
+/******************************* trimSentLines ********************************/
+/*
+*	The resume point is the start of the latest 64KB segment (its ExLinAddr
+*	line) with at least one record after it processed by the loader.  At that
+*	point the loader has written every block of the previous segments, so
+*	resending from there, including re-erasing the segment's 64KB block,
+*	rebuilds everything the loader lost when it abandoned the session.
+*/
+- (void)trimSentLines
+{
+	if (_linesAcked >= 2)
+	{
+		NSUInteger	resumeLine = [_segmentStarts indexLessThanIndex:_linesAcked - 1];
+		if (resumeLine != NSNotFound &&
+			resumeLine > _linesBase)
+		{
+			[_sentLines removeObjectsInRange:NSMakeRange(0, resumeLine - _linesBase)];
+			[_sentAddresses replaceBytesInRange:NSMakeRange(0, (resumeLine - _linesBase) * sizeof(uint32_t))
+				withBytes:NULL length:0];
+			[_segmentStarts removeIndexesInRange:NSMakeRange(0, resumeLine)];
+			_linesBase = resumeLine;
 		}
 	}
-	if (status == eDone &&
-		recordType != eRecordTypeEOF)
+}
+
+/******************************* errorStarted *********************************/
+/*
+*	The loader abandons the session on any error.  Lines still in flight are
+*	discarded by the loader when it flushes its serial buffer.
+*/
+- (void)errorStarted
+{
+	_state = eReadingError;
+	_generation++;
+	/*
+	*	If progress was made since the last error THEN
+	*	start counting retries again.
+	*/
+	if (_linesAcked > _failedAtLine)
+	{
+		_retries = 0;
+		_failedAtLine = _linesAcked;
+	}
+	_retries++;
+}
+
+/****************************** errorMessageRead ******************************/
+/*
+*	Called at the end of each line of an error message.  Some errors are
+*	reported as more than one line, so the resend is scheduled relative to the
+*	last line received.
+*/
+- (void)errorMessageRead
+{
+	if (self.wasStopped ||
+		_retries > _maxRetries)
+	{
+		self.stoppedDueToError = YES;
+		self.done = YES;
+	} else
+	{
+		NSUInteger	generation = ++_generation;
+		__weak SendHexIOSession*	weakSelf = self;
+		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kErrorFlushDelay * NSEC_PER_SEC)),
+			dispatch_get_main_queue(), ^(void){
+			[weakSelf resendFromResumePoint:generation];
+		});
+	}
+}
+
+/*************************** resendFromResumePoint ****************************/
+- (void)resendFromResumePoint:(NSUInteger)inGeneration
+{
+	if (!self.isDone &&
+		inGeneration == _generation &&
+		_state == eReadingError)
 	{
-		//fprintf(stderr, "0x%X 0x%X\n", baseAddress, addressOffset);
-		self.currentAddress = baseAddress + addressOffset;
+		[self.delegate logWarningString:[NSString stringWithFormat:
+			@"Resending from line %d (retry %d of %d)",
+				(int)_linesBase + 1, (int)_retries, (int)_maxRetries]];
+		_linesSent = _linesBase;
+		_linesAcked = _linesBase;
+		[self sendModeCommand];
 	}
 }
 
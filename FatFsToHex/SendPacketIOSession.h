@@ -0,0 +1,47 @@
+/*******************************************************************************
+	License
+	****************************************************************************
+	This program is free software; you can redistribute it
+	and/or modify it under the terms of the GNU General
+	Public License as published by the Free Software
+	Foundation; either version 3 of the License, or
+	(at your option) any later version.
+ 
+	This program is distributed in the hope that it will
+	be useful, but WITHOUT ANY WARRANTY; without even the
+	implied warranty of MERCHANTABILITY or FITNESS FOR A
+	PARTICULAR PURPOSE. See the GNU General Public
+	License for more details.
+ 
+	Licence can be viewed at
+	http://www.gnu.org/licenses/gpl-3.0.txt
+//
+	Please maintain this license information along with authorship
+	and copyright notices in any redistribution of this code
+*******************************************************************************/
+//
+//  SendPacketIOSession.h
+//  FatFsToHex
+//
+//  Copyright © 2018 Jon Mackey. All rights reserved.
+//
+
+#import "SendHexIOSession.h"
+
+/*
+*	Sends COBS framed binary block packets (see
+*	StorageAccess::GetNextBlockPacket) rather than hex lines.  Each packet is
+*	acknowledged with a '*' as a hex line is.  The packets are negotiated with
+*	B/b.  A loader that doesn't answer B/b with its packet credit is sent hex
+*	lines from inHexLineSource instead.
+*/
+@interface SendPacketIOSession : SendHexIOSession
+
+@property (nonatomic) BOOL sendingPackets;
+
+- (instancetype)initWithPacketSource:(HexLineSource)inPacketSource
+						hexLineSource:(HexLineSource)inHexLineSource
+								port:(ORSSerialPort *)inPort;
+- (void)begin;
+
+@end
@@ -0,0 +1,114 @@
+/*******************************************************************************
+	License
+	****************************************************************************
+	This program is free software; you can redistribute it
+	and/or modify it under the terms of the GNU General
+	Public License as published by the Free Software
+	Foundation; either version 3 of the License, or
+	(at your option) any later version.
+ 
+	This program is distributed in the hope that it will
+	be useful, but WITHOUT ANY WARRANTY; without even the
+	implied warranty of MERCHANTABILITY or FITNESS FOR A
+	PARTICULAR PURPOSE. See the GNU General Public
+	License for more details.
+ 
+	Licence can be viewed at
+	http://www.gnu.org/licenses/gpl-3.0.txt
+//
+	Please maintain this license information along with authorship
+	and copyright notices in any redistribution of this code
+*******************************************************************************/
+//
+//  SendPacketIOSession.m
+//  FatFsToHex
+//
+//  Copyright © 2018 Jon Mackey. All rights reserved.
+//
+
+#import <Cocoa/Cocoa.h>
+#import "SendPacketIOSession.h"
+
+@implementation SendPacketIOSession
+{
+	HexLineSource	_hexLineSource;
+	NSUInteger		_hexMaxLineLength;
+	uint32_t		_currentSegment;	// 64KB segment of the last packet
+}
+
+/*************************** initWithPacketSource *****************************/
+- (instancetype)initWithPacketSource:(HexLineSource)inPacketSource
+						hexLineSource:(HexLineSource)inHexLineSource
+								port:(ORSSerialPort *)inPort
+{
+	self = [super initWithLineSource:inPacketSource port:inPort];
+	if (self)
+	{
+		_hexLineSource = [inHexLineSource copy];
+		_sendingPackets = YES;
+	}
+	return(self);
+}
+
+/********************************** begin *************************************/
+- (void)begin
+{
+	_currentSegment = 0xFFFFFFFF;
+	if (_sendingPackets)
+	{
+		/*
+		*	The line length limit is that of the hex lines, packets are
+		*	always within the loader's limit.
+		*/
+		_hexMaxLineLength = self.maxLineLength;
+		self.maxLineLength = 0;
+	}
+	[super begin];
+}
+
+/******************************** modeCommand *********************************/
+- (uint8_t)modeCommand
+{
+	if (_sendingPackets)
+	{
+		return(self.eraseBeforeWrite ? 'B':'b');
+	}
+	return([super modeCommand]);
+}
+
+/********************************** fallBack **********************************/
+/*
+*	The loader doesn't know B/b, try hex lines.
+*/
+- (void)fallBack
+{
+	if (_sendingPackets)
+	{
+		_sendingPackets = NO;
+		self.lineSource = _hexLineSource;
+		self.maxLineLength = _hexMaxLineLength;
+		[self.delegate logInfoString:@"The loader doesn't accept binary packets, sending hex"];
+	} else
+	{
+		[super fallBack];
+	}
+}
+
+/***************************** lineStartsSegment ******************************/
+/*
+*	Packets carry no address records, so a packet starts a segment when its
+*	address is in a different 64KB segment than the previous packet's.
+*/
+- (BOOL)lineStartsSegment:(NSData*)inLine
+{
+	if (_sendingPackets)
+	{
+		uint32_t	segment = self.currentAddress >> 16;
+		BOOL	startsSegment = segment != _currentSegment;
+		_currentSegment = segment;
+		return(startsSegment);
+	}
+	return([super lineStartsSegment:inLine]);
+}
+
+@end
@@ -32,14 +32,199 @@
 
 #include <stdio.h>
 #include <map>
+#include <vector>
+#include <string>
+#include <atomic>
 #include "FatFs/diskio.h"
 #include "FatFs/ff.h"
 
+struct z_stream_s;
+struct iovec;
 typedef std::map<uint32_t, uint8_t*>	BlockMap;
+// The first block of a 64KB hex file segment, and its ordinal within the map
+struct SHexSegment
+{
+	BlockMap::iterator	begin;
+	uint32_t			firstBlock;
+};
+
+/*
+*	Sparse image (.sfimg) layout.  All fields are little endian:
+*	SSparseImageHeader, extentCount SSparseExtents, then starting at dataOffset
+*	(a multiple of blockSize) the blocks of each data extent in extent order.
+*/
+struct SSparseImageHeader
+{
+	char		magic[8];		// "FATFSSPX"
+	uint16_t	version;		// 1
+	uint16_t	headerSize;		// sizeof(SSparseImageHeader)
+	uint32_t	blockSize;
+	uint32_t	blockCount;		// GetImageBlockCount, highest used block + 1 or more
+	uint32_t	extentCount;
+	uint32_t	dataOffset;		// File offset of the first data extent
+	uint32_t	indexCrc;		// CRC-32 of the header (this field 0) and extents
+};
+
+enum ESparseExtentFlags
+{
+	eSparseExtentZero	= 1	// Null blocks, no data is stored
+};
+
+struct SSparseExtent
+{
+	uint32_t	startBlock;
+	uint32_t	blockCount;
+	uint32_t	flags;			// ESparseExtentFlags
+	uint32_t	crc;			// CRC-32 of the extent's blocks, 0 for zero extents
+};
+
+// Layout of hex records, see StorageAccess::SetHexRecordFormat
+struct SHexRecordFormat
+{
+	uint8_t		recordLength;	// Data bytes per hex record
+	uint32_t	recordBoundary;	// Records don't span this boundary (0 = block size)
+	bool		nullRuns;		// Write runs of null blocks as a single record
+};
+
+// State of the hex record generator, see StorageAccess::GetNextHexRecord
+struct SHexRecordCursor
+{
+	SHexRecordFormat	format;	// As set when the cursor began
+	uint32_t	blockIndex;		// Current or next block
+	uint32_t	upperAddress;	// Of the last extended linear address record
+	uint32_t	lineIndex;		// Next data record of the current block
+	bool		inBlock;
+	bool		blockHasData;
+	bool		done;			// The EOF record was returned
+	uint64_t	lineMap[FF_MAX_SS / 64];	// Data records of the current block
+};
+
+// State of the block packet generator, see StorageAccess::GetNextBlockPacket
+struct SBlockPacketCursor
+{
+	uint32_t	blockIndex;		// Current or next block
+	uint32_t	packetBlock;	// Next kPacketBlockSize part of the current block
+	bool		compress;		// Send data as compressed packets when smaller
+	bool		done;			// The end packet was returned
+};
+
+// Totals of the last export, see StorageAccess::GetExportStats
+struct SExportStats
+{
+	uint64_t	dataBytes;		// Bytes encoded, before compression
+	uint64_t	fileBytes;		// Bytes written to the file
+	double		seconds;		// From opening to closing the file
+	uint32_t	crc;			// CRC-32 of the file before compression, 0 for several files
+};
+
+/*
+*	Progress of the current build or export job, see StorageAccess::BeginJob.
+*	The counters are updated by the thread doing the work and may be read by
+*	any thread.
+*/
+struct SJobProgress
+{
+	uint32_t	filesAdded;		// To the FS
+	uint64_t	bytesAdded;		// Of the files added
+	uint64_t	blocksExported;
+	uint64_t	blocksToExport;	// Of the exports started
+	uint64_t	bytesWritten;	// To export files, after compression
+	bool		cancelled;
+};
+
+// Manifest entry of an erase unit, see StorageAccess::SaveManifest
+struct SManifestUnit
+{
+	uint32_t	unit;			// Index, the unit's address / unit size
+	uint32_t	blockCount;		// Used blocks in the unit
+	uint32_t	crc;			// CRC-32 of the unit, unused blocks as the manifest's fill
+};
+
+// Extent of binary and sparse images, must match the tags of the image size popup items
+enum EImageRange
+{
+	eImageRangeTrim,		// To the highest used block
+	eImageRangeEraseUnit,	// Rounded up to a whole erase unit
+	eImageRangeDevice		// The whole volume
+};
+
+// Files written by StorageAccess::Export, a NULL path skips the format
+struct SExportSinks
+{
+	const char*	hexPath;
+	const char*	binaryPath;		// fimg
+	const char*	sparsePath;		// sfimg
+	const char*	manifestPath;
+};
+
+// A file being written by an export, see StorageAccess::OpenOutputFile
+struct SOutputFile
+{
+	int				fd;
+	std::string		tempPath;		// Renamed to the export's path when done
+	z_stream_s*		deflateStream;	// gzip compressor, NULL when not compressed
+	uint8_t*		deflateBuffer;
+	double			startTime;
+	uint64_t		position;		// Offset of the next byte, before compression
+	uint32_t		crc;			// CRC-32 of the bytes before position
+	SExportStats	stats;
+};
+
+/*
+*	Writer state of each format of StorageAccess::Export.  Export makes a
+*	single pass over the blocks, handing each hex segment's lines to the hex
+*	sink and each run of consecutive blocks to the binary and sparse sinks.
+*/
+struct SHexSink
+{
+	SOutputFile				file;
+	std::vector<uint64_t>	lineMaps;	// Of every block, see ScanHexSegment
+	uint64_t				fileSize;
+};
+
+struct SBinarySink
+{
+	SOutputFile		file;
+	uint64_t		fileSize;
+	uint32_t		nextBlock;		// Index of the next block to write
+	struct iovec*	run;			// Uncompressed, blocks to write with one writev
+	int				runLength;
+	uint8_t*		staging;		// Compressed, blocks and zeros to deflate
+	size_t			stagedBytes;
+};
+
+struct SSparseSink
+{
+	SOutputFile		file;
+	uint64_t		fileSize;
+	std::vector<SSparseExtent>	extents;
+	size_t			extentIndex;	// Of the next block
+	uint32_t		extentBlock;	// Next block's index within its extent
+	uint8_t*		staging;
+	size_t			stagingSize;
+	size_t			stagedBytes;
+};
+
+// Result of StorageAccess::BeginDelta
+struct SDeltaSummary
+{
+	uint32_t				unitSize;	// Bytes per unit compared
+	uint32_t				unitCount;	// Units spanned by the image
+	uint32_t				blockCount;	// Blocks in the delta
+	std::vector<uint32_t>	units;		// Indexes of the units that differ
+};
 
 class StorageAccess
 {
 public:
+	// ':' + 255 data bytes + 5 header/checksum bytes as hex + '\n' + nul
+	static const size_t		kMaxHexLineSize = 1 + ((255 + 5) * 2) + 1 + 1;
+	// Block packets carry at most the loader's 512 byte block buffer
+	static const uint32_t	kPacketBlockSize = 512;
+	// Type + block index + offset + payload + CRC-16
+	static const size_t		kMaxPacketSize = 1 + 4 + 2 + kPacketBlockSize + 2;
+	// COBS encoded, a code byte per 254 bytes, plus the frame delimiter
+	static const size_t		kMaxPacketFrameSize = kMaxPacketSize + (kMaxPacketSize / 254) + 1 + 1;
 							StorageAccess(void);
 							~StorageAccess(void);
 	static void				Create(void);
@@ -73,11 +258,89 @@ public:
 								{return(mPageSize);}
 	uint32_t				GetVolumeSize(void) const
 								{return(mVolumeSize);}
+	uint32_t				GetUsedBlockCount(void) const
+								{return((uint32_t)mBlockMap.size());}
+	uint32_t				GetEraseUnitSize(void) const
+								{return(mPageSize > mBlockSize ? mPageSize : mBlockSize);}
+	uint32_t				GetEraseUnitCount(void) const;
+	bool					GetEraseUnitLayout(void) const
+								{return(mEraseUnitLayout);}
+	void					SetSmallFileBytes(
+								uint64_t				inSmallFileBytes)
+								{mSmallFileBytes = inSmallFileBytes;}
+	BYTE					GetFatType(void) const
+								{return(mFatFs.fs_type);}
+	uint32_t				GetClusterSize(void) const
+								{return(mFatFs.csize * mBlockSize);}
+	void					SetHexRecordFormat(
+								uint8_t					inRecordLength,
+								uint32_t				inRecordBoundary,
+								bool					inNullRuns = false);
+	void					SetCompressionLevel(
+								int						inLevel)
+								{mCompressionLevel = inLevel;}
+	void					SetImageRange(
+								EImageRange				inImageRange)
+								{mImageRange = inImageRange;}
+	void					SetAtomicSave(
+								bool					inAtomicSave)
+								{mAtomicSave = inAtomicSave;}
+	void					SetSyncOnSave(
+								bool					inSyncOnSave)
+								{mSyncOnSave = inSyncOnSave;}
+	uint32_t				GetImageBlockCount(void) const;
+	const SExportStats&		GetExportStats(void) const
+								{return(mExportStats);}
+	void					SetComputeManifest(
+								bool					inComputeManifest)
+								{mComputeManifest = inComputeManifest;}
+	uint32_t				GetManifestUnitSize(void) const;
+	bool					SaveManifest(
+								const char*				inPath);
+	void					BeginHexRecords(
+								SHexRecordCursor&		outCursor) const;
+	size_t					GetNextHexRecord(
+								SHexRecordCursor&		ioCursor,
+								char*					outLine,
+								uint32_t&				outAddress);
+	void					BeginBlockPackets(
+								SBlockPacketCursor&		outCursor) const;
+	size_t					GetNextBlockPacket(
+								SBlockPacketCursor&		ioCursor,
+								uint8_t*				outFrame,
+								uint32_t&				outAddress);
 	bool					SaveToHexFile(
 								const char*				inPath);
 	bool					SaveToFile(
 								const char*				inPath);
-	bool					Format(void);
+	bool					SaveToSparseFile(
+								const char*				inPath);
+	bool					Export(
+								const SExportSinks&		inSinks);
+	bool					WriteToDevice(
+								const char*				inPath,
+								bool					inZeroUnused = false,
+								bool					inVerify = false);
+	bool					LoadFromSparseFile(
+								const char*				inPath);
+	bool					LoadFromHexFile(
+								const char*				inPath);
+	bool					LoadFromFile(
+								const char*				inPath);
+	bool					LoadFromImageFile(
+								const char*				inPath);
+	bool					LoadBaseline(
+								const char*				inPath);
+	void					ClearBaseline(void);
+	bool					BeginDelta(
+								uint32_t				inUnitSize,
+								SDeltaSummary&			outSummary);
+	void					EndDelta(void);
+	bool					Format(
+								BYTE					inFormatOptions = FM_ANY,
+								DWORD					inAllocUnitSize = 0);
+	bool					Compact(
+								uint32_t*				outClustersMoved = NULL);
 	bool					AddFile(
 								const char*				inSrcPath,
 								const char*				inDstPath,
@@ -86,16 +349,203 @@ public:
 								const char*				inDstPath,
 								char*					outDosName);
 	bool					Begin(void);
+	void					BeginJob(void);
+	void					CancelJob(void)
+								{mJobCancelled = true;}
+	bool					JobCancelled(void) const
+								{return(mJobCancelled);}
+	void					GetJobProgress(
+								SJobProgress&			outProgress) const;
 protected:
 	static StorageAccess*	sInstance;
 	uint32_t	mBlockSize;
 	uint32_t	mPageSize;
 	uint32_t	mVolumeSize;
+	bool		mEraseUnitLayout;
+	bool		mSyncOnSave;		// fsync exported files before closing them
+	bool		mAtomicSave;		// Write to a temp file, then rename into place
+	SHexRecordFormat	mHexFormat;	// Of exports and new hex record cursors
+	int			mCompressionLevel;	// gzip level of exported files, 0 = none
+	EImageRange	mImageRange;
+	SExportStats	mExportStats;
+	bool		mComputeManifest;	// Exports compute mManifestUnits
+	bool		mManifestComputed;	// mManifestUnits is of the last export
+	uint8_t		mManifestFill;		// Of the unused blocks in mManifestUnits
+	std::vector<SManifestUnit>	mManifestUnits;	// Of the last export
+	std::atomic<bool>		mJobCancelled;		// See CancelJob
+	std::atomic<uint32_t>	mJobFilesAdded;
+	std::atomic<uint64_t>	mJobBytesAdded;
+	std::atomic<uint64_t>	mJobBlocksExported;
+	std::atomic<uint64_t>	mJobBlocksToExport;
+	std::atomic<uint64_t>	mJobBytesWritten;
+	uint64_t	mSmallFileBytes;	// Remaining bytes of files smaller than an erase unit
+	uint64_t	mLayoutGapBytes;	// Unfilled bytes before aligned files
 	BlockMap	mBlockMap;
+	BlockMap	mBaselineMap;		// See LoadBaseline
+	uint32_t	mBaselineBlockSize;
+	BlockMap	mFullBlockMap;		// mBlockMap while a delta is active
+	bool		mDeltaActive;
 	static const size_t kBufferSize;
 	uint8_t*	mBuffer;
 	FATFS		mFatFs;
 	
 	void					ClearBlockMap(void);
+	uint32_t				GetHexRecordBoundary(
+								const SHexRecordFormat&	inFormat) const;
+	uint8_t					GetHexRecordLength(
+								const SHexRecordFormat&	inFormat,
+								uint32_t				inOffset) const;
+	size_t					GetMaxHexSegmentSize(
+								const SHexRecordFormat&	inFormat) const;
+	uint32_t				GetHexLineCount(
+								const SHexRecordFormat&	inFormat) const;
+	uint32_t				GetHexLineOffset(
+								const SHexRecordFormat&	inFormat,
+								uint32_t				inLineIndex) const;
+	size_t					MapHexLines(
+								const SHexRecordFormat&	inFormat,
+								const uint8_t*			inBlock,
+								uint64_t*				outLineMap) const;
+	uint32_t				GetNullRunLength(
+								const SHexRecordFormat&	inFormat,
+								BlockMap::iterator		inBegin,
+								BlockMap::iterator		inEnd,
+								const uint64_t*			inLineMaps) const;
+	size_t					ToNullRunLine(
+								uint32_t				inAddress,
+								uint32_t				inBlockCount,
+								char*					inLineBuffer) const;
+	uint32_t				GetNullBlockRunLength(
+								uint32_t				inBlockIndex) const;
+	void					GetHexSegments(
+								std::vector<SHexSegment>&	outSegments);
+	size_t					ScanHexSegment(
+								BlockMap::iterator		inBegin,
+								BlockMap::iterator		inEnd,
+								uint64_t*				outLineMaps) const;
+	size_t					EncodeHexSegment(
+								BlockMap::iterator		inBegin,
+								BlockMap::iterator		inEnd,
+								const uint64_t*			inLineMaps,
+								char*					outBuffer);
+	void					PlanExport(
+								const std::vector<SHexSegment>&	inSegments,
+								SHexSink*				outHexSink,
+								SSparseSink*			outSparseSink);
+	bool					OpenBinarySink(
+								const char*				inPath,
+								SBinarySink&			outSink);
+	bool					WriteBinaryRun(
+								SBinarySink&			ioSink,
+								BlockMap::iterator		inBegin,
+								uint32_t				inBlockCount);
+	bool					StageBinaryBlock(
+								SBinarySink&			ioSink,
+								const uint8_t*			inBlock);
+	bool					CloseBinarySink(
+								SBinarySink&			ioSink,
+								const char*				inPath,
+								bool					inSuccess);
+	bool					OpenSparseSink(
+								const char*				inPath,
+								SSparseSink&			ioSink);
+	bool					WriteSparseRun(
+								SSparseSink&			ioSink,
+								BlockMap::iterator		inBegin,
+								uint32_t				inBlockCount);
+	bool					CloseSparseSink(
+								SSparseSink&			ioSink,
+								const char*				inPath,
+								bool					inSuccess);
+	bool					OpenOutputFile(
+								const char*				inPath,
+								uint64_t				inFileSize,
+								SOutputFile&			outFile);
+	bool					CloseOutputFile(
+								SOutputFile&			ioFile,
+								const char*				inPath,
+								bool					inSuccess);
+	static bool				WriteToFD(
+								int						inFD,
+								const void*				inData,
+								size_t					inLength);
+	bool					WriteOutput(
+								SOutputFile&			ioFile,
+								const void*				inData,
+								size_t					inLength);
+	bool					WriteOutputAt(
+								SOutputFile&			ioFile,
+								struct iovec*			ioVectors,
+								int						inCount,
+								uint64_t				inOffset);
+	static bool				TransferAt(
+								int						inFD,
+								void*					ioData,
+								size_t					inLength,
+								uint64_t				inOffset,
+								bool					inWrite);
+	bool					DeflateOutput(
+								SOutputFile&			ioFile,
+								const void*				inData,
+								size_t					inLength,
+								int						inFlush);
+	void					BeginManifest(
+								uint8_t					inFill);
+	size_t					GetUnitCrcs(
+								BlockMap::iterator		inBegin,
+								BlockMap::iterator		inEnd,
+								SManifestUnit*			outUnits) const;
+	void					CompactManifest(
+								const size_t*			inUnitCounts,
+								size_t					inSegmentCount);
+	bool					WriteFileCrcs(
+								std::string&			ioPath,
+								FILE*					inFile);
+	void					GetSparseExtents(
+								BlockMap::iterator		inBegin,
+								BlockMap::iterator		inEnd,
+								std::vector<SSparseExtent>&	outExtents) const;
+	static bool				ReadFileData(
+								const char*				inPath,
+								std::vector<uint8_t>&	outData);
+	static bool				InflateData(
+								const std::vector<uint8_t>&	inData,
+								std::vector<uint8_t>&	outData);
+	bool					ParseHexImage(
+								const uint8_t*			inText,
+								size_t					inLength);
+	uint32_t				GetImageBlockSize(
+								uint64_t&				outVolumeSize);
+	static uint32_t			GetBootSectorSize(
+								const uint8_t*			inSector,
+								uint64_t&				outSectorCount);
+	void					RegroupBlocks(
+								uint32_t				inBlockSize);
+	bool					MountImage(void);
+	DWORD					ClusterToBlock(
+								DWORD					inCluster) const
+								{return(mFatFs.database + (inCluster - 2) * mFatFs.csize);}
+	void					SetAllocationHint(
+								bool					inAlignToEraseUnit);
+	void					SmallFileAdded(
+								uint64_t				inFileSize);
+	uint8_t*				GetVolumeBytePtr(
+								uint64_t				inOffset,
+								bool					inCreateIfUndefined = false);
+	DWORD					GetFatEntry(
+								DWORD					inCluster);
+	void					PutFatEntry(
+								DWORD					inFatBase,
+								DWORD					inCluster,
+								DWORD					inValue);
+	bool					RemapDirectory(
+								const std::vector<DWORD>&	inFat,
+								const std::vector<DWORD>&	inNewCluster,
+								DWORD					inFirstBlock,
+								DWORD					inBlockCount,
+								std::vector<DWORD>&		ioSubdirectories);
+	void					MoveBlock(
+								DWORD					inFromIndex,
+								DWORD					inToIndex);
 };
 #endif /* StorageAccess_h */
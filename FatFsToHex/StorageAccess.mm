@@ -28,14 +28,69 @@
 //
 #import <Cocoa/Cocoa.h>
 #include "StorageAccess.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 StorageAccess*	StorageAccess::sInstance = NULL;
-const size_t StorageAccess::kBufferSize = 4096;
+static const char	kSparseImageMagic[] = "FATFSSPX";	// SSparseImageHeader.magic, not nul terminated
+static const uint16_t	kSparseImageVersion = 1;
+static const size_t	kDeflateBufferSize = 0x40000;
+static const size_t	kStagingSize = 0x100000;		// Of exports, a multiple of any block size
+static const size_t	kDeviceChunkSize = 0x100000;	// A multiple of any block size
+static const size_t	kDeviceAlignment = 4096;		// Of WriteToDevice's buffers
+static const uint8_t	kZeroBlock[FF_MAX_SS] = {0};
+static const uint8_t	kErasedFill = 0xFF;		// Of NOR Flash, see BeginManifest
+const size_t StorageAccess::kBufferSize = FF_MAX_SS;	// f_fdisk requires FF_MAX_SS
 // HEX_LINE_DATA_LEN was hard coded as 32.  32 results in a 76 byte hex line
 // length that has the potential of overwriting the 64 byte Arduino serial
 // ring buffer.  This is probably why the Arduino ISP uses 16 data bytes which
-// results in a 44 byte hex line.
+// results in a 44 byte hex line.  HEX_LINE_DATA_LEN is now the default, the
+// record length is set per target using SetHexRecordFormat.
 #define HEX_LINE_DATA_LEN	16
+// ':' + length, address, record type, data, and checksum hex pairs + '\n'
+#define HEX_LINE_LEN(dataLen)	(1 + ((4 + (dataLen)) * 2) + 2 + 1)
+
+// FAT on-disk offsets not exported by FatFs (see ff.c)
+enum EFatOffsets
+{
+	eBPB_RootClus32		= 44,	// FAT32: Root directory cluster (DWORD)
+	eBPB_FSInfo32		= 48,	// FAT32: Offset of FSINFO sector (WORD)
+	eBPB_BkBootSec32	= 50,	// FAT32: Offset of backup boot sector (WORD)
+	eFSI_Nxt_Free		= 492,	// FAT32 FSI: Last allocated cluster (DWORD)
+	eDIR_Attr			= 11,
+	eDIR_FstClusHI		= 20,
+	eDIR_FstClusLO		= 26,
+	eDirEntrySize		= 32,
+	eDeletedDirEntry	= 0xE5,
+	eAttrVolumeLabel	= 0x08,
+	eAttrLFN			= 0x0F,
+	eBS_JmpBoot			= 0,	// Jump instruction (3 bytes)
+	eBPB_BytsPerSec		= 11,	// Sector size (WORD)
+	eBPB_TotSec16		= 19,	// Volume size, 16 bit (WORD)
+	eBPB_TotSec32		= 32,	// Volume size, 32 bit (DWORD)
+	eBPB_TotSecEx		= 72,	// exFAT: Volume size (QWORD)
+	eBPB_BytsPerSecEx	= 108,	// exFAT: Sector size as a power of 2 (BYTE)
+	eMBR_Table			= 446,	// MBR: Offset of the partition table
+	ePTE_StLba			= 8,	// MBR PTE: Start in LBA (DWORD)
+	ePTE_SizLba			= 12,	// MBR PTE: Size in LBA (DWORD)
+	eBS_55AA			= 510	// Signature word (WORD)
+};
 
 enum EIntelHexRecordType
 {
@@ -44,13 +99,38 @@ enum EIntelHexRecordType
 	eRecordTypeExSegAddr,	// 2
 	eRecordTypeStSegAddr,	// 3
 	eRecordTypeExLinAddr,	// 4
-	eRecordTypeStLinAddr	// 5
+	eRecordTypeStLinAddr,	// 5
+	/*
+	*	FatFsToHex extension, only written when null runs are enabled.  The 4
+	*	data bytes are the big endian length of a run of null blocks starting
+	*	at the record's address.
+	*/
+	eRecordTypeNullRun = 0x10
+};
+
+/*
+*	Binary block packets, see GetNextBlockPacket.  Except for the end packet,
+*	the type is followed by the big endian index of the first kPacketBlockSize
+*	block.
+*/
+enum EBlockPacketType
+{
+	ePacketData		= 'D',	// + 16 bit offset in the block + the data from the offset
+	ePacketNullRun	= 'N',	// + 32 bit count of null blocks
+	ePacketEnd		= 'E',
+	ePacketCompressed = 'Z'	// As ePacketData, with the data compressed, see LzCompress
 };
 
 /***************************** StorageAccess **********************************/
 StorageAccess::StorageAccess(void)
-	: mBlockSize(0), mBuffer(NULL)
+	: mBlockSize(0), mEraseUnitLayout(false), mSyncOnSave(false),
+	  mAtomicSave(false), mHexFormat{HEX_LINE_DATA_LEN, 0, false}, mCompressionLevel(0), mImageRange(eImageRangeTrim),
+	  mComputeManifest(false), mManifestComputed(false), mManifestFill(0), mJobCancelled(false),
+	  mJobFilesAdded(0), mJobBytesAdded(0), mJobBlocksExported(0), mJobBlocksToExport(0),
+	  mJobBytesWritten(0), mSmallFileBytes(0), mLayoutGapBytes(0), mBaselineBlockSize(0),
+	  mDeltaActive(false), mBuffer(NULL)
 {
+	memset(&mExportStats, 0, sizeof(mExportStats));
 }
 
 /***************************** ~StorageAccess *********************************/
@@ -83,7 +163,7 @@ void StorageAccess::Release(void)
 /********************************** Alloc *************************************/
 void StorageAccess::Alloc(void)
 {
-	mBuffer = new uint8_t[4096];
+	mBuffer = new uint8_t[kBufferSize];
 }
 
 /********************************* Dealloc ************************************/
@@ -95,12 +175,21 @@ void StorageAccess::Dealloc(void)
 		mBuffer = NULL;
 	}
 	ClearBlockMap();
+	ClearBaseline();
 }
 
 /********************************** Format ************************************/
-bool StorageAccess::Format(void)
+/*
+*	inFormatOptions and inAllocUnitSize are passed to f_mkfs.  FM_ANY and 0
+*	let FatFs choose the FAT type and cluster size based on the volume size.
+*/
+bool StorageAccess::Format(
+	BYTE	inFormatOptions,
+	DWORD	inAllocUnitSize)
 {
 	ClearBlockMap();
+	mSmallFileBytes = 0;
+	mLayoutGapBytes = 0;
 	// Partition the flash with 1 partition that takes the entire space.
 #ifdef DEBUG
 	fprintf(stderr, "Partitioning flash with 1 primary partition...\n");
@@ -115,7 +204,7 @@ bool StorageAccess::Format(void)
 		// Make filesystem.
 		fprintf(stderr, "Creating and formatting FAT filesystem...\n");
 #endif
-		r = f_mkfs("", FM_ANY, 0, mBuffer, kBufferSize);
+		r = f_mkfs("", inFormatOptions, inAllocUnitSize, mBuffer, kBufferSize);
 		if (r == FR_OK)
 		{
 #ifdef DEBUG
@@ -175,15 +264,40 @@ bool StorageAccess::AddFile(
 		if (Begin())
 		{
 			FIL	fp;
+			fseek(file, 0, SEEK_END);
+			long	fileSize = ftell(file);
+			rewind(file);
 			r = f_open (&fp, inDstPath, FA_CREATE_NEW+FA_WRITE);
 			if (r == FR_OK)
 			{
+				/*
+				*	Files at least as large as an erase unit start on an erase
+				*	unit boundary.  Smaller files fill the gaps.  The file's
+				*	chain is created by its first f_write, which is where FatFs
+				*	reads the hint.
+				*/
+				if (mEraseUnitLayout)
+				{
+					if (fileSize >= (long)GetEraseUnitSize())
+					{
+						SetAllocationHint(true);
+					} else
+					{
+						SetAllocationHint(false);
+						SmallFileAdded(fileSize);
+					}
+				}
 				size_t bytesRead = fread(mBuffer, 1, kBufferSize, file);
 				size_t	totalBytesRead = bytesRead;
 				UINT	bytesWritten;
 				UINT	totalBytesWritten = 0;
 				while (bytesRead > 0)
 				{
+					if (mJobCancelled)
+					{
+						r = FR_INT_ERR;
+						break;
+					}
 					r = f_write(&fp, mBuffer, (UINT)bytesRead, &bytesWritten);
 					if (r == FR_OK)
 					{
@@ -198,6 +312,11 @@ bool StorageAccess::AddFile(
 				fprintf(stderr, "Bytes read = %d, bytes written = %d\n", (int)totalBytesRead, totalBytesWritten);
 #endif
 				f_close(&fp);
+				if (r == FR_OK)
+				{
+					mJobFilesAdded++;
+					mJobBytesAdded += totalBytesWritten;
+				}
 				if (r == FR_OK &&
 					outDosName)
 				{
@@ -228,6 +347,10 @@ bool StorageAccess::CreateFolder(
 	FRESULT r = FR_MKFS_ABORTED;
 	if (Begin())
 	{
+		if (mEraseUnitLayout)
+		{
+			SetAllocationHint(false);	// For the new directory's first cluster
+		}
 		r = f_mkdir(inDstPath);
 		if (r == FR_OK &&
 			outDosName)
@@ -243,22 +366,525 @@ bool StorageAccess::CreateFolder(
 	return(r == FR_OK);
 }
 
-static const char kHexChars[] = "0123456789ABCDEF";
+/********************************* Compact ************************************/
+/*
+*	Relocates the used clusters so that they form a single dense run starting
+*	at cluster 2.  The relative order of the clusters is preserved, so files
+*	that were contiguous remain contiguous.  The FAT chains, the start cluster
+*	of every directory entry (including the dot entries), and for FAT32 the
+*	root directory cluster and FSINFO are rewritten to match.  Blocks of the
+*	clusters freed by compaction are removed from the block map, so the
+*	highest block index is as low as the FS allows.
+*
+*	Because each cluster's new number is its rank among the used clusters, a
+*	cluster never moves to a higher number.  Moving the clusters in ascending
+*	order therefore never overwrites a cluster that hasn't been moved yet.
+*/
+bool StorageAccess::Compact(
+	uint32_t*	outClustersMoved)
+{
+	uint32_t	clustersMoved = 0;
+	bool		success = Begin() && mFatFs.fs_type != FS_EXFAT;
+	if (success)
+	{
+		DWORD	fatEntries = mFatFs.n_fatent;
+		std::vector<DWORD>	fat(fatEntries);
+		std::vector<DWORD>	newCluster(fatEntries, 0);
+		DWORD	nextCluster = 2;
+		for (DWORD cluster = 0; cluster < fatEntries; cluster++)
+		{
+			fat[cluster] = GetFatEntry(cluster);
+			if (cluster >= 2 &&
+				fat[cluster] != 0)
+			{
+				if (nextCluster != cluster)
+				{
+					clustersMoved++;
+				}
+				newCluster[cluster] = nextCluster++;
+			}
+		}
+		if (clustersMoved)
+		{
+			/*
+			*	Update the directory entries in place, before the directory
+			*	clusters are moved.  The directory tree is walked using the old
+			*	FAT chains.
+			*/
+			std::vector<DWORD>	subdirectories;
+			std::vector<bool>	visited(fatEntries, false);
+			if (mFatFs.fs_type == FS_FAT32)
+			{
+				subdirectories.push_back(mFatFs.dirbase);
+			} else
+			{
+				RemapDirectory(fat, newCluster, mFatFs.dirbase,
+					(mFatFs.n_rootdir * eDirEntrySize) / mBlockSize, subdirectories);
+			}
+			while (!subdirectories.empty())
+			{
+				DWORD	cluster = subdirectories.back();
+				subdirectories.pop_back();
+				bool	moreEntries = true;
+				while (moreEntries && cluster >= 2 && cluster < fatEntries && !visited[cluster])
+				{
+					visited[cluster] = true;
+					moreEntries = RemapDirectory(fat, newCluster, ClusterToBlock(cluster),
+								mFatFs.csize, subdirectories);
+					cluster = fat[cluster];
+				}
+			}
+			if (success)
+			{
+				// Move the cluster data
+				for (DWORD cluster = 2; cluster < fatEntries; cluster++)
+				{
+					if (newCluster[cluster] != 0 &&
+						newCluster[cluster] != cluster)
+					{
+						DWORD	fromBlock = ClusterToBlock(cluster);
+						DWORD	toBlock = ClusterToBlock(newCluster[cluster]);
+						for (DWORD i = 0; i < mFatFs.csize; i++)
+						{
+							MoveBlock(fromBlock + i, toBlock + i);
+						}
+					}
+				}
+				// Remove anything left past the last used cluster.
+				BlockMap::iterator	itr = mBlockMap.lower_bound(ClusterToBlock(nextCluster));
+				BlockMap::iterator	itrEnd = mBlockMap.lower_bound(ClusterToBlock(fatEntries));
+				while (itr != itrEnd)
+				{
+					delete [] itr->second;
+					itr = mBlockMap.erase(itr);
+				}
+				// Write the new FAT(s)
+				for (BYTE fatIndex = 0; fatIndex < mFatFs.n_fats; fatIndex++)
+				{
+					DWORD	fatBase = mFatFs.fatbase + (fatIndex * mFatFs.fsize);
+					for (DWORD cluster = 2; cluster < fatEntries; cluster++)
+					{
+						PutFatEntry(fatBase, cluster, 0);
+					}
+					for (DWORD cluster = 2; cluster < fatEntries; cluster++)
+					{
+						DWORD	entry = fat[cluster];
+						if (newCluster[cluster] != 0)
+						{
+							PutFatEntry(fatBase, newCluster[cluster],
+								(entry >= 2 && entry < fatEntries) ? newCluster[entry] : entry);
+						}
+					}
+				}
+				if (mFatFs.fs_type == FS_FAT32)
+				{
+					uint64_t	volumeOffset = (uint64_t)mFatFs.volbase * mBlockSize;
+					uint8_t*	bootSector = GetVolumeBytePtr(volumeOffset);
+					if (bootSector)
+					{
+						DWORD	rootCluster = newCluster[mFatFs.dirbase];
+						uint16_t	fsInfoSector = bootSector[eBPB_FSInfo32] | (bootSector[eBPB_FSInfo32+1] << 8);
+						uint16_t	backupSector = bootSector[eBPB_BkBootSec32] | (bootSector[eBPB_BkBootSec32+1] << 8);
+						for (uint32_t i = 0; i < 2; i++)
+						{
+							uint8_t*	sector = GetVolumeBytePtr(volumeOffset + (i ? backupSector : 0) * mBlockSize);
+							if (sector &&
+								(i == 0 || backupSector != 0))
+							{
+								for (uint32_t b = 0; b < 4; b++)
+								{
+									sector[eBPB_RootClus32 + b] = (uint8_t)(rootCluster >> (b*8));
+								}
+							}
+							sector = GetVolumeBytePtr(volumeOffset + (fsInfoSector + (i ? backupSector : 0)) * mBlockSize);
+							if (sector &&
+								fsInfoSector != 0 &&
+								(i == 0 || backupSector != 0))
+							{
+								for (uint32_t b = 0; b < 4; b++)
+								{
+									sector[eFSI_Nxt_Free + b] = (uint8_t)((nextCluster - 1) >> (b*8));
+								}
+							}
+						}
+					}
+				}
+				/*
+				*	Remount so that FatFs doesn't use any cached data from
+				*	before the compaction.
+				*/
+				f_mount(NULL, "", 0);
+				success = Begin();
+			}
+		}
+	}
+#ifdef DEBUG
+	fprintf(stderr, "Compact - %s, %d clusters moved\n", success ? "success" : "failed", (int)clustersMoved);
+#endif
+	if (outClustersMoved)
+	{
+		*outClustersMoved = clustersMoved;
+	}
+	return(success);
+}
+
+/***************************** RemapDirectory *********************************/
+/*
+*	Updates the start cluster of the directory entries in the blocks
+*	inFirstBlock to inFirstBlock + inBlockCount.  The old start clusters of any
+*	subdirectories found are appended to ioSubdirectories.  Returns false if the
+*	end of the directory was reached (this isn't an error,) so the rest of the
+*	directory's chain doesn't need to be scanned.
+*/
+bool StorageAccess::RemapDirectory(
+	const std::vector<DWORD>&	inFat,
+	const std::vector<DWORD>&	inNewCluster,
+	DWORD						inFirstBlock,
+	DWORD						inBlockCount,
+	std::vector<DWORD>&			ioSubdirectories)
+{
+	bool	is32 = mFatFs.fs_type == FS_FAT32;
+	for (DWORD blockIndex = inFirstBlock; blockIndex < inFirstBlock + inBlockCount; blockIndex++)
+	{
+		uint8_t*	block = GetBlock(blockIndex);
+		if (block == NULL)
+		{
+			return(false);	// Never written, therefore the end of the directory
+		}
+		for (uint8_t* entry = block; entry < &block[mBlockSize]; entry += eDirEntrySize)
+		{
+			if (entry[0] == 0)
+			{
+				return(false);	// End of directory
+			}
+			if (entry[0] == eDeletedDirEntry ||
+				entry[eDIR_Attr] == eAttrLFN ||
+				(entry[eDIR_Attr] & eAttrVolumeLabel))
+			{
+				continue;
+			}
+			DWORD	cluster = entry[eDIR_FstClusLO] | (entry[eDIR_FstClusLO+1] << 8);
+			if (is32)
+			{
+				cluster |= (DWORD)(entry[eDIR_FstClusHI] | (entry[eDIR_FstClusHI+1] << 8)) << 16;
+			}
+			if (cluster >= 2 &&
+				cluster < inNewCluster.size() &&
+				inNewCluster[cluster] != 0)
+			{
+				DWORD	newCluster = inNewCluster[cluster];
+				entry[eDIR_FstClusLO] = (uint8_t)newCluster;
+				entry[eDIR_FstClusLO+1] = (uint8_t)(newCluster >> 8);
+				if (is32)
+				{
+					entry[eDIR_FstClusHI] = (uint8_t)(newCluster >> 16);
+					entry[eDIR_FstClusHI+1] = (uint8_t)(newCluster >> 24);
+				}
+				if ((entry[eDIR_Attr] & AM_DIR) &&
+					entry[0] != '.')
+				{
+					ioSubdirectories.push_back(cluster);
+				}
+			}
+		}
+	}
+	return(true);
+}
+
+/******************************** MoveBlock ***********************************/
+/*
+*	Moves a block by moving its buffer within the block map.  If there is no
+*	block at inFromIndex then any block at inToIndex is removed.
+*/
+void StorageAccess::MoveBlock(
+	DWORD	inFromIndex,
+	DWORD	inToIndex)
+{
+	BlockMap::iterator	toItr = mBlockMap.find(inToIndex);
+	if (toItr != mBlockMap.end())
+	{
+		delete [] toItr->second;
+		mBlockMap.erase(toItr);
+	}
+	BlockMap::iterator	fromItr = mBlockMap.find(inFromIndex);
+	if (fromItr != mBlockMap.end())
+	{
+		uint8_t*	block = fromItr->second;
+		mBlockMap.erase(fromItr);
+		mBlockMap.insert(BlockMap::value_type(inToIndex, block));
+	}
+}
+
+/***************************** GetVolumeBytePtr *******************************/
+/*
+*	Returns a pointer to the byte at inOffset from the start of the device.
+*/
+uint8_t* StorageAccess::GetVolumeBytePtr(
+	uint64_t	inOffset,
+	bool		inCreateIfUndefined)
+{
+	uint8_t*	block = GetBlock((uint32_t)(inOffset / mBlockSize), inCreateIfUndefined);
+	return(block ? &block[inOffset % mBlockSize] : NULL);
+}
+
+/******************************* GetFatEntry **********************************/
+/*
+*	Reads the entry for inCluster from the first FAT.  Entries in blocks that
+*	were never written are 0 (free).
+*/
+DWORD StorageAccess::GetFatEntry(
+	DWORD	inCluster)
+{
+	uint64_t	fatOffset = (uint64_t)mFatFs.fatbase * mBlockSize;
+	DWORD		entry = 0;
+	switch (mFatFs.fs_type)
+	{
+		case FS_FAT12:
+		{
+			uint64_t	offset = fatOffset + inCluster + (inCluster / 2);
+			uint8_t*	lowPtr = GetVolumeBytePtr(offset);
+			uint8_t*	highPtr = GetVolumeBytePtr(offset + 1);
+			entry = (lowPtr ? *lowPtr : 0) | ((highPtr ? *highPtr : 0) << 8);
+			entry = (inCluster & 1) ? (entry >> 4) : (entry & 0xFFF);
+			break;
+		}
+		case FS_FAT16:
+		case FS_FAT32:
+		{
+			uint32_t	entrySize = mFatFs.fs_type == FS_FAT16 ? 2 : 4;
+			uint8_t*	entryPtr = GetVolumeBytePtr(fatOffset + (uint64_t)inCluster * entrySize);
+			if (entryPtr)
+			{
+				for (uint32_t i = entrySize; i > 0; i--)
+				{
+					entry = (entry << 8) | entryPtr[i-1];
+				}
+			}
+			if (entrySize == 4)
+			{
+				entry &= 0x0FFFFFFF;
+			}
+			break;
+		}
+	}
+	return(entry);
+}
+
+/******************************* PutFatEntry **********************************/
+/*
+*	Writes inValue to the entry for inCluster of the FAT starting at block
+*	inFatBase.  For FAT32 the upper 4 reserved bits are preserved.  Writing 0
+*	(free) to a block that was never written doesn't create the block.
+*/
+void StorageAccess::PutFatEntry(
+	DWORD	inFatBase,
+	DWORD	inCluster,
+	DWORD	inValue)
+{
+	uint64_t	fatOffset = (uint64_t)inFatBase * mBlockSize;
+	bool		create = inValue != 0;
+	switch (mFatFs.fs_type)
+	{
+		case FS_FAT12:
+		{
+			uint64_t	offset = fatOffset + inCluster + (inCluster / 2);
+			uint8_t*	lowPtr = GetVolumeBytePtr(offset, create);
+			uint8_t*	highPtr = GetVolumeBytePtr(offset + 1, create);
+			if (lowPtr == NULL ||
+				highPtr == NULL)
+			{
+				break;
+			}
+			if (inCluster & 1)
+			{
+				*lowPtr = (*lowPtr & 0x0F) | (uint8_t)((inValue << 4) & 0xF0);
+				*highPtr = (uint8_t)(inValue >> 4);
+			} else
+			{
+				*lowPtr = (uint8_t)inValue;
+				*highPtr = (*highPtr & 0xF0) | (uint8_t)((inValue >> 8) & 0x0F);
+			}
+			break;
+		}
+		case FS_FAT16:
+		case FS_FAT32:
+		{
+			uint32_t	entrySize = mFatFs.fs_type == FS_FAT16 ? 2 : 4;
+			uint8_t*	entryPtr = GetVolumeBytePtr(fatOffset + (uint64_t)inCluster * entrySize, create);
+			if (entryPtr == NULL)
+			{
+				break;
+			}
+			if (entrySize == 4)
+			{
+				inValue = (inValue & 0x0FFFFFFF) | ((DWORD)(entryPtr[3] & 0xF0) << 24);
+			}
+			for (uint32_t i = 0; i < entrySize; i++)
+			{
+				entryPtr[i] = (uint8_t)(inValue >> (i*8));
+			}
+			break;
+		}
+	}
+}
+
+/**************************** SetAllocationHint *******************************/
+/*
+*	Erase unit aware layout.  FatFs starts its search for a free cluster after
+*	mFatFs.last_clst when creating a new cluster chain.
+*
+*	When inAlignToEraseUnit is false the search starts at the beginning of the
+*	data area so that new directories and small files are packed into the gaps
+*	left by aligned files.
+*
+*	The hint only applies to new chains.  When FatFs extends an existing chain,
+*	such as a full directory, it takes the next cluster if that is free.
+*
+*	When inAlignToEraseUnit is true the search starts at the first cluster
+*	past the highest used cluster.  If the small files yet to be added can fill
+*	the resulting gap, the search starts at the first erase unit boundary
+*	instead.  A file aligned this way touches the fewest erase units possible
+*	without increasing the erase unit count of the image as a whole.
+*/
+void StorageAccess::SetAllocationHint(
+	bool	inAlignToEraseUnit)
+{
+	DWORD	hint = 1;	// FatFs searches from hint+1, cluster 2 is the first.
+	if (inAlignToEraseUnit)
+	{
+		DWORD	highestBlock = GetHighestBlockIndex();
+		DWORD	nextCluster = highestBlock >= mFatFs.database ?
+							((highestBlock - mFatFs.database) / mFatFs.csize) + 3 : 2;
+		DWORD	cluster = nextCluster;
+		DWORD	blocksPerEraseUnit = GetEraseUnitSize()/mBlockSize;
+		for (DWORD i = 0; i < blocksPerEraseUnit &&
+				(ClusterToBlock(cluster) % blocksPerEraseUnit) != 0; i++)
+		{
+			cluster++;
+		}
+		uint64_t	gapBytes = (uint64_t)(cluster - nextCluster) * GetClusterSize();
+		if (cluster < mFatFs.n_fatent &&
+			mLayoutGapBytes + gapBytes <= mSmallFileBytes)
+		{
+			mLayoutGapBytes += gapBytes;
+			hint = cluster - 1;
+		} else if (nextCluster < mFatFs.n_fatent)
+		{
+			hint = nextCluster - 1;
+		}
+	}
+	mFatFs.last_clst = hint;
+}
+
+/****************************** SmallFileAdded ********************************/
+/*
+*	Updates the erase unit layout accounting.  A small file is placed in the
+*	first free clusters, so it fills any gaps before aligned files first.
+*/
+void StorageAccess::SmallFileAdded(
+	uint64_t	inFileSize)
+{
+	uint64_t	clusterSize = GetClusterSize();
+	uint64_t	allocatedSize = ((inFileSize + clusterSize - 1) / clusterSize) * clusterSize;
+	mSmallFileBytes -= inFileSize < mSmallFileBytes ? inFileSize : mSmallFileBytes;
+	mLayoutGapBytes -= allocatedSize < mLayoutGapBytes ? allocatedSize : mLayoutGapBytes;
+}
+
+/*
+*	Two hex characters for each byte value.  kHexPairs[inNum*2] is the high
+*	digit, kHexPairs[inNum*2 + 1] the low digit.
+*/
+static const char kHexPairs[] =
+	"000102030405060708090A0B0C0D0E0F"
+	"101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F"
+	"303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F"
+	"505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F"
+	"707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F"
+	"909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+	"B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+	"D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+	"F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
 /******************************** Int8ToHexStr ********************************/
 /*
 *	Returns hex8 str with leading zeros (0x0 would return 00, 0x1 01)
 */
-char* Int8ToHexStr(
+inline char* Int8ToHexStr(
 	uint8_t	inNum,
 	char*	inBuffer)
 {
-	char*	bufPtr = &inBuffer[1];
-	for (; bufPtr >= inBuffer; bufPtr--)
+	memcpy(inBuffer, &kHexPairs[inNum*2], 2);
+	return(&inBuffer[2]);
+}
+
+/******************************* DataToHexStr *********************************/
+/*
+*	Converts inDataLen bytes of inData to hex and adds each byte to ioChecksum.
+*	Returns a pointer to the character following the last hex pair.
+*
+*	Runs of 16 bytes are converted using SSE2 (x86_64) or NEON (arm64), both
+*	of which are always available on the supported Macs.  Any remaining bytes
+*	use the lookup table.
+*/
+static char* DataToHexStr(
+	const uint8_t*	inData,
+	uint8_t			inDataLen,
+	char*			inBuffer,
+	uint8_t&		ioChecksum)
+{
+	const uint8_t*	dataPtr = inData;
+	const uint8_t*	dataEnd = &inData[inDataLen];
+	char*			bufPtr = inBuffer;
+	uint8_t			checksum = ioChecksum;
+#if defined(__SSE2__)
+	const __m128i	kNibbleMask = _mm_set1_epi8(0x0F);
+	const __m128i	kNine = _mm_set1_epi8(9);
+	const __m128i	kZero = _mm_set1_epi8('0');
+	const __m128i	kAlphaOffset = _mm_set1_epi8('A' - '0' - 10);
+	for (; dataEnd - dataPtr >= 16; dataPtr += 16, bufPtr += 32)
 	{
-		*bufPtr =  kHexChars[inNum & 0xF];
-		inNum >>= 4;
+		__m128i	data = _mm_loadu_si128((const __m128i*)dataPtr);
+		__m128i	hi = _mm_and_si128(_mm_srli_epi16(data, 4), kNibbleMask);
+		__m128i	lo = _mm_and_si128(data, kNibbleMask);
+		__m128i	first = _mm_unpacklo_epi8(hi, lo);
+		__m128i	second = _mm_unpackhi_epi8(hi, lo);
+		// nibble + '0', plus 7 more for nibbles > 9
+		first = _mm_add_epi8(_mm_add_epi8(first, kZero),
+					_mm_and_si128(_mm_cmpgt_epi8(first, kNine), kAlphaOffset));
+		second = _mm_add_epi8(_mm_add_epi8(second, kZero),
+					_mm_and_si128(_mm_cmpgt_epi8(second, kNine), kAlphaOffset));
+		_mm_storeu_si128((__m128i*)bufPtr, first);
+		_mm_storeu_si128((__m128i*)&bufPtr[16], second);
+		// Sum of the 16 bytes as two 64 bit halves
+		__m128i	sum = _mm_sad_epu8(data, _mm_setzero_si128());
+		checksum += (uint8_t)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
 	}
-	return(&inBuffer[2]);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t	kHexDigits = vld1q_u8((const uint8_t*)"0123456789ABCDEF");
+	for (; dataEnd - dataPtr >= 16; dataPtr += 16, bufPtr += 32)
+	{
+		uint8x16_t		data = vld1q_u8(dataPtr);
+		uint8x16x2_t	hexPairs;
+		hexPairs.val[0] = vqtbl1q_u8(kHexDigits, vshrq_n_u8(data, 4));
+		hexPairs.val[1] = vqtbl1q_u8(kHexDigits, vandq_u8(data, vdupq_n_u8(0x0F)));
+		vst2q_u8((uint8_t*)bufPtr, hexPairs);	// Interleaves hi and lo
+		checksum += vaddvq_u8(data);
+	}
+#endif
+	for (; dataPtr < dataEnd; dataPtr++)
+	{
+		bufPtr = Int8ToHexStr(*dataPtr, bufPtr);
+		checksum += *dataPtr;
+	}
+	ioChecksum = checksum;
+	return(bufPtr);
 }
 
 /**************************** ToIntelHexLine **********************************/
@@ -285,12 +911,7 @@ size_t ToIntelHexLine(
 		checksum += thisByte;
 		nextHexBytePtr = Int8ToHexStr(inRecordType, nextHexBytePtr);
 		checksum += inRecordType;
-		for (uint8_t i = 0; i < inDataLen; i++)
-		{
-			thisByte = inData[i];
-			nextHexBytePtr = Int8ToHexStr(thisByte, nextHexBytePtr);
-			checksum += thisByte;
-		}
+		nextHexBytePtr = DataToHexStr(inData, inDataLen, nextHexBytePtr, checksum);
 	// Else it's record type 4, 'Extended Linear Address'
 	} else
 	{
@@ -312,19 +933,76 @@ size_t ToIntelHexLine(
 }
 
 /**************************** LineIsEmpty **********************************/
+/*
+*	Returns true if all inDataLen bytes of inData are null.  8 bytes are
+*	checked at a time.
+*/
 bool LineIsEmpty(
 	const uint8_t*	inData,
-	uint8_t			inDataLen)
+	uint32_t		inDataLen)
+{
+	uint64_t	orOfWords = 0;
+	uint32_t	i = 0;
+	for (; i + 8 <= inDataLen; i += 8)
+	{
+		uint64_t	word;
+		memcpy(&word, &inData[i], 8);	// Unaligned load
+		orOfWords |= word;
+	}
+	for (; i < inDataLen; i++)
+	{
+		orOfWords |= inData[i];
+	}
+	return(orOfWords == 0);
+}
+
+/****************************** LineMapIsEmpty ********************************/
+static bool LineMapIsEmpty(
+	const uint64_t*	inLineMap,
+	uint32_t		inMapWords)
+{
+	uint64_t	orOfWords = 0;
+	for (uint32_t word = 0; word < inMapWords; word++)
+	{
+		orOfWords |= inLineMap[word];
+	}
+	return(orOfWords == 0);
+}
+
+/***************************** GetNonNullChunks *******************************/
+/*
+*	Sets the bit in outChunkMap for each 16 byte chunk of inData that isn't all
+*	nulls.  inDataLen must be a multiple of 16.  Returns false if all of inData
+*	is null.
+*/
+static bool GetNonNullChunks(
+	const uint8_t*	inData,
+	uint32_t		inDataLen,
+	uint64_t*		outChunkMap)
 {
-	for (uint8_t i = 0; i < inDataLen; i++)
+	uint32_t	chunks = inDataLen / 16;
+	uint64_t	anyChunk = 0;
+	for (uint32_t word = 0; word < (chunks + 63) / 64; word++)
 	{
-		if (inData[i] == 0)
+		uint64_t	chunkBits = 0;
+		uint32_t	wordChunks = chunks - (word * 64) < 64 ? chunks - (word * 64) : 64;
+		const uint8_t*	dataPtr = &inData[word * 64 * 16];
+		for (uint32_t chunk = 0; chunk < wordChunks; chunk++, dataPtr += 16)
 		{
-			continue;
+#if defined(__SSE2__)
+			__m128i	data = _mm_loadu_si128((const __m128i*)dataPtr);
+			uint64_t	isNonNull = _mm_movemask_epi8(_mm_cmpeq_epi8(data, _mm_setzero_si128())) != 0xFFFF;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+			uint64_t	isNonNull = vmaxvq_u8(vld1q_u8(dataPtr)) != 0;
+#else
+			uint64_t	isNonNull = !LineIsEmpty(dataPtr, 16);
+#endif
+			chunkBits |= isNonNull << chunk;
 		}
-		return(false);
+		outChunkMap[word] = chunkBits;
+		anyChunk |= chunkBits;
 	}
-	return(true);
+	return(anyChunk != 0);
 }
 
 /*************************** GetHighestBlockIndex *****************************/
@@ -338,114 +1016,2856 @@ uint32_t StorageAccess::GetHighestBlockIndex(void) const
 	return(itr != itrEnd ? itr->first : 0);
 }
 
-/****************************** SaveToHexFile *********************************/
-bool StorageAccess::SaveToHexFile(
-	const char*	inPath)
+/**************************** GetEraseUnitCount *******************************/
+/*
+*	Returns the number of erase units (device pages) containing at least one
+*	block used by the FS.  This is the number of erase operations needed to
+*	program the FS onto an erased-as-needed device.
+*/
+uint32_t StorageAccess::GetEraseUnitCount(void) const
 {
-	bool success = false;
-	FILE*    file = fopen(inPath, "w");
-	if (file)
+	uint32_t	eraseUnitCount = 0;
+	if (mBlockSize == 0)
 	{
-		BlockMap::iterator	itr = mBlockMap.begin();
-		BlockMap::iterator	itrEnd = mBlockMap.end();
-		char		hexLine[90];
-		uint32_t	address = 0;
-		uint32_t	baseAddress = 0;
-		uint32_t	upperAddress = 0;
-		uint32_t	lastUpperAddress = 0;
-		uint8_t*	dataPtr;
-		bool		entireBlockIsNull;
-		size_t		lineLength;
-		
-		for (; itr != itrEnd; ++itr)
-		{
-			dataPtr = itr->second;
-			address = itr->first * mBlockSize;
-			baseAddress = address % 0x10000;
-			/*
-			*	The Intel hex format address field is only 16 bits.  When the
-			*	address moves to the next block of 65535 bytes you need to write
-			*	an address record that all data records will offset from.
-			*/
-			upperAddress = address / 0x10000;
-			if (upperAddress != lastUpperAddress)
-			{
-				lastUpperAddress = upperAddress;
-				lineLength = ToIntelHexLine(NULL, 2, upperAddress, eRecordTypeExLinAddr, hexLine);
-				fwrite(hexLine, 1, lineLength, file);
-			}
-			entireBlockIsNull = true;
-			for (uint32_t offset = 0; offset < mBlockSize; offset += HEX_LINE_DATA_LEN)
-			{
-				if (!LineIsEmpty(&dataPtr[offset], HEX_LINE_DATA_LEN))
-				{
-					entireBlockIsNull = false;
-					lineLength = ToIntelHexLine(&dataPtr[offset], HEX_LINE_DATA_LEN, baseAddress + offset, eRecordTypeData, hexLine);
-					fwrite(hexLine, 1, lineLength, file);
-				}
-			}
-			/*
-			*	If the entire block is null THEN
-			*	write a single byte data line so that the reader will know to
-			*	zero the entire block.
-			*/
-			if (entireBlockIsNull)
-			{
-				//fprintf(stderr, "entireBlockIsNull = %X\n", address);
-				lineLength = ToIntelHexLine(dataPtr, 1, baseAddress, eRecordTypeData, hexLine);
-				fwrite(hexLine, 1, lineLength, file);
-			}
-		}
-		lineLength = ToIntelHexLine(dataPtr, 0, 0, eRecordTypeEOF, hexLine);
-		fwrite(hexLine, 1, lineLength, file);
-		fclose(file);
-		success = true;
+		return(0);
 	}
-	return(success);
-}
-
-/********************************* SaveToFile *********************************/
-bool StorageAccess::SaveToFile(
-	const char*	inPath)
-{
-	bool success = false;
-	FILE*    file = fopen(inPath, "w");
-	if (file)
+	uint32_t	blocksPerEraseUnit = GetEraseUnitSize()/mBlockSize;
+	uint32_t	lastEraseUnit = 0;
+	BlockMap::const_iterator	itr = mBlockMap.begin();
+	BlockMap::const_iterator	itrEnd = mBlockMap.end();
+	for (; itr != itrEnd; ++itr)
 	{
-		BlockMap::iterator	itr = mBlockMap.begin();
-		BlockMap::iterator	itrEnd = mBlockMap.end();
-		/*
-		*	FatFs only initializes blocks that it uses.  The block map indexes
-		*	may have gaps of unused blocks.   The blocks that aren't used need
-		*	to be written to the file.  These blocks could be written as random
-		*	data but this would limit the optimization of anything that copies
-		*	the file.  It also makes the file less readable for debugging.  For
-		*	this reason empty blocks are zeroed.
-		*/
-		uint32_t	nextBlockIndex = 0;
-		uint8_t*	emptyBlock = new uint8_t[mBlockSize];
-		memset(emptyBlock, 0, mBlockSize);
-		for (; itr != itrEnd; ++itr)
+		uint32_t	eraseUnit = itr->first / blocksPerEraseUnit;
+		if (eraseUnitCount == 0 ||
+			eraseUnit != lastEraseUnit)
 		{
-			uint32_t	emptyBlocks = itr->first - nextBlockIndex;
-			if (emptyBlocks)
-			{
-				for (uint32_t i = 0; i < emptyBlocks; i++)
-				{
-					fwrite(emptyBlock, 1, mBlockSize, file);
-				}
-			}
-			nextBlockIndex = itr->first+1;
-			fwrite(itr->second, 1, mBlockSize, file);
+			lastEraseUnit = eraseUnit;
+			eraseUnitCount++;
 		}
-		delete [] emptyBlock;
-		fclose(file);
-		success = true;
 	}
-	return(success);
+	return(eraseUnitCount);
 }
 
-/********************************** Begin *************************************/
+/**************************** GetImageBlockCount ******************************/
+/*
+*	Returns the number of blocks in a binary or sparse image of the FS.
+*	Trimmed, the image ends at the highest used block.  A device is erased
+*	and programmed in whole erase units, so rounding up to the erase unit
+*	costs nothing to program and the image maps directly to whole units.
+*	Padding to the device gives an image of the full volume, e.g. for a tool
+*	that requires one.  Uncompressed, the padding is a hole in the file.
+*/
+uint32_t StorageAccess::GetImageBlockCount(void) const
+{
+	if (mBlockMap.empty())
+	{
+		return(0);
+	}
+	uint32_t	blockCount = GetHighestBlockIndex() + 1;
+	if (mImageRange == eImageRangeEraseUnit)
+	{
+		uint32_t	blocksPerUnit = GetEraseUnitSize() / mBlockSize;
+		blockCount = ((blockCount + blocksPerUnit - 1) / blocksPerUnit) * blocksPerUnit;
+	} else if (mImageRange == eImageRangeDevice &&
+		GetMaxBlockIndex() > blockCount)
+	{
+		blockCount = GetMaxBlockIndex();
+	}
+	return(blockCount);
+}
+
+/**************************** SetHexRecordFormat ******************************/
+/*
+*	inRecordLength is the number of data bytes per hex record (1 to 255.)
+*	Records never span inRecordBoundary (a power of 2, 0 = the block size.)
+*	When inNullRuns is set, consecutive null blocks are written as a single
+*	eRecordTypeNullRun record.  This isn't standard Intel HEX, only the
+*	loader sketches understand it.
+*/
+void StorageAccess::SetHexRecordFormat(
+	uint8_t		inRecordLength,
+	uint32_t	inRecordBoundary,
+	bool		inNullRuns)
+{
+	mHexFormat.recordLength = inRecordLength ? inRecordLength : 1;
+	mHexFormat.recordBoundary = inRecordBoundary;
+	mHexFormat.nullRuns = inNullRuns;
+}
+
+/*************************** GetHexRecordBoundary *****************************/
+/*
+*	Data records never span a multiple of the record boundary, nor a block.
+*	The loader sketches buffer 512 bytes and determine the buffer a record
+*	belongs to from its address.
+*/
+uint32_t StorageAccess::GetHexRecordBoundary(
+	const SHexRecordFormat&	inFormat) const
+{
+	return(inFormat.recordBoundary && inFormat.recordBoundary < mBlockSize ? inFormat.recordBoundary : mBlockSize);
+}
+
+/**************************** GetHexRecordLength ******************************/
+/*
+*	Returns the data length of the record starting at inOffset within a block.
+*	This is the record length unless the record boundary is reached first.
+*/
+uint8_t StorageAccess::GetHexRecordLength(
+	const SHexRecordFormat&	inFormat,
+	uint32_t				inOffset) const
+{
+	uint32_t	boundary = GetHexRecordBoundary(inFormat);
+	uint32_t	toBoundary = boundary - (inOffset % boundary);
+	return(toBoundary < inFormat.recordLength ? (uint8_t)toBoundary : inFormat.recordLength);
+}
+
+/*************************** GetMaxHexSegmentSize *****************************/
+/*
+*	Returns the size of a 64KB segment when every record contains data, plus
+*	1 for ToIntelHexLine's nul.
+*/
+size_t StorageAccess::GetMaxHexSegmentSize(
+	const SHexRecordFormat&	inFormat) const
+{
+	uint32_t	boundary = GetHexRecordBoundary(inFormat);
+	uint32_t	recordsPerBoundary = (boundary + inFormat.recordLength - 1) / inFormat.recordLength;
+	return(HEX_LINE_LEN(2) + ((0x10000 / boundary) * recordsPerBoundary * HEX_LINE_LEN(inFormat.recordLength)) + 1);
+}
+
+/****************************** GetHexLineCount *******************************/
+/*
+*	Returns the number of data records needed to represent a block.
+*/
+uint32_t StorageAccess::GetHexLineCount(
+	const SHexRecordFormat&	inFormat) const
+{
+	uint32_t	boundary = GetHexRecordBoundary(inFormat);
+	return((mBlockSize / boundary) * ((boundary + inFormat.recordLength - 1) / inFormat.recordLength));
+}
+
+/****************************** GetHexLineOffset ******************************/
+/*
+*	Returns the offset within a block of the data record inLineIndex.
+*/
+uint32_t StorageAccess::GetHexLineOffset(
+	const SHexRecordFormat&	inFormat,
+	uint32_t				inLineIndex) const
+{
+	uint32_t	boundary = GetHexRecordBoundary(inFormat);
+	uint32_t	linesPerBoundary = (boundary + inFormat.recordLength - 1) / inFormat.recordLength;
+	return(((inLineIndex / linesPerBoundary) * boundary) + ((inLineIndex % linesPerBoundary) * inFormat.recordLength));
+}
+
+/******************************** MapHexLines *********************************/
+/*
+*	Sets the bit in outLineMap for each data record of inBlock that isn't all
+*	nulls and therefore must be written.  outLineMap must have room for
+*	GetHexLineCount bits.  Returns the number of bytes the data records of the
+*	block will generate, 0 if the entire block is null.
+*
+*	The null test is done for the whole block at once, 16 bytes at a time,
+*	resulting in a map of the non-null chunks.  A record is null when none of
+*	the chunks it overlaps are non-null.  Records aren't necessarily aligned to
+*	chunks, so a record that only partially overlaps non-null chunks is checked
+*	directly.
+*/
+size_t StorageAccess::MapHexLines(
+	const SHexRecordFormat&	inFormat,
+	const uint8_t*			inBlock,
+	uint64_t*				outLineMap) const
+{
+	uint32_t	lineCount = GetHexLineCount(inFormat);
+	size_t		linesSize = 0;
+	memset(outLineMap, 0, ((lineCount + 63) / 64) * sizeof(uint64_t));
+	uint64_t	chunkMap[FF_MAX_SS / 16 / 64];
+	if (GetNonNullChunks(inBlock, mBlockSize, chunkMap))
+	{
+		for (uint32_t line = 0; line < lineCount; line++)
+		{
+			uint32_t	offset = GetHexLineOffset(inFormat, line);
+			uint32_t	dataLen = GetHexRecordLength(inFormat, offset);
+			uint32_t	lastChunk = (offset + dataLen - 1) / 16;
+			bool		overlapsNonNull = false;
+			bool		hasData = false;
+			for (uint32_t chunk = offset / 16; chunk <= lastChunk; chunk++)
+			{
+				if ((chunkMap[chunk / 64] >> (chunk % 64)) & 1)
+				{
+					overlapsNonNull = true;
+					if (chunk * 16 >= offset &&
+						(chunk + 1) * 16 <= offset + dataLen)
+					{
+						hasData = true;	// Chunk is entirely within the record
+						break;
+					}
+				}
+			}
+			if (hasData ||
+				(overlapsNonNull && !LineIsEmpty(&inBlock[offset], dataLen)))
+			{
+				outLineMap[line / 64] |= (uint64_t)1 << (line % 64);
+				linesSize += HEX_LINE_LEN(dataLen);
+			}
+		}
+	}
+	return(linesSize);
+}
+
+/***************************** GetNullRunLength *******************************/
+/*
+*	Returns the number of consecutive null blocks starting at inBegin, 0 if
+*	inBegin contains data.  A block is null when its line map (inLineMaps, from
+*	MapHexLines) is empty.  When null runs aren't enabled each null block is
+*	written on its own, so at most 1 is returned.
+*/
+uint32_t StorageAccess::GetNullRunLength(
+	const SHexRecordFormat&	inFormat,
+	BlockMap::iterator		inBegin,
+	BlockMap::iterator		inEnd,
+	const uint64_t*			inLineMaps) const
+{
+	BlockMap::iterator	itr = inBegin;
+	uint32_t	mapWords = (GetHexLineCount(inFormat) + 63) / 64;
+	uint32_t	runLength = 0;
+	for (; itr != inEnd; ++itr, inLineMaps += mapWords, runLength++)
+	{
+		if ((runLength && (itr->first != inBegin->first + runLength || !inFormat.nullRuns)) ||
+			!LineMapIsEmpty(inLineMaps, mapWords))
+		{
+			break;
+		}
+	}
+	return(runLength);
+}
+
+/****************************** GetHexSegments ********************************/
+/*
+*	The Intel hex address field is only 16 bits, so the hex file is made up of
+*	64KB segments, each preceded by an extended linear address record.  A
+*	block never straddles a segment.  Fills outSegments with the first block of
+*	each segment containing blocks, followed by mBlockMap.end().
+*/
+void StorageAccess::GetHexSegments(
+	std::vector<SHexSegment>&	outSegments)
+{
+	BlockMap::iterator	itr = mBlockMap.begin();
+	BlockMap::iterator	itrEnd = mBlockMap.end();
+	uint32_t	lastUpperAddress = 0xFFFFFFFF;
+	uint32_t	blockOrdinal = 0;
+	outSegments.clear();
+	for (; itr != itrEnd; ++itr, blockOrdinal++)
+	{
+		uint32_t	upperAddress = (itr->first * mBlockSize) / 0x10000;
+		if (upperAddress != lastUpperAddress)
+		{
+			lastUpperAddress = upperAddress;
+			outSegments.push_back(SHexSegment{itr, blockOrdinal});
+		}
+	}
+	outSegments.push_back(SHexSegment{itrEnd, blockOrdinal});
+}
+
+/******************************* ScanHexSegment *******************************/
+/*
+*	Maps the data records of each block of the segment (see MapHexLines), and
+*	returns the number of bytes EncodeHexSegment will generate for the
+*	segment.  outLineMaps receives one map per block.
+*/
+size_t StorageAccess::ScanHexSegment(
+	BlockMap::iterator	inBegin,
+	BlockMap::iterator	inEnd,
+	uint64_t*			outLineMaps) const
+{
+	BlockMap::iterator	itr = inBegin;
+	uint64_t*	lineMaps = outLineMaps;
+	uint32_t	mapWords = (GetHexLineCount(mHexFormat) + 63) / 64;
+	// Segment 0 doesn't need an address record, the upper address defaults to 0
+	size_t	segmentSize = (inBegin->first * mBlockSize) / 0x10000 ? HEX_LINE_LEN(2) : 0;
+	for (; itr != inEnd; ++itr, lineMaps += mapWords)
+	{
+		segmentSize += MapHexLines(mHexFormat, itr->second, lineMaps);
+	}
+	/*
+	*	Null blocks are written as a single byte data record, or when part of
+	*	a run of null blocks, as a single null run record for the run.
+	*/
+	for (itr = inBegin, lineMaps = outLineMaps; itr != inEnd; )
+	{
+		uint32_t	runLength = GetNullRunLength(mHexFormat, itr, inEnd, lineMaps);
+		if (runLength)
+		{
+			segmentSize += runLength > 1 ? HEX_LINE_LEN(4) : HEX_LINE_LEN(1);
+			std::advance(itr, runLength);
+			lineMaps += runLength * mapWords;
+		} else
+		{
+			++itr;
+			lineMaps += mapWords;
+		}
+	}
+	return(segmentSize);
+}
+
+/******************************* ToNullRunLine ********************************/
+/*
+*	Writes a null run record for inBlockCount blocks starting at inAddress.
+*/
+size_t StorageAccess::ToNullRunLine(
+	uint32_t	inAddress,
+	uint32_t	inBlockCount,
+	char*		inLineBuffer) const
+{
+	uint32_t	runLength = inBlockCount * mBlockSize;
+	uint8_t		runLengthBE[4] = {(uint8_t)(runLength >> 24), (uint8_t)(runLength >> 16),
+									(uint8_t)(runLength >> 8), (uint8_t)runLength};
+	return(ToIntelHexLine(runLengthBE, 4, inAddress % 0x10000, eRecordTypeNullRun, inLineBuffer));
+}
+
+/***************************** EncodeHexSegment *******************************/
+/*
+*	Encodes the blocks of the segment starting at inBegin as hex lines.  Only
+*	the data records set in the block's line map (inLineMaps, from
+*	ScanHexSegment) are encoded.  outBuffer must be at least
+*	GetMaxHexSegmentSize.  Returns the number of bytes encoded.
+*/
+size_t StorageAccess::EncodeHexSegment(
+	BlockMap::iterator	inBegin,
+	BlockMap::iterator	inEnd,
+	const uint64_t*		inLineMaps,
+	char*				outBuffer)
+{
+	BlockMap::iterator	itr = inBegin;
+	char*		bufPtr = outBuffer;
+	uint32_t	upperAddress = (inBegin->first * mBlockSize) / 0x10000;
+	uint32_t	mapWords = (GetHexLineCount(mHexFormat) + 63) / 64;
+	uint32_t	baseAddress;
+	uint8_t*	dataPtr;
+	uint32_t	runLength;
+	/*
+	*	The Intel hex format address field is only 16 bits.  When the
+	*	address moves to the next block of 65535 bytes you need to write
+	*	an address record that all data records will offset from.
+	*/
+	if (upperAddress)
+	{
+		bufPtr += ToIntelHexLine(NULL, 2, upperAddress, eRecordTypeExLinAddr, bufPtr);
+	}
+	while (itr != inEnd)
+	{
+		dataPtr = itr->second;
+		baseAddress = (itr->first * mBlockSize) % 0x10000;
+		runLength = GetNullRunLength(mHexFormat, itr, inEnd, inLineMaps);
+		/*
+		*	If the entire block is null THEN
+		*	write a single byte data line so that the reader will know to
+		*	zero the entire block.  A run of null blocks is written as a
+		*	single null run record.
+		*/
+		if (runLength)
+		{
+			//fprintf(stderr, "entireBlockIsNull = %X, %d\n", itr->first * mBlockSize, runLength);
+			bufPtr += runLength > 1 ? ToNullRunLine(baseAddress, runLength, bufPtr) :
+						ToIntelHexLine(dataPtr, 1, baseAddress, eRecordTypeData, bufPtr);
+			std::advance(itr, runLength);
+			inLineMaps += runLength * mapWords;
+			continue;
+		}
+		for (uint32_t word = 0; word < mapWords; word++)
+		{
+			// Visit each set bit, lowest (lowest address) first
+			for (uint64_t lineBits = inLineMaps[word]; lineBits; lineBits &= lineBits - 1)
+			{
+				uint32_t	offset = GetHexLineOffset(mHexFormat, (word * 64) + __builtin_ctzll(lineBits));
+				bufPtr += ToIntelHexLine(&dataPtr[offset], GetHexRecordLength(mHexFormat, offset), baseAddress + offset, eRecordTypeData, bufPtr);
+			}
+		}
+		++itr;
+		inLineMaps += mapWords;
+	}
+	return(bufPtr - outBuffer);
+}
+
+/****************************** SaveToHexFile *********************************/
+/*
+*	The blocks are first scanned for null data records, producing a map of the
+*	records to be written for each block and the exact file size.  The file
+*	size is used to preallocate the file and to verify the result.
+*
+*	Each 64KB segment is independent of the others, so the segments are
+*	scanned and encoded concurrently, each into its own buffer, then written in
+*	address order.  Encoding is done in batches of a few segments per core to
+*	bound the memory used.  The buffers are reused for each batch.  The output
+*	is identical to encoding the segments one after another.  See Export.
+*/
+bool StorageAccess::SaveToHexFile(
+	const char*	inPath)
+{
+	SExportSinks	sinks = {inPath, NULL, NULL, NULL};
+	return(Export(sinks));
+}
+
+/*********************************** Export ***********************************/
+/*
+*	Writes the FS to each sink of inSinks that has a path, so that any number
+*	of formats can be exported from a single build of the FS.  SaveToHexFile,
+*	SaveToFile and SaveToSparseFile are exports to a single sink.
+*
+*	PlanExport first scans the blocks for what has to be known before the
+*	start of a file is written: the exact size of the hex file, and the
+*	extents of the sparse image, whose CRCs are in its index.  The blocks are
+*	then traversed once for all of the sinks, in batches of hex segments.  The
+*	segments of a batch are encoded concurrently, each by a task that also
+*	computes the segment's erase unit CRCs for the manifest.  Then, in address
+*	order, each segment's hex lines are written to the hex sink and each run
+*	of consecutive blocks of the segment is handed to the binary and sparse
+*	sinks.  Each sink has its own file, compressor, position and CRC.
+*
+*	A delta can't be written as a flat image.  Every block is at its offset
+*	in the file, so the units that didn't change would be zeros, and writing
+*	the file to the target would zero them.  The hex and sparse formats only
+*	hold the units of the delta.
+*
+*	The export stats are the totals of the files written.
+*/
+bool StorageAccess::Export(
+	const SExportSinks&	inSinks)
+{
+	if (mDeltaActive &&
+		inSinks.binaryPath)
+	{
+		return(false);
+	}
+	std::vector<SHexSegment>	segments;
+	GetHexSegments(segments);
+	size_t		segmentCount = segments.size() - 1;
+	SHexSink	hexSink;
+	SBinarySink	binarySink;
+	SSparseSink	sparseSink;
+	BeginManifest(inSinks.hexPath ? kErasedFill : 0);
+	mJobBlocksToExport += mBlockMap.size();
+	PlanExport(segments, inSinks.hexPath ? &hexSink : NULL, inSinks.sparsePath ? &sparseSink : NULL);
+	// Every sink is opened, even after a failure, so that each can be closed
+	bool	success = true;
+	if (inSinks.hexPath)
+	{
+		success = OpenOutputFile(inSinks.hexPath, hexSink.fileSize, hexSink.file);
+	}
+	if (inSinks.binaryPath)
+	{
+		success = OpenBinarySink(inSinks.binaryPath, binarySink) && success;
+	}
+	if (inSinks.sparsePath)
+	{
+		success = OpenSparseSink(inSinks.sparsePath, sparseSink) && success;
+	}
+	size_t	batchSize = [NSProcessInfo processInfo].activeProcessorCount * 4;
+	if (batchSize > segmentCount)
+	{
+		batchSize = segmentCount;
+	}
+	uint32_t	mapWords = (GetHexLineCount(mHexFormat) + 63) / 64;
+	size_t	maxSegmentSize = GetMaxHexSegmentSize(mHexFormat);
+	char*	buffers = inSinks.hexPath ? new char[(batchSize * maxSegmentSize) + HEX_LINE_LEN(0) + 1] : NULL;
+	size_t*	encodedSizes = new size_t[batchSize + 1];
+	const SHexSegment*	segmentsPtr = segments.data();
+	const uint64_t*		lineMapsPtr = hexSink.lineMaps.data();
+	size_t	unitsPerSegment = 0x10000 / GetManifestUnitSize();
+	size_t*	unitCounts = NULL;
+	SManifestUnit*	unitsPtr = NULL;
+	if (mComputeManifest ||
+		inSinks.manifestPath)
+	{
+		mManifestUnits.resize(segmentCount * unitsPerSegment);
+		unitsPtr = mManifestUnits.data();
+		unitCounts = new size_t[segmentCount + 1];
+	}
+	for (size_t batchStart = 0; success && batchStart < segmentCount; batchStart += batchSize)
+	{
+		size_t	thisBatchSize = segmentCount - batchStart;
+		if (thisBatchSize > batchSize)
+		{
+			thisBatchSize = batchSize;
+		}
+		if (buffers ||
+			unitCounts)
+		{
+			dispatch_apply(thisBatchSize, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t inIndex) {
+				const SHexSegment&	segment = segmentsPtr[batchStart + inIndex];
+				BlockMap::iterator	segmentEnd = segmentsPtr[batchStart + inIndex + 1].begin;
+				if (buffers)
+				{
+					encodedSizes[inIndex] = EncodeHexSegment(segment.begin, segmentEnd,
+						&lineMapsPtr[segment.firstBlock * mapWords], &buffers[inIndex * maxSegmentSize]);
+				}
+				if (unitCounts)
+				{
+					unitCounts[batchStart + inIndex] = GetUnitCrcs(segment.begin, segmentEnd,
+						&unitsPtr[(batchStart + inIndex) * unitsPerSegment]);
+				}
+			});
+		}
+		for (size_t i = 0; success && i < thisBatchSize; i++)
+		{
+			success = !mJobCancelled &&
+						(buffers == NULL || WriteOutput(hexSink.file, &buffers[i * maxSegmentSize], encodedSizes[i]));
+			BlockMap::iterator	itr = segmentsPtr[batchStart + i].begin;
+			BlockMap::iterator	segmentEnd = segmentsPtr[batchStart + i + 1].begin;
+			while (success &&
+				(inSinks.binaryPath || inSinks.sparsePath) &&
+				itr != segmentEnd)
+			{
+				BlockMap::iterator	runBegin = itr;
+				uint32_t	runLength = 0;
+				for (; itr != segmentEnd && itr->first == runBegin->first + runLength; ++itr)
+				{
+					runLength++;
+				}
+				success = (inSinks.binaryPath == NULL || WriteBinaryRun(binarySink, runBegin, runLength)) &&
+							(inSinks.sparsePath == NULL || WriteSparseRun(sparseSink, runBegin, runLength));
+			}
+		}
+		mJobBlocksExported += segmentsPtr[batchStart + thisBatchSize].firstBlock - segmentsPtr[batchStart].firstBlock;
+	}
+	if (inSinks.hexPath)
+	{
+		size_t	lineLength = ToIntelHexLine(NULL, 0, 0, eRecordTypeEOF, buffers);
+		success = success && WriteOutput(hexSink.file, buffers, lineLength);
+		success = CloseOutputFile(hexSink.file, inSinks.hexPath, success && hexSink.file.position == hexSink.fileSize);
+	}
+	if (inSinks.binaryPath)
+	{
+		success = CloseBinarySink(binarySink, inSinks.binaryPath, success);
+	}
+	if (inSinks.sparsePath)
+	{
+		success = CloseSparseSink(sparseSink, inSinks.sparsePath, success);
+	}
+	delete [] buffers;
+	delete [] encodedSizes;
+	if (unitCounts)
+	{
+		CompactManifest(unitCounts, segmentCount);
+		mManifestComputed = success;
+		delete [] unitCounts;
+	}
+	const SOutputFile*	files[] = {inSinks.hexPath ? &hexSink.file : NULL,
+								inSinks.binaryPath ? &binarySink.file : NULL,
+								inSinks.sparsePath ? &sparseSink.file : NULL};
+	uint32_t	fileCount = 0;
+	memset(&mExportStats, 0, sizeof(mExportStats));
+	for (const SOutputFile* file : files)
+	{
+		if (file)
+		{
+			// The files are written at the same time
+			mExportStats.dataBytes += file->stats.dataBytes;
+			mExportStats.fileBytes += file->stats.fileBytes;
+			mExportStats.seconds = std::max(mExportStats.seconds, file->stats.seconds);
+			mExportStats.crc = fileCount++ ? 0 : file->stats.crc;
+		}
+	}
+	success = success &&
+				(inSinks.manifestPath == NULL || SaveManifest(inSinks.manifestPath));
+	return(success);
+}
+
+/********************************* PlanExport *********************************/
+/*
+*	Scans the blocks for what the sinks of an export need before their files
+*	are written, the segments concurrently.  For outHexSink, the line map of
+*	every block (see ScanHexSegment) and the exact size of the hex file.  For
+*	outSparseSink, the extents of the sparse image.  Either may be NULL.
+*/
+void StorageAccess::PlanExport(
+	const std::vector<SHexSegment>&	inSegments,
+	SHexSink*						outHexSink,
+	SSparseSink*					outSparseSink)
+{
+	size_t		segmentCount = inSegments.size() - 1;
+	uint32_t	mapWords = (GetHexLineCount(mHexFormat) + 63) / 64;
+	size_t*		segmentSizes = new size_t[segmentCount + 1];
+	uint64_t*	lineMaps = NULL;
+	if (outHexSink)
+	{
+		outHexSink->lineMaps.assign(mBlockMap.size() * mapWords, 0);
+		lineMaps = outHexSink->lineMaps.data();
+	}
+	std::vector<std::vector<SSparseExtent>>	segmentExtents(outSparseSink ? segmentCount : 0);
+	std::vector<SSparseExtent>*	segmentExtentsPtr = outSparseSink ? segmentExtents.data() : NULL;
+	const SHexSegment*	segmentsPtr = inSegments.data();
+	dispatch_apply(segmentCount, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t inIndex) {
+		if (lineMaps)
+		{
+			segmentSizes[inIndex] = ScanHexSegment(segmentsPtr[inIndex].begin, segmentsPtr[inIndex+1].begin,
+										&lineMaps[segmentsPtr[inIndex].firstBlock * mapWords]);
+		}
+		if (segmentExtentsPtr)
+		{
+			GetSparseExtents(segmentsPtr[inIndex].begin, segmentsPtr[inIndex+1].begin, segmentExtentsPtr[inIndex]);
+		}
+	});
+	if (outHexSink)
+	{
+		outHexSink->fileSize = HEX_LINE_LEN(0);	// EOF record
+		for (size_t i = 0; i < segmentCount; i++)
+		{
+			outHexSink->fileSize += segmentSizes[i];
+		}
+	}
+	if (outSparseSink)
+	{
+		// Join the extents that continue across segments
+		std::vector<SSparseExtent>&	extents = outSparseSink->extents;
+		extents.clear();
+		for (const std::vector<SSparseExtent>& segment : segmentExtents)
+		{
+			for (const SSparseExtent& extent : segment)
+			{
+				SSparseExtent*	lastExtent = extents.empty() ? NULL : &extents.back();
+				if (lastExtent &&
+					lastExtent->startBlock + lastExtent->blockCount == extent.startBlock &&
+					lastExtent->flags == extent.flags)
+				{
+					if (extent.flags == 0)
+					{
+						lastExtent->crc = (uint32_t)crc32_combine(lastExtent->crc, extent.crc,
+															(z_off_t)extent.blockCount * mBlockSize);
+					}
+					lastExtent->blockCount += extent.blockCount;
+				} else
+				{
+					extents.push_back(extent);
+				}
+			}
+		}
+	}
+	delete [] segmentSizes;
+}
+
+/**************************** GetManifestUnitSize *****************************/
+/*
+*	The erase unit size, limited to the 64KB hex segment so that a unit never
+*	spans segments.  The page sizes offered are at most 64KB.
+*/
+uint32_t StorageAccess::GetManifestUnitSize(void) const
+{
+	uint32_t	unitSize = GetEraseUnitSize();
+	return(unitSize > 0x10000 ? 0x10000 : unitSize);
+}
+
+/******************************* BeginManifest ********************************/
+/*
+*	Called at the start of an export.  The manifest is computed by the
+*	export when mComputeManifest is set, so it describes exactly the blocks
+*	exported, e.g. only those of a delta.
+*
+*	The unit CRCs include the unused blocks as the target holds them after
+*	the export is loaded, inFill.  The loaders of hex files erase each 64KB
+*	block before writing it, and write only the blocks in the file, so for
+*	hex the unused blocks are erased NOR Flash (kErasedFill.)  fimg and
+*	sfimg images expand with the unused blocks as zeros.
+*/
+void StorageAccess::BeginManifest(
+	uint8_t	inFill)
+{
+	mManifestUnits.clear();
+	mManifestComputed = false;
+	mManifestFill = inFill;
+}
+
+/******************************** GetUnitCrcs *********************************/
+/*
+*	Fills outUnits with the manifest entry of each erase unit containing the
+*	blocks inBegin up to inEnd, and returns the number of entries.  The blocks
+*	must be whole units, e.g. a hex segment.  Unused blocks of a unit are
+*	included as mManifestFill, see BeginManifest.
+*/
+size_t StorageAccess::GetUnitCrcs(
+	BlockMap::iterator	inBegin,
+	BlockMap::iterator	inEnd,
+	SManifestUnit*		outUnits) const
+{
+	uint32_t	blocksPerUnit = GetManifestUnitSize() / mBlockSize;
+	uint8_t		fillBlock[FF_MAX_SS];
+	const uint8_t*	unusedBlock = kZeroBlock;
+	if (mManifestFill)
+	{
+		memset(fillBlock, mManifestFill, mBlockSize);
+		unusedBlock = fillBlock;
+	}
+	SManifestUnit*	unitPtr = outUnits;
+	BlockMap::iterator	itr = inBegin;
+	while (itr != inEnd)
+	{
+		uint32_t	blockIndex = itr->first - (itr->first % blocksPerUnit);
+		uint32_t	unitEnd = blockIndex + blocksPerUnit;
+		uLong		crc = 0;
+		unitPtr->unit = blockIndex / blocksPerUnit;
+		unitPtr->blockCount = 0;
+		for (; blockIndex < unitEnd; blockIndex++)
+		{
+			if (itr != inEnd &&
+				itr->first == blockIndex)
+			{
+				crc = crc32(crc, itr->second, mBlockSize);
+				unitPtr->blockCount++;
+				++itr;
+			} else
+			{
+				crc = crc32(crc, unusedBlock, mBlockSize);
+			}
+		}
+		unitPtr->crc = (uint32_t)crc;
+		unitPtr++;
+	}
+	return(unitPtr - outUnits);
+}
+
+/****************************** CompactManifest *******************************/
+/*
+*	mManifestUnits has room for every unit of each segment.  Moves the
+*	inUnitCounts[i] entries of each segment down to follow the previous
+*	segment's.
+*/
+void StorageAccess::CompactManifest(
+	const size_t*	inUnitCounts,
+	size_t			inSegmentCount)
+{
+	size_t	unitsPerSegment = 0x10000 / GetManifestUnitSize();
+	size_t	unitCount = 0;
+	for (size_t i = 0; i < inSegmentCount; i++)
+	{
+		memmove(&mManifestUnits[unitCount], &mManifestUnits[i * unitsPerSegment], inUnitCounts[i] * sizeof(SManifestUnit));
+		unitCount += inUnitCounts[i];
+	}
+	mManifestUnits.resize(unitCount);
+}
+
+/******************************** SaveManifest ********************************/
+/*
+*	Writes a text manifest of the last export: the CRC-32 of each erase unit
+*	exported followed by the CRC-32 and size of each file of the FS.  Loaders,
+*	verifiers and delta tools can compare a region of the target against the
+*	manifest rather than transferring or reading back its data.
+*
+*	The unit CRCs are those computed by the export, see BeginManifest.  They
+*	can't be computed now because a delta export has ended by the time the
+*	manifest is saved, so false is returned if the last export was done
+*	without mComputeManifest set.  The fill line is the value of the unused
+*	blocks included in the unit CRCs.
+*
+*	FatFsToHex manifest 2
+*	blockSize 512
+*	unitSize 4096
+*	fill 0xFF
+*	unit <address> <used blocks> <CRC-32, unused blocks as the fill>
+*	...
+*	file <CRC-32> <size> <path>
+*	...
+*/
+bool StorageAccess::SaveManifest(
+	const char*	inPath)
+{
+	FILE*	file = mManifestComputed ? fopen(inPath, "w") : NULL;
+	bool	success = file != NULL;
+	if (success)
+	{
+		fprintf(file, "FatFsToHex manifest 2\nblockSize %u\nunitSize %u\nfill 0x%02X\n",
+			mBlockSize, GetManifestUnitSize(), mManifestFill);
+		for (const SManifestUnit& unit : mManifestUnits)
+		{
+			fprintf(file, "unit 0x%08llX %u %08X\n", (unsigned long long)unit.unit * GetManifestUnitSize(), unit.blockCount, unit.crc);
+		}
+		std::string	path;
+		success = WriteFileCrcs(path, file);
+		success = fclose(file) == 0 && success;
+	}
+	return(success);
+}
+
+/******************************* WriteFileCrcs ********************************/
+/*
+*	Writes the manifest line of each file in the directory ioPath ("" for the
+*	root) and its subdirectories.
+*/
+bool StorageAccess::WriteFileCrcs(
+	std::string&	ioPath,
+	FILE*			inFile)
+{
+	DIR		dir;
+	FILINFO	fileInfo;
+	FRESULT	r = f_opendir(&dir, ioPath.empty() ? "/" : ioPath.c_str());
+	if (r == FR_OK)
+	{
+		while ((r = f_readdir(&dir, &fileInfo)) == FR_OK &&
+			fileInfo.fname[0])
+		{
+			size_t	pathLength = ioPath.size();
+			ioPath += '/';
+			ioPath += fileInfo.fname;
+			if (fileInfo.fattrib & AM_DIR)
+			{
+				r = WriteFileCrcs(ioPath, inFile) ? FR_OK : FR_INT_ERR;
+			} else
+			{
+				FIL	fp;
+				r = f_open(&fp, ioPath.c_str(), FA_READ);
+				if (r == FR_OK)
+				{
+					uLong	crc = 0;
+					UINT	bytesRead;
+					while ((r = f_read(&fp, mBuffer, (UINT)kBufferSize, &bytesRead)) == FR_OK &&
+						bytesRead)
+					{
+						crc = crc32(crc, mBuffer, bytesRead);
+					}
+					f_close(&fp);
+					fprintf(inFile, "file %08X %llu %s\n", (uint32_t)crc, (unsigned long long)fileInfo.fsize, ioPath.c_str());
+				}
+			}
+			ioPath.resize(pathLength);
+			if (r != FR_OK)
+			{
+				break;
+			}
+		}
+		f_closedir(&dir);
+	}
+	return(r == FR_OK);
+}
+
+/***************************** BeginHexRecords ********************************/
+void StorageAccess::BeginHexRecords(
+	SHexRecordCursor&	outCursor) const
+{
+	memset(&outCursor, 0, sizeof(SHexRecordCursor));
+	outCursor.format = mHexFormat;
+}
+
+/***************************** GetNextHexRecord *******************************/
+/*
+*	Pull based equivalent of SaveToHexFile.  Each call generates the next hex
+*	record (line) directly from the block map.  The records, concatenated,
+*	are identical to the file SaveToHexFile writes.  outLine must be at least
+*	kMaxHexLineSize.  outAddress is set to the target address of the record's
+*	data.  For an extended linear address record, outAddress is the segment
+*	address.  Returns the length of the line, or 0 once the EOF record has
+*	been returned (ioCursor.done is set when the EOF record is returned.)
+*
+*	The cursor only holds block indexes, never map iterators, so the block map
+*	may change between calls without invalidating the cursor.  The record
+*	format is the one in effect when BeginHexRecords was called, so a later
+*	SetHexRecordFormat doesn't change the records of a cursor in progress.
+*/
+size_t StorageAccess::GetNextHexRecord(
+	SHexRecordCursor&	ioCursor,
+	char*				outLine,
+	uint32_t&			outAddress)
+{
+	size_t	lineLength = 0;
+	while (lineLength == 0 &&
+		!ioCursor.done)
+	{
+		if (!ioCursor.inBlock)
+		{
+			BlockMap::iterator	itr = mBlockMap.lower_bound(ioCursor.blockIndex);
+			if (itr == mBlockMap.end())
+			{
+				lineLength = ToIntelHexLine(NULL, 0, 0, eRecordTypeEOF, outLine);
+				outAddress = 0;
+				ioCursor.done = true;
+				break;
+			}
+			uint32_t	upperAddress = (itr->first * mBlockSize) / 0x10000;
+			ioCursor.blockIndex = itr->first;
+			if (upperAddress != ioCursor.upperAddress)
+			{
+				// The block is entered on the next call
+				ioCursor.upperAddress = upperAddress;
+				lineLength = ToIntelHexLine(NULL, 2, upperAddress, eRecordTypeExLinAddr, outLine);
+				outAddress = upperAddress << 16;
+				break;
+			}
+			ioCursor.inBlock = true;
+			ioCursor.lineIndex = 0;
+			ioCursor.blockHasData = MapHexLines(ioCursor.format, itr->second, ioCursor.lineMap) != 0;
+		}
+		uint8_t*	dataPtr = GetBlock(ioCursor.blockIndex);
+		uint32_t	address = ioCursor.blockIndex * mBlockSize;
+		if (dataPtr == NULL)
+		{
+			// The block map changed, skip the block.
+		} else if (!ioCursor.blockHasData)
+		{
+			/*
+			*	The entire block is null.  Write a single byte data line so
+			*	that the reader will know to zero the entire block.  When null
+			*	runs are enabled, the following null blocks of the segment
+			*	are included in a single null run record (as EncodeHexSegment.)
+			*/
+			uint32_t	runLength = 1;
+			if (ioCursor.format.nullRuns)
+			{
+				uint64_t	lineMap[FF_MAX_SS / 64];
+				BlockMap::iterator	itr = mBlockMap.find(ioCursor.blockIndex);
+				BlockMap::iterator	itrEnd = mBlockMap.end();
+				for (++itr; itr != itrEnd &&
+						itr->first == ioCursor.blockIndex + runLength &&
+						(itr->first * mBlockSize) / 0x10000 == ioCursor.upperAddress &&
+						MapHexLines(ioCursor.format, itr->second, lineMap) == 0; ++itr)
+				{
+					runLength++;
+				}
+			}
+			lineLength = runLength > 1 ? ToNullRunLine(address, runLength, outLine) :
+							ToIntelHexLine(dataPtr, 1, address % 0x10000, eRecordTypeData, outLine);
+			outAddress = address;
+			ioCursor.blockIndex += runLength - 1;
+		} else
+		{
+			uint32_t	lineCount = GetHexLineCount(ioCursor.format);
+			for (uint32_t word = ioCursor.lineIndex / 64; word < (lineCount + 63) / 64; word++)
+			{
+				uint64_t	lineBits = ioCursor.lineMap[word];
+				if (word == ioCursor.lineIndex / 64)
+				{
+					lineBits &= ~(uint64_t)0 << (ioCursor.lineIndex % 64);
+				}
+				if (lineBits)
+				{
+					uint32_t	line = (word * 64) + __builtin_ctzll(lineBits);
+					uint32_t	offset = GetHexLineOffset(ioCursor.format, line);
+					lineLength = ToIntelHexLine(&dataPtr[offset], GetHexRecordLength(ioCursor.format, offset), (address + offset) % 0x10000, eRecordTypeData, outLine);
+					outAddress = address + offset;
+					ioCursor.lineIndex = line + 1;
+					break;
+				}
+			}
+			if (lineLength)
+			{
+				break;	// Stay in this block
+			}
+		}
+		ioCursor.inBlock = false;
+		ioCursor.blockIndex++;
+	}
+	return(lineLength);
+}
+
+/********************************** Crc16 *************************************/
+/*
+*	CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF), the same as
+*	HexLoader computes using avr-libc's _crc_xmodem_update.
+*/
+static uint16_t Crc16(
+	const uint8_t*	inData,
+	size_t			inDataLen)
+{
+	uint16_t	crc = 0xFFFF;
+	for (size_t i = 0; i < inDataLen; i++)
+	{
+		crc ^= (uint16_t)inData[i] << 8;
+		for (uint32_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return(crc);
+}
+
+/******************************** CobsEncode **********************************/
+/*
+*	Consistent Overhead Byte Stuffing.  Encodes inData so that it contains no
+*	nulls and appends the null frame delimiter.  Returns the frame length.
+*	outFrame must be at least inDataLen + (inDataLen / 254) + 2.
+*/
+static size_t CobsEncode(
+	const uint8_t*	inData,
+	size_t			inDataLen,
+	uint8_t*		outFrame)
+{
+	uint8_t*	codePtr = outFrame;
+	uint8_t*	framePtr = &outFrame[1];
+	uint8_t		code = 1;
+	for (size_t i = 0; i < inDataLen; i++)
+	{
+		if (inData[i])
+		{
+			*(framePtr++) = inData[i];
+			code++;
+			if (code != 0xFF)
+			{
+				continue;
+			}
+		}
+		*codePtr = code;
+		codePtr = framePtr++;
+		code = 1;
+	}
+	*codePtr = code;
+	*(framePtr++) = 0;
+	return(framePtr - outFrame);
+}
+
+/******************************** LzCompress **********************************/
+/*
+*	Small window LZ77 for the block packets, simple enough for HexLoader to
+*	decode a byte at a time directly into its 512 byte block buffer.  Only
+*	the block itself is the window, so no other RAM is needed to decode.
+*
+*	Tokens:
+*	0LLLLLLL			L + 1 literal bytes follow (1 to 128)
+*	1LLLLLLD DDDDDDDD	copy L + 3 bytes (3 to 66) from D + 1 bytes back (1 to
+*						512.)  The copy may overlap the bytes being copied.
+*
+*	Compresses inBlock[inStart] up to inBlock[inEnd].  The bytes before inStart
+*	are null, and are part of the window because the loader zeros the block
+*	before decoding into it.  Returns the compressed length, or 0 if it's not
+*	less than inMaxLength.
+*/
+static size_t LzCompress(
+	const uint8_t*	inBlock,
+	uint32_t		inStart,
+	uint32_t		inEnd,
+	uint8_t*		outData,
+	size_t			inMaxLength)
+{
+	const uint32_t	kMinMatch = 3;
+	const uint32_t	kMaxMatch = 66;
+	const uint32_t	kMaxDistance = 512;
+	const uint32_t	kHashSize = 1024;
+	const uint32_t	kMaxChain = 32;
+	int16_t		head[kHashSize];
+	int16_t		prev[StorageAccess::kPacketBlockSize];
+	size_t		length = 0;
+	uint32_t	literalStart = inStart;
+	uint32_t	pos = 0;
+	memset(head, 0xFF, sizeof(head));	// -1, no position
+	auto	hash = [inBlock](uint32_t inPos) -> uint32_t
+	{
+		return(((inBlock[inPos] << 6) ^ (inBlock[inPos+1] << 3) ^ inBlock[inPos+2]) & (kHashSize - 1));
+	};
+	auto	insert = [&](uint32_t inPos)
+	{
+		if (inPos + kMinMatch <= inEnd)
+		{
+			uint32_t	h = hash(inPos);
+			prev[inPos] = head[h];
+			head[h] = (int16_t)inPos;
+		}
+	};
+	/*
+	*	Writes the literals from literalStart up to inPos, returning false if
+	*	the compressed data is no longer smaller.
+	*/
+	auto	flushLiterals = [&](uint32_t inPos) -> bool
+	{
+		while (literalStart < inPos)
+		{
+			uint32_t	count = inPos - literalStart > 128 ? 128 : inPos - literalStart;
+			if (length + 1 + count >= inMaxLength)
+			{
+				return(false);
+			}
+			outData[length++] = count - 1;
+			memcpy(&outData[length], &inBlock[literalStart], count);
+			length += count;
+			literalStart += count;
+		}
+		return(true);
+	};
+	for (; pos < inStart; pos++)
+	{
+		insert(pos);
+	}
+	while (pos < inEnd)
+	{
+		uint32_t	bestLength = 0;
+		uint32_t	bestDistance = 0;
+		if (pos + kMinMatch <= inEnd)
+		{
+			uint32_t	maxLength = inEnd - pos < kMaxMatch ? inEnd - pos : kMaxMatch;
+			int32_t		candidate = head[hash(pos)];
+			for (uint32_t chain = 0; candidate >= 0 && chain < kMaxChain &&
+					pos - candidate <= kMaxDistance; chain++, candidate = prev[candidate])
+			{
+				uint32_t	matchLength = 0;
+				while (matchLength < maxLength &&
+					inBlock[candidate + matchLength] == inBlock[pos + matchLength])
+				{
+					matchLength++;
+				}
+				if (matchLength > bestLength)
+				{
+					bestLength = matchLength;
+					bestDistance = pos - candidate;
+					if (matchLength == maxLength)
+					{
+						break;
+					}
+				}
+			}
+		}
+		if (bestLength >= kMinMatch)
+		{
+			if (!flushLiterals(pos) ||
+				length + 2 >= inMaxLength)
+			{
+				return(0);
+			}
+			outData[length++] = 0x80 | ((bestLength - kMinMatch) << 1) | ((bestDistance - 1) >> 8);
+			outData[length++] = (uint8_t)(bestDistance - 1);
+			for (uint32_t endPos = pos + bestLength; pos < endPos; pos++)
+			{
+				insert(pos);
+			}
+			literalStart = pos;
+		} else
+		{
+			insert(pos);
+			pos++;
+		}
+	}
+	return(flushLiterals(pos) ? length : 0);
+}
+
+/************************** GetNullBlockRunLength *****************************/
+/*
+*	Returns the number of consecutive null blocks in the block map starting
+*	at inBlockIndex.  As with null run hex records, a run doesn't leave the
+*	64KB segment of inBlockIndex.
+*/
+uint32_t StorageAccess::GetNullBlockRunLength(
+	uint32_t	inBlockIndex) const
+{
+	BlockMap::const_iterator	itr = mBlockMap.find(inBlockIndex);
+	BlockMap::const_iterator	itrEnd = mBlockMap.end();
+	uint32_t	upperAddress = (inBlockIndex * mBlockSize) / 0x10000;
+	uint32_t	runLength = 0;
+	for (; itr != itrEnd &&
+			itr->first == inBlockIndex + runLength &&
+			(itr->first * mBlockSize) / 0x10000 == upperAddress &&
+			LineIsEmpty(itr->second, mBlockSize); ++itr)
+	{
+		runLength++;
+	}
+	return(runLength);
+}
+
+/**************************** BeginBlockPackets *******************************/
+void StorageAccess::BeginBlockPackets(
+	SBlockPacketCursor&	outCursor) const
+{
+	memset(&outCursor, 0, sizeof(SBlockPacketCursor));
+}
+
+/**************************** GetNextBlockPacket ******************************/
+/*
+*	Binary equivalent of GetNextHexRecord, for loaders that accept COBS framed
+*	block packets rather than hex.  Each call generates the next packet,
+*	followed by its big endian CRC-16, as a null delimited COBS frame.
+*	outFrame must be at least kMaxPacketFrameSize.
+*
+*	The block zero-fill convention of the hex is kept.  A data packet carries
+*	one kPacketBlockSize block from its first to its last non-null byte, and
+*	the loader zeros the rest of the block.  A run of null blocks is a single
+*	null run packet.  Unlike hex, the null kPacketBlockSize parts of a larger
+*	block are sent as null runs.  The loader decodes a data packet directly
+*	into its only block buffer, so it can't fill the gaps of a sector the way
+*	it does for hex without losing the packet.
+*
+*	When ioCursor.compress is set, a data packet is replaced by a compressed
+*	packet whenever the compressed data is smaller (see LzCompress.)
+*
+*	outAddress is set to the target address of the packet's data.  Returns the
+*	length of the frame, or 0 once the end packet has been returned
+*	(ioCursor.done is set when the end packet is returned.)
+*/
+size_t StorageAccess::GetNextBlockPacket(
+	SBlockPacketCursor&	ioCursor,
+	uint8_t*			outFrame,
+	uint32_t&			outAddress)
+{
+	uint8_t		packet[kMaxPacketSize];
+	size_t		packetLength = 0;
+	uint32_t	packetBlocks = mBlockSize / kPacketBlockSize;
+	while (packetLength == 0 &&
+		!ioCursor.done)
+	{
+		BlockMap::iterator	itr = mBlockMap.lower_bound(ioCursor.blockIndex);
+		if (itr == mBlockMap.end())
+		{
+			packet[0] = ePacketEnd;
+			packetLength = 1;
+			outAddress = 0;
+			ioCursor.done = true;
+			break;
+		}
+		if (itr->first != ioCursor.blockIndex)
+		{
+			ioCursor.blockIndex = itr->first;
+			ioCursor.packetBlock = 0;
+		}
+		uint32_t	address = ioCursor.blockIndex * mBlockSize;
+		if (ioCursor.packetBlock == 0 &&
+			LineIsEmpty(itr->second, mBlockSize))
+		{
+			uint32_t	runLength = GetNullBlockRunLength(ioCursor.blockIndex);
+			uint32_t	firstBlock = address / kPacketBlockSize;
+			uint32_t	blockCount = runLength * packetBlocks;
+			uint8_t		nullRun[9] = {ePacketNullRun,
+							(uint8_t)(firstBlock >> 24), (uint8_t)(firstBlock >> 16),
+							(uint8_t)(firstBlock >> 8), (uint8_t)firstBlock,
+							(uint8_t)(blockCount >> 24), (uint8_t)(blockCount >> 16),
+							(uint8_t)(blockCount >> 8), (uint8_t)blockCount};
+			memcpy(packet, nullRun, sizeof(nullRun));
+			packetLength = sizeof(nullRun);
+			outAddress = address;
+			ioCursor.blockIndex += runLength;
+			continue;
+		}
+		uint32_t	partBlock = (address / kPacketBlockSize) + ioCursor.packetBlock;
+		const uint8_t*	partPtr = &itr->second[ioCursor.packetBlock * kPacketBlockSize];
+		uint32_t	start = 0;
+		uint32_t	end = kPacketBlockSize;
+		for (; start < end && partPtr[start] == 0; start++){}
+		for (; end > start && partPtr[end-1] == 0; end--){}
+		if (start < end)
+		{
+			uint8_t		header[7] = {ePacketData,
+							(uint8_t)(partBlock >> 24), (uint8_t)(partBlock >> 16),
+							(uint8_t)(partBlock >> 8), (uint8_t)partBlock,
+							(uint8_t)(start >> 8), (uint8_t)start};
+			memcpy(packet, header, sizeof(header));
+			size_t	compressedLength = ioCursor.compress ?
+						LzCompress(partPtr, start, end, &packet[sizeof(header)], end - start) : 0;
+			if (compressedLength)
+			{
+				packet[0] = ePacketCompressed;
+				packetLength = sizeof(header) + compressedLength;
+			} else
+			{
+				memcpy(&packet[sizeof(header)], &partPtr[start], end - start);
+				packetLength = sizeof(header) + end - start;
+			}
+			outAddress = (partBlock * kPacketBlockSize) + start;
+			ioCursor.packetBlock++;
+		} else
+		{
+			// The null parts that follow, within this block
+			uint32_t	blockCount = 1;
+			for (ioCursor.packetBlock++; ioCursor.packetBlock < packetBlocks &&
+					LineIsEmpty(&itr->second[ioCursor.packetBlock * kPacketBlockSize], kPacketBlockSize);
+						ioCursor.packetBlock++)
+			{
+				blockCount++;
+			}
+			uint8_t		nullRun[9] = {ePacketNullRun,
+							(uint8_t)(partBlock >> 24), (uint8_t)(partBlock >> 16),
+							(uint8_t)(partBlock >> 8), (uint8_t)partBlock,
+							0, 0, 0, (uint8_t)blockCount};
+			memcpy(packet, nullRun, sizeof(nullRun));
+			packetLength = sizeof(nullRun);
+			outAddress = partBlock * kPacketBlockSize;
+		}
+		if (ioCursor.packetBlock >= packetBlocks)
+		{
+			ioCursor.blockIndex++;
+			ioCursor.packetBlock = 0;
+		}
+	}
+	if (packetLength == 0)
+	{
+		return(0);
+	}
+	uint16_t	crc = Crc16(packet, packetLength);
+	packet[packetLength++] = crc >> 8;
+	packet[packetLength++] = (uint8_t)crc;
+	return(CobsEncode(packet, packetLength, outFrame));
+}
+
+/************************* GetReplacementDirectory ****************************/
+/*
+*	Returns the path of a new, empty item replacement directory on the same
+*	volume as inPath.  The directory is writable even within the app sandbox.
+*/
+static bool GetReplacementDirectory(
+	const char*		inPath,
+	std::string&	outDirectoryPath)
+{
+	NSURL*	folderURL = [[NSURL fileURLWithPath:[NSString stringWithUTF8String:inPath]] URLByDeletingLastPathComponent];
+	NSURL*	directoryURL = [[NSFileManager defaultManager] URLForDirectory:NSItemReplacementDirectory
+							inDomain:NSUserDomainMask appropriateForURL:folderURL create:YES error:nil];
+	if (directoryURL)
+	{
+		outDirectoryPath.assign(directoryURL.fileSystemRepresentation);
+	}
+	return(directoryURL != nil);
+}
+
+/************************ RemoveReplacementDirectory **************************/
+/*
+*	Removes the directory returned by GetReplacementDirectory that contains
+*	inTempPath, once inTempPath has been renamed or removed.
+*/
+static void RemoveReplacementDirectory(
+	const std::string&	inTempPath)
+{
+	size_t	slash = inTempPath.rfind('/');
+	if (slash != std::string::npos)
+	{
+		rmdir(inTempPath.substr(0, slash).c_str());
+	}
+}
+
+/****************************** OpenOutputFile ********************************/
+/*
+*	Opens an export file for writing, preallocating inFileSize bytes.
+*	outFile holds everything about the file being written, so an export can
+*	write several files at once.
+*
+*	When mAtomicSave is set, a temporary file is opened that
+*	CloseOutputFile renames into place, so an interrupted export never leaves
+*	a partial file.  The app sandbox only allows access to the file the user
+*	selected, not to its folder, so the temporary file is created in an item
+*	replacement directory.  macOS places this directory on the same volume as
+*	inPath so the rename can't fail for crossing volumes.  If there's no such
+*	directory the export fails rather than writing over inPath non-atomically.
+*
+*	When mCompressionLevel is set, everything written with WriteOutput is gzip
+*	compressed on the way to the file.  The compressed size isn't known in
+*	advance so nothing is preallocated.
+*/
+bool StorageAccess::OpenOutputFile(
+	const char*		inPath,
+	uint64_t		inFileSize,
+	SOutputFile&	outFile)
+{
+	outFile.fd = -1;
+	outFile.tempPath.clear();
+	outFile.deflateStream = NULL;
+	outFile.deflateBuffer = NULL;
+	outFile.position = 0;
+	outFile.crc = 0;
+	memset(&outFile.stats, 0, sizeof(outFile.stats));
+	outFile.startTime = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	if (mCompressionLevel)
+	{
+		outFile.deflateStream = new z_stream;
+		memset(outFile.deflateStream, 0, sizeof(z_stream));
+		// windowBits + 16 writes a gzip header and trailer rather than zlib's
+		if (deflateInit2(outFile.deflateStream, mCompressionLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			delete outFile.deflateStream;
+			outFile.deflateStream = NULL;
+			return(false);
+		}
+		outFile.deflateBuffer = new uint8_t[kDeflateBufferSize];
+		inFileSize = 0;
+	}
+	if (mAtomicSave)
+	{
+		std::string&	tempPath = outFile.tempPath;
+		if (GetReplacementDirectory(inPath, tempPath))
+		{
+			tempPath += "/FatFsToHex.XXXXXX";
+			outFile.fd = mkstemp(&tempPath[0]);
+		}
+		if (outFile.fd >= 0)
+		{
+			// mkstemp creates the file as 0600, use the normal creation mode.
+			mode_t	mask = umask(0);
+			umask(mask);
+			fchmod(outFile.fd, 0666 & ~mask);
+		} else
+		{
+#ifdef DEBUG
+			fprintf(stderr, "OpenOutputFile no temporary file (%d)\n", errno);
+#endif
+			RemoveReplacementDirectory(tempPath);
+			tempPath.clear();
+		}
+	} else
+	{
+		outFile.fd = open(inPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+#ifdef F_PREALLOCATE
+	if (outFile.fd >= 0 &&
+		inFileSize)
+	{
+		fstore_t	store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)inFileSize, 0};
+		if (fcntl(outFile.fd, F_PREALLOCATE, &store) == -1)
+		{
+			store.fst_flags = F_ALLOCATEALL;
+			fcntl(outFile.fd, F_PREALLOCATE, &store);	// Only a hint, ignore failure
+		}
+	}
+#endif
+	if (outFile.fd < 0 &&
+		outFile.deflateStream)
+	{
+		deflateEnd(outFile.deflateStream);
+		delete outFile.deflateStream;
+		outFile.deflateStream = NULL;
+		delete [] outFile.deflateBuffer;
+		outFile.deflateBuffer = NULL;
+	}
+	return(outFile.fd >= 0);
+}
+
+/***************************** CloseOutputFile ********************************/
+/*
+*	Closes a file opened by OpenOutputFile.  When mSyncOnSave is set, the data
+*	is flushed to the device first (F_FULLFSYNC on macOS, which also flushes
+*	the drive's cache.)  If inSuccess is set and the file is a temporary file,
+*	it's renamed into place.  If the rename fails the export fails and inPath
+*	is left as it was.  A compressed file is finished (the remaining
+*	compressed data and the gzip trailer are written) before anything else.
+*	Does nothing but return false if the file isn't open.
+*/
+bool StorageAccess::CloseOutputFile(
+	SOutputFile&	ioFile,
+	const char*		inPath,
+	bool			inSuccess)
+{
+	if (ioFile.fd < 0)
+	{
+		return(false);
+	}
+	bool	success = inSuccess;
+	if (ioFile.deflateStream)
+	{
+		success = success && DeflateOutput(ioFile, NULL, 0, Z_FINISH);
+		deflateEnd(ioFile.deflateStream);
+		delete ioFile.deflateStream;
+		ioFile.deflateStream = NULL;
+		delete [] ioFile.deflateBuffer;
+		ioFile.deflateBuffer = NULL;
+	}
+	if (success &&
+		mSyncOnSave)
+	{
+#ifdef F_FULLFSYNC
+		success = fcntl(ioFile.fd, F_FULLFSYNC) == 0 || fsync(ioFile.fd) == 0;
+#else
+		success = fsync(ioFile.fd) == 0;
+#endif
+	}
+	if (!ioFile.tempPath.empty())
+	{
+		if (success &&
+			rename(ioFile.tempPath.c_str(), inPath) != 0)
+		{
+#ifdef DEBUG
+			fprintf(stderr, "CloseOutputFile rename failed (%d)\n", errno);
+#endif
+			success = false;
+		}
+		if (!success)
+		{
+			unlink(ioFile.tempPath.c_str());
+		}
+		RemoveReplacementDirectory(ioFile.tempPath);
+	} else if (mJobCancelled)
+	{
+		unlink(inPath);	// Don't leave a partial file
+	}
+	ioFile.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count() - ioFile.startTime;
+	ioFile.stats.crc = ioFile.crc;
+	success = close(ioFile.fd) == 0 && success;
+	ioFile.fd = -1;
+	return(success);
+}
+
+/******************************* CrcAppendZeros *******************************/
+/*
+*	Returns inCrc extended by inLength zero bytes, e.g. the holes of a binary
+*	export, without reading that many zeros.  The CRC of 2^n zero blocks is
+*	built by doubling with crc32_combine.
+*/
+static uLong CrcAppendZeros(
+	uLong		inCrc,
+	uint64_t	inLength)
+{
+	uint64_t	blockCount = inLength / sizeof(kZeroBlock);
+	uLong		zerosCrc = crc32(0, kZeroBlock, sizeof(kZeroBlock));
+	z_off_t		zerosLength = sizeof(kZeroBlock);
+	for (; blockCount; blockCount >>= 1)
+	{
+		if (blockCount & 1)
+		{
+			inCrc = crc32_combine(inCrc, zerosCrc, zerosLength);
+		}
+		if (blockCount > 1)
+		{
+			zerosCrc = crc32_combine(zerosCrc, zerosCrc, zerosLength);
+			zerosLength *= 2;
+		}
+	}
+	return(crc32(inCrc, kZeroBlock, (uInt)(inLength % sizeof(kZeroBlock))));
+}
+
+/********************************* WriteToFD **********************************/
+bool StorageAccess::WriteToFD(
+	int			inFD,
+	const void*	inData,
+	size_t		inLength)
+{
+	const uint8_t*	dataPtr = (const uint8_t*)inData;
+	while (inLength)
+	{
+		ssize_t	bytesWritten = write(inFD, dataPtr, inLength);
+		if (bytesWritten < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return(false);
+		}
+		dataPtr += bytesWritten;
+		inLength -= bytesWritten;
+	}
+	return(true);
+}
+
+/******************************** WriteOutput *********************************/
+/*
+*	Appends to a file opened by OpenOutputFile, compressing the data when
+*	compression is on.
+*/
+bool StorageAccess::WriteOutput(
+	SOutputFile&	ioFile,
+	const void*		inData,
+	size_t			inLength)
+{
+	ioFile.stats.dataBytes += inLength;
+	ioFile.position += inLength;
+	ioFile.crc = (uint32_t)crc32(ioFile.crc, (const Bytef*)inData, (uInt)inLength);
+	if (ioFile.deflateStream)
+	{
+		return(DeflateOutput(ioFile, inData, inLength, Z_NO_FLUSH));
+	}
+	ioFile.stats.fileBytes += inLength;
+	mJobBytesWritten += inLength;
+	return(WriteToFD(ioFile.fd, inData, inLength));
+}
+
+/******************************* WriteOutputAt ********************************/
+/*
+*	Writes the inCount buffers of ioVectors to an uncompressed file opened by
+*	OpenOutputFile, starting at inOffset.  inOffset can't be before the end
+*	of the previous write.  What's skipped is a hole that reads as zeros.
+*	ioVectors is modified when a write is partial.
+*/
+bool StorageAccess::WriteOutputAt(
+	SOutputFile&	ioFile,
+	struct iovec*	ioVectors,
+	int				inCount,
+	uint64_t		inOffset)
+{
+	ioFile.crc = (uint32_t)CrcAppendZeros(ioFile.crc, inOffset - ioFile.position);
+	ioFile.position = inOffset;
+	for (int i = 0; i < inCount; i++)
+	{
+		ioFile.crc = (uint32_t)crc32(ioFile.crc, (const Bytef*)ioVectors[i].iov_base, (uInt)ioVectors[i].iov_len);
+	}
+	bool	success = lseek(ioFile.fd, inOffset, SEEK_SET) == (off_t)inOffset;
+	while (success &&
+		inCount)
+	{
+		ssize_t	bytesWritten = writev(ioFile.fd, ioVectors, inCount);
+		if (bytesWritten < 0)
+		{
+			success = errno == EINTR;
+			continue;
+		}
+		ioFile.stats.dataBytes += bytesWritten;
+		ioFile.stats.fileBytes += bytesWritten;
+		ioFile.position += bytesWritten;
+		mJobBytesWritten += bytesWritten;
+		for (; inCount && (size_t)bytesWritten >= ioVectors->iov_len; inCount--, ioVectors++)
+		{
+			bytesWritten -= ioVectors->iov_len;
+		}
+		if (bytesWritten)
+		{
+			ioVectors->iov_base = (uint8_t*)ioVectors->iov_base + bytesWritten;
+			ioVectors->iov_len -= bytesWritten;
+		}
+	}
+	return(success);
+}
+
+/******************************* DeflateOutput ********************************/
+/*
+*	Compresses inData, writing any compressed data deflate returns.  deflate
+*	buffers internally, so most calls don't write anything.  inFlush is
+*	Z_FINISH when closing the file.
+*/
+bool StorageAccess::DeflateOutput(
+	SOutputFile&	ioFile,
+	const void*		inData,
+	size_t			inLength,
+	int				inFlush)
+{
+	bool		success = true;
+	int			result = Z_OK;
+	z_stream*	stream = ioFile.deflateStream;
+	stream->next_in = (Bytef*)inData;
+	stream->avail_in = (uInt)inLength;
+	do
+	{
+		stream->next_out = ioFile.deflateBuffer;
+		stream->avail_out = kDeflateBufferSize;
+		result = deflate(stream, inFlush);
+		size_t	outLength = kDeflateBufferSize - stream->avail_out;
+		success = result != Z_STREAM_ERROR &&
+					WriteToFD(ioFile.fd, ioFile.deflateBuffer, outLength);
+		ioFile.stats.fileBytes += outLength;
+		mJobBytesWritten += outLength;
+	} while (success &&
+		stream->avail_out == 0);
+	return(success && (inFlush != Z_FINISH || result == Z_STREAM_END));
+}
+
+/********************************* SaveToFile *********************************/
+/*
+*	Writes the image as a flat binary file of GetImageBlockCount blocks.
+*
+*	FatFs only initializes blocks that it uses.  The block map indexes may
+*	have gaps of unused blocks.  The blocks that aren't used could be written
+*	as random data but this would limit the optimization of anything that
+*	copies the file.  It also makes the file less readable for debugging.
+*	For this reason empty blocks read as zeros.
+*
+*	Uncompressed, the empty blocks are left as holes: each run of used blocks
+*	is written at its offset, and the file size is set when done.  On file
+*	systems with sparse file support (APFS) the holes take no space and no
+*	time to write.  The file isn't preallocated because that would allocate
+*	the holes.  A run is written directly from the block map with a single
+*	writev of up to IOV_MAX blocks (pwritev requires macOS 11.)
+*
+*	Compressed, the zeroed blocks have to be written.  The blocks are staged
+*	so that deflate is called a megabyte at a time.
+*/
+bool StorageAccess::SaveToFile(
+	const char*	inPath)
+{
+	SExportSinks	sinks = {NULL, inPath, NULL, NULL};
+	return(Export(sinks));
+}
+
+/******************************* OpenBinarySink *******************************/
+/*
+*	Opens the binary sink of an export, see SaveToFile.
+*/
+bool StorageAccess::OpenBinarySink(
+	const char*		inPath,
+	SBinarySink&	outSink)
+{
+	outSink.fileSize = (uint64_t)GetImageBlockCount() * mBlockSize;
+	outSink.nextBlock = 0;
+	outSink.run = NULL;
+	outSink.runLength = 0;
+	outSink.staging = NULL;
+	outSink.stagedBytes = 0;
+	// Uncompressed the holes aren't written, so nothing is preallocated
+	bool	success = OpenOutputFile(inPath, 0, outSink.file);
+	if (success)
+	{
+		if (outSink.file.deflateStream)
+		{
+			outSink.staging = new uint8_t[kStagingSize];
+		} else
+		{
+			outSink.run = new struct iovec[IOV_MAX];
+		}
+	}
+	return(success);
+}
+
+/******************************* WriteBinaryRun *******************************/
+/*
+*	Writes inBlockCount consecutive blocks starting at inBegin to the binary
+*	sink.  Uncompressed, the blocks are added to the run of blocks to write
+*	with a single writev, and the unused blocks before them are left as a
+*	hole.  Compressed, the unused blocks are staged as zeros.
+*/
+bool StorageAccess::WriteBinaryRun(
+	SBinarySink&		ioSink,
+	BlockMap::iterator	inBegin,
+	uint32_t			inBlockCount)
+{
+	bool	success = true;
+	BlockMap::iterator	itr = inBegin;
+	if (ioSink.file.deflateStream)
+	{
+		while (success &&
+			ioSink.nextBlock < inBegin->first)
+		{
+			success = StageBinaryBlock(ioSink, kZeroBlock);
+		}
+		for (uint32_t i = 0; success && i < inBlockCount; i++, ++itr)
+		{
+			success = StageBinaryBlock(ioSink, itr->second);
+		}
+	} else
+	{
+		for (uint32_t i = 0; success && i < inBlockCount; i++, ++itr)
+		{
+			if (ioSink.runLength &&
+				(ioSink.runLength == IOV_MAX || ioSink.nextBlock != itr->first))
+			{
+				success = WriteOutputAt(ioSink.file, ioSink.run, ioSink.runLength,
+							(uint64_t)(ioSink.nextBlock - ioSink.runLength) * mBlockSize);
+				ioSink.runLength = 0;
+			}
+			ioSink.run[ioSink.runLength].iov_base = itr->second;
+			ioSink.run[ioSink.runLength].iov_len = mBlockSize;
+			ioSink.runLength++;
+			ioSink.nextBlock = itr->first + 1;
+		}
+	}
+	return(success);
+}
+
+/****************************** StageBinaryBlock ******************************/
+/*
+*	Stages the next block of a compressed binary sink, so that deflate is
+*	called a megabyte at a time.
+*/
+bool StorageAccess::StageBinaryBlock(
+	SBinarySink&	ioSink,
+	const uint8_t*	inBlock)
+{
+	bool	success = true;
+	if (ioSink.stagedBytes == kStagingSize)
+	{
+		success = WriteOutput(ioSink.file, ioSink.staging, ioSink.stagedBytes);
+		ioSink.stagedBytes = 0;
+	}
+	memcpy(&ioSink.staging[ioSink.stagedBytes], inBlock, mBlockSize);
+	ioSink.stagedBytes += mBlockSize;
+	ioSink.nextBlock++;
+	return(success);
+}
+
+/****************************** CloseBinarySink *******************************/
+/*
+*	Writes what's left of the binary sink, the last run or the staged blocks
+*	and the zeros up to the end of the image, and closes the file.
+*	Uncompressed, the file size is set to include the hole at the end.
+*/
+bool StorageAccess::CloseBinarySink(
+	SBinarySink&	ioSink,
+	const char*		inPath,
+	bool			inSuccess)
+{
+	bool	success = inSuccess && ioSink.file.fd >= 0;
+	uint32_t	blockCount = (uint32_t)(ioSink.fileSize / mBlockSize);
+	if (ioSink.file.deflateStream)
+	{
+		while (success &&
+			ioSink.nextBlock < blockCount)
+		{
+			success = StageBinaryBlock(ioSink, kZeroBlock);
+		}
+		success = success && WriteOutput(ioSink.file, ioSink.staging, ioSink.stagedBytes);
+	} else if (success)
+	{
+		success = WriteOutputAt(ioSink.file, ioSink.run, ioSink.runLength,
+					(uint64_t)(ioSink.nextBlock - ioSink.runLength) * mBlockSize) &&
+					ftruncate(ioSink.file.fd, ioSink.fileSize) == 0;
+		ioSink.file.crc = (uint32_t)CrcAppendZeros(ioSink.file.crc, ioSink.fileSize - ioSink.file.position);
+		ioSink.file.position = ioSink.fileSize;
+	}
+	success = CloseOutputFile(ioSink.file, inPath, success && ioSink.file.position == ioSink.fileSize);
+	delete [] ioSink.run;
+	delete [] ioSink.staging;
+	return(success);
+}
+
+/******************************** SDeviceRun **********************************/
+// A range written by WriteToDevice, queued to be verified
+struct SDeviceRun
+{
+	uint64_t			offset;
+	size_t				length;
+	BlockMap::iterator	firstBlock;	// mBlockMap.end() for a zeroed range
+};
+
+/******************************* WriteToDevice ********************************/
+/*
+*	Writes the image directly to a block device (e.g. /dev/rdisk4) or to a
+*	file at inPath, rather than exporting a .fimg and copying all of it with
+*	dd.  Only the used blocks are written, the rest of the device is left as
+*	is unless inZeroUnused is set, in which case the unused blocks up to the
+*	end of the image are zeroed.  Nothing past the end of the image is
+*	touched, and an existing file isn't truncated.  The sandboxed app can't
+*	open raw devices, so it only writes image files.
+*
+*	The buffer cache is bypassed (F_NOCACHE on macOS, O_DIRECT where it's
+*	available.)  Runs of used blocks are copied into an aligned buffer and
+*	written a megabyte at a time at their offsets.
+*
+*	When inVerify is set, each range written is read back and compared on a
+*	second thread while the following ranges are written.  Verification
+*	reads compare against the block map directly, so the write buffer can be
+*	reused immediately.  A read of a range that went through the buffer
+*	cache would only return what was just written, so when the cache can't
+*	be bypassed the range is synced and evicted from the cache before it's
+*	read (posix_fadvise), and where that isn't available either nothing is
+*	written and false is returned.  Writing stops and false is returned at
+*	the first range that doesn't match.
+*/
+bool StorageAccess::WriteToDevice(
+	const char*	inPath,
+	bool		inZeroUnused,
+	bool		inVerify)
+{
+	int	fd = -1;
+#ifdef O_DIRECT
+	fd = open(inPath, O_RDWR | O_CREAT | O_DIRECT, 0666);
+	if (fd < 0 &&
+		errno == EINVAL)	// The file system doesn't support direct IO
+#endif
+	{
+		fd = open(inPath, O_RDWR | O_CREAT, 0666);
+	}
+	bool	success = fd >= 0;
+	if (success)
+	{
+		bool	noCache = false;
+#ifdef F_NOCACHE
+		noCache = fcntl(fd, F_NOCACHE, 1) != -1;
+#endif
+		/*
+		*	TransferAt turns O_DIRECT off when the device rejects a transfer,
+		*	so whether a range bypassed the cache is checked per range.
+		*/
+		auto	isUncached = [&]()
+		{
+#ifdef O_DIRECT
+			return(noCache || (fcntl(fd, F_GETFL) & O_DIRECT) != 0);
+#else
+			return(noCache);
+#endif
+		};
+#ifndef POSIX_FADV_DONTNEED
+		success = !inVerify || isUncached();
+#endif
+		mJobBlocksToExport += mBlockMap.size();
+		void*	staging = NULL;
+		void*	zeros = NULL;
+		success = success &&
+					posix_memalign(&staging, kDeviceAlignment, kDeviceChunkSize) == 0 &&
+					posix_memalign(&zeros, kDeviceAlignment, kDeviceChunkSize) == 0;
+		if (zeros)
+		{
+			memset(zeros, 0, kDeviceChunkSize);
+		}
+		std::mutex				queueMutex;
+		std::condition_variable	queueCondition;
+		std::deque<SDeviceRun>	verifyQueue;
+		bool		writeDone = false;
+		std::atomic<bool>	verified(true);	// Also read by the writing loop
+		std::thread	verifier;
+		BlockMap::iterator	itrEnd = mBlockMap.end();
+		if (success &&
+			inVerify)
+		{
+			verifier = std::thread([&]()
+			{
+				void*	readBuffer = NULL;
+				verified = posix_memalign(&readBuffer, kDeviceAlignment, kDeviceChunkSize) == 0;
+				for (;;)
+				{
+					SDeviceRun	run;
+					{
+						std::unique_lock<std::mutex>	lock(queueMutex);
+						queueCondition.wait(lock, [&]{return(writeDone || !verifyQueue.empty());});
+						if (verifyQueue.empty())
+						{
+							break;
+						}
+						run = verifyQueue.front();
+						verifyQueue.pop_front();
+					}
+					if (verified)
+					{
+						bool	rangeVerified = isUncached();
+#ifdef POSIX_FADV_DONTNEED
+						// Dirty pages aren't evicted, so the range is synced first
+						rangeVerified = rangeVerified ||
+							(fsync(fd) == 0 &&
+							posix_fadvise(fd, run.offset, run.length, POSIX_FADV_DONTNEED) == 0);
+#endif
+						rangeVerified = rangeVerified && TransferAt(fd, readBuffer, run.length, run.offset, false);
+						if (run.firstBlock == itrEnd)
+						{
+							rangeVerified = rangeVerified && memcmp(readBuffer, zeros, run.length) == 0;
+						} else
+						{
+							BlockMap::iterator	itr = run.firstBlock;
+							for (size_t offset = 0; rangeVerified && offset < run.length; offset += mBlockSize, ++itr)
+							{
+								rangeVerified = memcmp(&((uint8_t*)readBuffer)[offset], itr->second, mBlockSize) == 0;
+							}
+						}
+#ifdef DEBUG
+						if (!rangeVerified)
+						{
+							fprintf(stderr, "WriteToDevice verify failed at 0x%llX\n", (unsigned long long)run.offset);
+						}
+#endif
+						verified = rangeVerified;
+					}
+				}
+				free(readBuffer);
+			});
+		}
+		uint32_t	nextBlockIndex = 0;
+		BlockMap::iterator	itr = mBlockMap.begin();
+		while (success &&
+			verified &&
+			itr != itrEnd)
+		{
+			SDeviceRun	run;
+			run.offset = (uint64_t)nextBlockIndex * mBlockSize;
+			if (itr->first > nextBlockIndex)
+			{
+				// Unused blocks, skipped or zeroed
+				uint64_t	gapLength = (uint64_t)(itr->first - nextBlockIndex) * mBlockSize;
+				run.length = gapLength > kDeviceChunkSize ? kDeviceChunkSize : (size_t)gapLength;
+				run.firstBlock = itrEnd;
+				nextBlockIndex += (uint32_t)(run.length / mBlockSize);
+				if (!inZeroUnused)
+				{
+					nextBlockIndex = itr->first;
+					continue;
+				}
+				success = !mJobCancelled && TransferAt(fd, zeros, run.length, run.offset, true);
+			} else
+			{
+				run.length = 0;
+				run.firstBlock = itr;
+				for (; itr != itrEnd && itr->first == nextBlockIndex &&
+					run.length < kDeviceChunkSize; ++itr, nextBlockIndex++)
+				{
+					memcpy(&((uint8_t*)staging)[run.length], itr->second, mBlockSize);
+					run.length += mBlockSize;
+				}
+				success = !mJobCancelled && TransferAt(fd, staging, run.length, run.offset, true);
+				mJobBlocksExported += run.length / mBlockSize;
+			}
+			if (success &&
+				inVerify)
+			{
+				std::lock_guard<std::mutex>	lock(queueMutex);
+				verifyQueue.push_back(run);
+				queueCondition.notify_one();
+			}
+		}
+#ifdef F_FULLFSYNC
+		success = success && (fcntl(fd, F_FULLFSYNC) == 0 || fsync(fd) == 0);
+#else
+		success = success && fsync(fd) == 0;
+#endif
+		if (verifier.joinable())
+		{
+			{
+				std::lock_guard<std::mutex>	lock(queueMutex);
+				writeDone = true;
+				queueCondition.notify_one();
+			}
+			verifier.join();
+		}
+		success = success && verified;
+		free(staging);
+		free(zeros);
+		success = close(fd) == 0 && success;
+	}
+	return(success);
+}
+
+/********************************* TransferAt *********************************/
+/*
+*	Reads or writes inLength bytes at inOffset.  O_DIRECT requires the length
+*	and offset to be multiples of the device's sector size.  If that's larger
+*	than the block size the transfer fails with EINVAL, in which case direct
+*	IO is turned off and the transfer is retried.
+*/
+bool StorageAccess::TransferAt(
+	int			inFD,
+	void*		ioData,
+	size_t		inLength,
+	uint64_t	inOffset,
+	bool		inWrite)
+{
+	uint8_t*	dataPtr = (uint8_t*)ioData;
+	while (inLength)
+	{
+		ssize_t	bytesTransferred = inWrite ? pwrite(inFD, dataPtr, inLength, inOffset) :
+												pread(inFD, dataPtr, inLength, inOffset);
+		if (bytesTransferred <= 0)
+		{
+			if (bytesTransferred < 0 &&
+				errno == EINTR)
+			{
+				continue;
+			}
+#ifdef O_DIRECT
+			int	fileFlags = fcntl(inFD, F_GETFL);
+			if (bytesTransferred < 0 &&
+				errno == EINVAL &&
+				(fileFlags & O_DIRECT) &&
+				fcntl(inFD, F_SETFL, fileFlags & ~O_DIRECT) == 0)
+			{
+				continue;
+			}
+#endif
+			return(false);
+		}
+		dataPtr += bytesTransferred;
+		inLength -= bytesTransferred;
+		inOffset += bytesTransferred;
+	}
+	return(true);
+}
+
+/*
+*	Value of each hex digit character, 0x80 for any other character.  Invalid
+*	characters are detected by ORing the values of a record together rather
+*	than testing each character.
+*/
+static const uint8_t kHexValues[256] =
+{
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+/********************************* LoadWord ***********************************/
+static inline uint32_t LoadWord(
+	const uint8_t*	inPtr)
+{
+	return(inPtr[0] | (inPtr[1] << 8));
+}
+
+/********************************* LoadDWord **********************************/
+static inline uint32_t LoadDWord(
+	const uint8_t*	inPtr)
+{
+	return(inPtr[0] | (inPtr[1] << 8) | (inPtr[2] << 16) | ((uint32_t)inPtr[3] << 24));
+}
+
+/******************************* LoadFromFile *********************************/
+/*
+*	Replaces the FS with the binary image at inPath (as written by SaveToFile.)
+*	Every block of the image is kept, including null blocks, because the image
+*	defines their content.  The block size and volume size are determined from
+*	the image, see MountImage.
+*/
+bool StorageAccess::LoadFromFile(
+	const char*	inPath)
+{
+	std::vector<uint8_t>	image;
+	bool	success = ReadFileData(inPath, image) &&
+						image.size() >= FF_MIN_SS &&
+						image.size() <= 0xFFFFFFFF;
+	if (success)
+	{
+		ClearBlockMap();
+		mBlockSize = FF_MIN_SS;
+		uint32_t	blockCount = (uint32_t)((image.size() + FF_MIN_SS - 1) / FF_MIN_SS);
+		for (uint32_t blockIndex = 0; blockIndex < blockCount; blockIndex++)
+		{
+			size_t	offset = (size_t)blockIndex * FF_MIN_SS;
+			size_t	length = image.size() - offset < FF_MIN_SS ? image.size() - offset : FF_MIN_SS;
+			uint8_t*	block = new uint8_t[FF_MIN_SS];
+			memcpy(block, &image[offset], length);
+			memset(&block[length], 0, FF_MIN_SS - length);
+			mBlockMap.insert(mBlockMap.end(), BlockMap::value_type(blockIndex, block));
+		}
+		success = MountImage();
+	}
+	return(success);
+}
+
+/***************************** LoadFromImageFile ******************************/
+/*
+*	Replaces the FS with the image at inPath, choosing the loader by the file
+*	extension: .hex, .sfimg, otherwise a binary image.  A trailing .gz is
+*	skipped, ReadFileData does the decompression.
+*/
+bool StorageAccess::LoadFromImageFile(
+	const char*	inPath)
+{
+	std::string	name(inPath);
+	std::string::size_type	nameStart = name.rfind('/');
+	name.erase(0, nameStart == std::string::npos ? 0 : nameStart + 1);
+	std::string::size_type	extensionStart = name.rfind('.');
+	if (extensionStart != std::string::npos &&
+		strcasecmp(&name[extensionStart], ".gz") == 0)
+	{
+		name.erase(extensionStart);
+		extensionStart = name.rfind('.');
+	}
+	const char*	extension = extensionStart != std::string::npos ? &name[extensionStart] : "";
+	bool	success;
+	if (strcasecmp(extension, ".hex") == 0)
+	{
+		success = LoadFromHexFile(inPath);
+	} else if (strcasecmp(extension, ".sfimg") == 0)
+	{
+		success = LoadFromSparseFile(inPath);
+	} else
+	{
+		success = LoadFromFile(inPath);
+	}
+	return(success);
+}
+
+/******************************** LoadBaseline ********************************/
+/*
+*	Loads the image at inPath (any format LoadFromImageFile accepts) as the
+*	baseline that BeginDelta compares against, typically the image that was
+*	last programmed into the target.  The image is loaded and mounted like
+*	any other to verify that it's a FAT volume, then its blocks are moved to
+*	mBaselineMap and the current FS is restored.
+*/
+bool StorageAccess::LoadBaseline(
+	const char*	inPath)
+{
+	ClearBaseline();
+	EndDelta();
+	BlockMap	currentMap;
+	currentMap.swap(mBlockMap);
+	uint32_t	blockSize = mBlockSize;
+	uint32_t	volumeSize = mVolumeSize;
+	uint64_t	smallFileBytes = mSmallFileBytes;
+	uint64_t	layoutGapBytes = mLayoutGapBytes;
+	bool	success = LoadFromImageFile(inPath);
+	if (success)
+	{
+		mBaselineMap.swap(mBlockMap);
+		mBaselineBlockSize = mBlockSize;
+	}
+	ClearBlockMap();
+	mBlockMap.swap(currentMap);
+	mBlockSize = blockSize;
+	mVolumeSize = volumeSize;
+	mSmallFileBytes = smallFileBytes;
+	mLayoutGapBytes = layoutGapBytes;
+	if (!mBlockMap.empty())
+	{
+		Begin();	// Remount the current FS
+	}
+	return(success);
+}
+
+/******************************** ClearBaseline *******************************/
+void StorageAccess::ClearBaseline(void)
+{
+	BlockMap::iterator	itr = mBaselineMap.begin();
+	BlockMap::iterator	itrEnd = mBaselineMap.end();
+	for (; itr != itrEnd; ++itr)
+	{
+		delete [] itr->second;
+	}
+	mBaselineMap.clear();
+	mBaselineBlockSize = 0;
+}
+
+/********************************* BeginDelta *********************************/
+/*
+*	Compares the FS against the baseline in units of inUnitSize bytes (the
+*	target's erase unit.)  A unit differs if any of its used blocks differs
+*	from the baseline's, or isn't in the baseline.  Blocks only used by the
+*	baseline are ignored because the FS doesn't access them.
+*
+*	Until EndDelta is called the block map only contains the blocks of the
+*	units that differ, so the exporters write just the delta.  Every used
+*	block of a unit that differs is included, not just the blocks that
+*	changed, because the loader erases the whole unit before writing it.
+*
+*	The baseline's block size must match the FS.
+*/
+bool StorageAccess::BeginDelta(
+	uint32_t		inUnitSize,
+	SDeltaSummary&	outSummary)
+{
+	EndDelta();
+	outSummary.unitSize = inUnitSize;
+	outSummary.unitCount = 0;
+	outSummary.blockCount = 0;
+	outSummary.units.clear();
+	bool	success = !mBaselineMap.empty() &&
+						mBaselineBlockSize == mBlockSize &&
+						inUnitSize >= mBlockSize &&
+						(inUnitSize % mBlockSize) == 0;
+	if (success)
+	{
+		uint32_t	blocksPerUnit = inUnitSize / mBlockSize;
+		outSummary.unitCount = mBlockMap.empty() ? 0 : (GetHighestBlockIndex() / blocksPerUnit) + 1;
+		BlockMap	deltaMap;
+		BlockMap::iterator	itr = mBlockMap.begin();
+		BlockMap::iterator	itrEnd = mBlockMap.end();
+		BlockMap::iterator	baselineEnd = mBaselineMap.end();
+		while (itr != itrEnd)
+		{
+			uint32_t	unit = itr->first / blocksPerUnit;
+			BlockMap::iterator	unitBegin = itr;
+			bool	differs = false;
+			for (; itr != itrEnd && (itr->first / blocksPerUnit) == unit; ++itr)
+			{
+				if (!differs)
+				{
+					BlockMap::iterator	baselineItr = mBaselineMap.find(itr->first);
+					differs = baselineItr == baselineEnd ||
+								memcmp(baselineItr->second, itr->second, mBlockSize) != 0;
+				}
+			}
+			if (differs)
+			{
+				outSummary.units.push_back(unit);
+				for (; unitBegin != itr; ++unitBegin)
+				{
+					deltaMap.insert(deltaMap.end(), *unitBegin);
+					outSummary.blockCount++;
+				}
+			}
+		}
+		mFullBlockMap.swap(mBlockMap);
+		mBlockMap.swap(deltaMap);
+		mDeltaActive = true;
+	}
+	return(success);
+}
+
+/********************************** EndDelta **********************************/
+/*
+*	Restores the block map replaced by BeginDelta.  The delta map's blocks are
+*	owned by the full map so they aren't deleted.
+*/
+void StorageAccess::EndDelta(void)
+{
+	if (mDeltaActive)
+	{
+		mBlockMap.swap(mFullBlockMap);
+		mFullBlockMap.clear();
+		mDeltaActive = false;
+	}
+}
+
+/******************************* GetSparseExtents *****************************/
+/*
+*	Splits the blocks inBegin up to inEnd into extents of consecutive blocks.
+*	Null blocks form their own zero extents so that their data doesn't need
+*	to be stored.  The blocks are scanned once, computing the CRC-32 of each
+*	data extent as it's found.
+*/
+void StorageAccess::GetSparseExtents(
+	BlockMap::iterator			inBegin,
+	BlockMap::iterator			inEnd,
+	std::vector<SSparseExtent>&	outExtents) const
+{
+	BlockMap::iterator	itr = inBegin;
+	SSparseExtent*	extent = NULL;
+	outExtents.clear();
+	for (; itr != inEnd; ++itr)
+	{
+		uint32_t	flags = LineIsEmpty(itr->second, mBlockSize) ? eSparseExtentZero : 0;
+		if (extent == NULL ||
+			itr->first != extent->startBlock + extent->blockCount ||
+			flags != extent->flags)
+		{
+			outExtents.push_back(SSparseExtent{itr->first, 0, flags, 0});
+			extent = &outExtents.back();
+		}
+		extent->blockCount++;
+		if (flags == 0)
+		{
+			extent->crc = (uint32_t)crc32(extent->crc, itr->second, mBlockSize);
+		}
+	}
+}
+
+/****************************** SaveToSparseFile ******************************/
+/*
+*	Writes the block map as a sparse image: a header, the extent table, then
+*	the blocks of each data extent packed in extent order.  Unused blocks and
+*	null blocks take no space.  The data starts on a block boundary so that
+*	the blocks of an extent can be read directly from the file at
+*	dataOffset + (the blocks of the preceding data extents * blockSize.)
+*/
+bool StorageAccess::SaveToSparseFile(
+	const char*	inPath)
+{
+	SExportSinks	sinks = {NULL, NULL, inPath, NULL};
+	return(Export(sinks));
+}
+
+/******************************* OpenSparseSink *******************************/
+/*
+*	Opens the sparse sink of an export, see SaveToSparseFile.  The extents
+*	are from PlanExport.  The header and the extent table are staged ahead of
+*	the data.
+*/
+bool StorageAccess::OpenSparseSink(
+	const char*		inPath,
+	SSparseSink&	ioSink)
+{
+	const std::vector<SSparseExtent>&	extents = ioSink.extents;
+	uint64_t	dataBlocks = 0;
+	for (const SSparseExtent& extent : extents)
+	{
+		dataBlocks += (extent.flags & eSparseExtentZero) ? 0 : extent.blockCount;
+	}
+	SSparseImageHeader	header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kSparseImageMagic, sizeof(header.magic));
+	header.version = kSparseImageVersion;
+	header.headerSize = sizeof(SSparseImageHeader);
+	header.blockSize = mBlockSize;
+	header.blockCount = GetImageBlockCount();
+	header.extentCount = (uint32_t)extents.size();
+	size_t	indexSize = sizeof(SSparseImageHeader) + (extents.size() * sizeof(SSparseExtent));
+	header.dataOffset = (uint32_t)(((indexSize + mBlockSize - 1) / mBlockSize) * mBlockSize);
+	uLong	indexCrc = crc32(0, (const Bytef*)&header, sizeof(header));
+	header.indexCrc = (uint32_t)crc32(indexCrc, (const Bytef*)extents.data(), (uInt)(extents.size() * sizeof(SSparseExtent)));
+	ioSink.fileSize = header.dataOffset + (dataBlocks * mBlockSize);
+	ioSink.extentIndex = 0;
+	ioSink.extentBlock = 0;
+	ioSink.staging = NULL;
+	ioSink.stagingSize = header.dataOffset > kStagingSize ? header.dataOffset : kStagingSize;
+	ioSink.stagedBytes = 0;
+	bool	success = OpenOutputFile(inPath, ioSink.fileSize, ioSink.file);
+	if (success)
+	{
+		ioSink.staging = new uint8_t[ioSink.stagingSize];
+		memset(ioSink.staging, 0, header.dataOffset);
+		memcpy(ioSink.staging, &header, sizeof(header));
+		memcpy(&ioSink.staging[sizeof(header)], extents.data(), extents.size() * sizeof(SSparseExtent));
+		ioSink.stagedBytes = header.dataOffset;
+	}
+	return(success);
+}
+
+/******************************* WriteSparseRun *******************************/
+/*
+*	Stages inBlockCount consecutive blocks starting at inBegin to the sparse
+*	sink.  The blocks of zero extents are skipped.
+*/
+bool StorageAccess::WriteSparseRun(
+	SSparseSink&		ioSink,
+	BlockMap::iterator	inBegin,
+	uint32_t			inBlockCount)
+{
+	bool	success = true;
+	BlockMap::iterator	itr = inBegin;
+	for (uint32_t i = 0; success && i < inBlockCount; i++, ++itr)
+	{
+		const SSparseExtent&	extent = ioSink.extents[ioSink.extentIndex];
+		if ((extent.flags & eSparseExtentZero) == 0)
+		{
+			if (ioSink.stagedBytes + mBlockSize > ioSink.stagingSize)
+			{
+				success = WriteOutput(ioSink.file, ioSink.staging, ioSink.stagedBytes);
+				ioSink.stagedBytes = 0;
+			}
+			memcpy(&ioSink.staging[ioSink.stagedBytes], itr->second, mBlockSize);
+			ioSink.stagedBytes += mBlockSize;
+		}
+		if (++ioSink.extentBlock == extent.blockCount)
+		{
+			ioSink.extentIndex++;
+			ioSink.extentBlock = 0;
+		}
+	}
+	return(success);
+}
+
+/****************************** CloseSparseSink *******************************/
+bool StorageAccess::CloseSparseSink(
+	SSparseSink&	ioSink,
+	const char*		inPath,
+	bool			inSuccess)
+{
+	bool	success = inSuccess &&
+						ioSink.file.fd >= 0 &&
+						WriteOutput(ioSink.file, ioSink.staging, ioSink.stagedBytes);
+	success = CloseOutputFile(ioSink.file, inPath, success && ioSink.file.position == ioSink.fileSize);
+	delete [] ioSink.staging;
+	return(success);
+}
+
+/***************************** LoadFromSparseFile *****************************/
+/*
+*	Replaces the FS with the sparse image at inPath (see SaveToSparseFile.)
+*	The index and the data of every extent are verified against their CRCs
+*	before the current FS is replaced.
+*/
+bool StorageAccess::LoadFromSparseFile(
+	const char*	inPath)
+{
+	std::vector<uint8_t>	image;
+	SSparseImageHeader	header;
+	bool	success = ReadFileData(inPath, image) &&
+						image.size() >= sizeof(SSparseImageHeader);
+	if (success)
+	{
+		memcpy(&header, image.data(), sizeof(header));
+		uint32_t	indexCrc = header.indexCrc;
+		header.indexCrc = 0;
+		success = memcmp(header.magic, kSparseImageMagic, sizeof(header.magic)) == 0 &&
+					header.version == kSparseImageVersion &&
+					header.headerSize == sizeof(SSparseImageHeader) &&
+					header.blockSize >= FF_MIN_SS &&
+					header.blockSize <= FF_MAX_SS &&
+					(header.blockSize & (header.blockSize - 1)) == 0 &&
+					sizeof(SSparseImageHeader) + ((uint64_t)header.extentCount * sizeof(SSparseExtent)) <= header.dataOffset &&
+					header.dataOffset <= image.size();
+		if (success)
+		{
+			uLong	crc = crc32(0, (const Bytef*)&header, sizeof(header));
+			crc = crc32(crc, &image[sizeof(header)], (uInt)(header.extentCount * sizeof(SSparseExtent)));
+			success = crc == indexCrc;
+		}
+	}
+	const SSparseExtent*	extents = success ? (const SSparseExtent*)&image[sizeof(header)] : NULL;
+	uint64_t	dataOffset = header.dataOffset;
+	for (uint32_t i = 0; success && i < header.extentCount; i++)
+	{
+		if ((extents[i].flags & eSparseExtentZero) == 0)
+		{
+			uint64_t	extentSize = (uint64_t)extents[i].blockCount * header.blockSize;
+			success = dataOffset + extentSize <= image.size() &&
+						crc32(0, &image[dataOffset], (uInt)extentSize) == extents[i].crc;
+			dataOffset += extentSize;
+		}
+	}
+	if (success)
+	{
+		ClearBlockMap();
+		mBlockSize = header.blockSize;
+		dataOffset = header.dataOffset;
+		for (uint32_t i = 0; i < header.extentCount; i++)
+		{
+			bool	isZero = (extents[i].flags & eSparseExtentZero) != 0;
+			for (uint32_t j = 0; j < extents[i].blockCount; j++)
+			{
+				uint8_t*	block = GetBlock(extents[i].startBlock + j, true);
+				if (!isZero)
+				{
+					memcpy(block, &image[dataOffset], mBlockSize);
+					dataOffset += mBlockSize;
+				}
+			}
+		}
+		success = MountImage();
+	}
+	return(success);
+}
+
+/****************************** LoadFromHexFile *******************************/
+/*
+*	Replaces the FS with the Intel hex file at inPath (as written by
+*	SaveToHexFile, or any other Intel hex file of a FAT volume.)  Blocks are
+*	created the way the loader sketches write them: any block containing at
+*	least one data record is included, zero filled where there are no records.
+*	The single byte null block records, null run records, and extended
+*	segment and linear address records are supported.
+*/
+bool StorageAccess::LoadFromHexFile(
+	const char*	inPath)
+{
+	std::vector<uint8_t>	hexText;
+	bool	success = ReadFileData(inPath, hexText);
+	if (success)
+	{
+		ClearBlockMap();
+		mBlockSize = FF_MIN_SS;
+		success = ParseHexImage(hexText.data(), hexText.size()) &&
+					MountImage();
+		if (!success)
+		{
+			ClearBlockMap();
+		}
+	}
+	return(success);
+}
+
+/******************************* ParseHexImage ********************************/
+/*
+*	Decodes the hex records of inText into the block map.  Each record is
+*	decoded in full before it is tested, the digits using kHexValues, so the
+*	decode loop doesn't branch per character.  Returns false on the first
+*	invalid record, or if there is no EOF record.
+*/
+bool StorageAccess::ParseHexImage(
+	const uint8_t*	inText,
+	size_t			inLength)
+{
+	const uint8_t*	textPtr = inText;
+	const uint8_t*	textEnd = &inText[inLength];
+	uint32_t	baseAddress = 0;
+	uint32_t	lastBlockIndex = 0xFFFFFFFF;
+	uint8_t*	lastBlock = NULL;
+	uint8_t		record[5 + 255];	// Length, address H/L, type, data, checksum
+	while ((textPtr = (const uint8_t*)memchr(textPtr, ':', textEnd - textPtr)) != NULL)
+	{
+		textPtr++;
+		if (textEnd - textPtr < 2)
+		{
+			break;
+		}
+		uint8_t		invalid = kHexValues[textPtr[0]] | kHexValues[textPtr[1]];
+		uint32_t	recordSize = 5 + (uint8_t)((kHexValues[textPtr[0]] << 4) | kHexValues[textPtr[1]]);
+		if ((invalid & 0x80) ||
+			(size_t)(textEnd - textPtr) < recordSize * 2)
+		{
+			break;
+		}
+		uint8_t		checksum = 0;
+		for (uint32_t i = 0; i < recordSize; i++, textPtr += 2)
+		{
+			uint8_t	high = kHexValues[textPtr[0]];
+			uint8_t	low = kHexValues[textPtr[1]];
+			invalid |= high | low;
+			record[i] = (uint8_t)((high << 4) | low);
+			checksum += record[i];
+		}
+		if ((invalid & 0x80) ||
+			checksum != 0)
+		{
+#ifdef DEBUG
+			fprintf(stderr, "ParseHexImage - invalid record at offset %ld\n", (long)(textPtr - inText));
+#endif
+			break;
+		}
+		uint32_t	dataLen = record[0];
+		uint32_t	address = baseAddress + ((record[1] << 8) | record[2]);
+		const uint8_t*	data = &record[4];
+		switch (record[3])
+		{
+			case eRecordTypeData:
+				/*
+				*	The record may span a block when the image's block size
+				*	is larger than FF_MIN_SS.
+				*/
+				while (dataLen)
+				{
+					uint32_t	blockIndex = address / mBlockSize;
+					uint32_t	offset = address % mBlockSize;
+					uint32_t	length = mBlockSize - offset < dataLen ? mBlockSize - offset : dataLen;
+					if (blockIndex != lastBlockIndex)
+					{
+						lastBlockIndex = blockIndex;
+						lastBlock = GetBlock(blockIndex, true);
+					}
+					memcpy(&lastBlock[offset], data, length);
+					data += length;
+					address += length;
+					dataLen -= length;
+				}
+				continue;
+			case eRecordTypeEOF:
+				return(true);
+			case eRecordTypeExSegAddr:
+			case eRecordTypeExLinAddr:
+				if (dataLen != 2)
+				{
+					break;
+				}
+				baseAddress = ((data[0] << 8) | data[1]) << (record[3] == eRecordTypeExLinAddr ? 16 : 4);
+				continue;
+			case eRecordTypeStSegAddr:
+			case eRecordTypeStLinAddr:
+				continue;	// Start address, not used
+			case eRecordTypeNullRun:
+			{
+				if (dataLen != 4)
+				{
+					break;
+				}
+				uint32_t	runLength = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+				uint32_t	endBlockIndex = (uint32_t)(((uint64_t)address + runLength + mBlockSize - 1) / mBlockSize);
+				for (uint32_t blockIndex = address / mBlockSize; blockIndex < endBlockIndex; blockIndex++)
+				{
+					GetBlock(blockIndex, true);
+				}
+				continue;
+			}
+		}
+#ifdef DEBUG
+		fprintf(stderr, "ParseHexImage - invalid record type %d\n", (int)record[3]);
+#endif
+		break;
+	}
+	return(false);
+}
+
+/****************************** GetImageBlockSize *****************************/
+/*
+*	Returns the sector size of the FAT volume in the block map, 0 if there
+*	isn't a valid boot sector.  Sector 0 is either the boot sector of an
+*	unpartitioned volume, or an MBR (as created by Format) whose first
+*	partition contains the volume.  In the latter case the sector size is
+*	found by testing each possible size for a boot sector at the partition's
+*	start.  outVolumeSize is set to the size of the device.
+*/
+uint32_t StorageAccess::GetImageBlockSize(
+	uint64_t&	outVolumeSize)
+{
+	uint64_t	sectorCount;
+	uint8_t*	block = GetVolumeBytePtr(0);
+	uint32_t	blockSize = block ? GetBootSectorSize(block, sectorCount) : 0;
+	if (blockSize)
+	{
+		outVolumeSize = sectorCount * blockSize;
+	} else if (block &&
+		block[eBS_55AA] == 0x55 && block[eBS_55AA+1] == 0xAA)
+	{
+		const uint8_t*	partition = &block[eMBR_Table];
+		uint32_t	startSector = LoadDWord(&partition[ePTE_StLba]);
+		uint32_t	partitionSectors = LoadDWord(&partition[ePTE_SizLba]);
+		for (uint32_t sectorSize = FF_MIN_SS; sectorSize <= FF_MAX_SS; sectorSize *= 2)
+		{
+			uint8_t*	bootSector = GetVolumeBytePtr((uint64_t)startSector * sectorSize);
+			if (bootSector &&
+				GetBootSectorSize(bootSector, sectorCount) == sectorSize)
+			{
+				blockSize = sectorSize;
+				outVolumeSize = ((uint64_t)startSector + partitionSectors) * sectorSize;
+				break;
+			}
+		}
+	}
+	return(blockSize);
+}
+
+/****************************** GetBootSectorSize *****************************/
+/*
+*	Returns the sector size defined by the FAT or exFAT boot sector inSector, 0
+*	if inSector isn't a boot sector.  outSectorCount is set to the number of
+*	sectors in the volume.
+*/
+uint32_t StorageAccess::GetBootSectorSize(
+	const uint8_t*	inSector,
+	uint64_t&		outSectorCount)
+{
+	uint32_t	sectorSize = 0;
+	if (inSector[eBS_55AA] == 0x55 && inSector[eBS_55AA+1] == 0xAA)
+	{
+		if (memcmp(&inSector[eBS_JmpBoot+3], "EXFAT   ", 8) == 0)
+		{
+			sectorSize = inSector[eBPB_BytsPerSecEx] <= 12 ? 1 << inSector[eBPB_BytsPerSecEx] : 0;
+			outSectorCount = LoadDWord(&inSector[eBPB_TotSecEx]) |
+								((uint64_t)LoadDWord(&inSector[eBPB_TotSecEx+4]) << 32);
+		} else if (inSector[eBS_JmpBoot] == 0xEB ||
+			inSector[eBS_JmpBoot] == 0xE9)
+		{
+			sectorSize = LoadWord(&inSector[eBPB_BytsPerSec]);
+			outSectorCount = LoadWord(&inSector[eBPB_TotSec16]);
+			if (outSectorCount == 0)
+			{
+				outSectorCount = LoadDWord(&inSector[eBPB_TotSec32]);
+			}
+		}
+	}
+	return(sectorSize >= FF_MIN_SS &&
+			sectorSize <= FF_MAX_SS &&
+			(sectorSize & (sectorSize - 1)) == 0 ? sectorSize : 0);
+}
+
+/******************************** RegroupBlocks *******************************/
+/*
+*	Combines the blocks of the block map into blocks of inBlockSize, a multiple
+*	of the current block size.  A block is created for each inBlockSize block
+*	containing at least one of the current blocks, zero filled otherwise.
+*/
+void StorageAccess::RegroupBlocks(
+	uint32_t	inBlockSize)
+{
+	BlockMap	blockMap;
+	BlockMap::iterator	itr = mBlockMap.begin();
+	BlockMap::iterator	itrEnd = mBlockMap.end();
+	uint32_t	blocksPerBlock = inBlockSize / mBlockSize;
+	uint32_t	lastBlockIndex = 0xFFFFFFFF;
+	uint8_t*	block = NULL;
+	for (; itr != itrEnd; ++itr)
+	{
+		uint32_t	blockIndex = itr->first / blocksPerBlock;
+		if (blockIndex != lastBlockIndex)
+		{
+			lastBlockIndex = blockIndex;
+			block = new uint8_t[inBlockSize];
+			memset(block, 0, inBlockSize);
+			blockMap.insert(blockMap.end(), BlockMap::value_type(blockIndex, block));
+		}
+		memcpy(&block[(itr->first % blocksPerBlock) * mBlockSize], itr->second, mBlockSize);
+		delete [] itr->second;
+	}
+	mBlockMap.swap(blockMap);
+	mBlockSize = inBlockSize;
+}
+
+/********************************* MountImage *********************************/
+/*
+*	Called once an image has been loaded into the block map, as FF_MIN_SS
+*	blocks when the image's block size isn't known.  The blocks are regrouped
+*	to the image's block size, then the volume is mounted.  The block size and
+*	volume size of the image are used rather than the user defaults (see
+*	InitializeDisk.)  The page size remains the user default because it isn't
+*	recorded in the image.
+*/
+bool StorageAccess::MountImage(void)
+{
+	uint64_t	volumeSize = 0;
+	uint32_t	blockSize = GetImageBlockSize(volumeSize);
+	uint64_t	imageSize = ((uint64_t)GetHighestBlockIndex() + 1) * mBlockSize;
+	bool		success = blockSize != 0 &&
+							blockSize >= mBlockSize;
+	if (success)
+	{
+		if (blockSize > mBlockSize)
+		{
+			RegroupBlocks(blockSize);
+		}
+		if (volumeSize < imageSize)
+		{
+			volumeSize = imageSize;
+		}
+		mVolumeSize = volumeSize > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)volumeSize;
+		mSmallFileBytes = 0;
+		mLayoutGapBytes = 0;
+		success = Begin();
+	}
+#ifdef DEBUG
+	fprintf(stderr, "MountImage blockSize = %d, volumeSize = %lld, %s\n", blockSize, (long long)volumeSize, success ? "mounted" : "failed");
+#endif
+	if (!success)
+	{
+		ClearBlockMap();
+	}
+	return(success);
+}
+
+/******************************** ReadFileData ********************************/
+/*
+*	Reads the entire file at inPath into outData.  A gzip file (any of the
+*	export formats compressed) is decompressed.
+*/
+bool StorageAccess::ReadFileData(
+	const char*				inPath,
+	std::vector<uint8_t>&	outData)
+{
+	int		fd = open(inPath, O_RDONLY);
+	bool	success = fd >= 0;
+	if (success)
+	{
+		struct stat	fileStat;
+		success = fstat(fd, &fileStat) == 0;
+		if (success)
+		{
+			outData.resize(fileStat.st_size);
+			uint8_t*	dataPtr = outData.data();
+			size_t		bytesRemaining = outData.size();
+			while (success &&
+				bytesRemaining)
+			{
+				ssize_t	bytesRead = read(fd, dataPtr, bytesRemaining);
+				if (bytesRead < 0 &&
+					errno == EINTR)
+				{
+					continue;
+				}
+				success = bytesRead > 0;
+				if (success)
+				{
+					dataPtr += bytesRead;
+					bytesRemaining -= bytesRead;
+				}
+			}
+		}
+		close(fd);
+	}
+	if (success &&
+		outData.size() >= 18 &&		// gzip header + trailer
+		outData[0] == 0x1F &&
+		outData[1] == 0x8B)
+	{
+		std::vector<uint8_t>	compressedData;
+		compressedData.swap(outData);
+		success = InflateData(compressedData, outData);
+	}
+	return(success);
+}
+
+/******************************** InflateData *********************************/
+/*
+*	Decompresses the gzip data inData into outData.  The size stored in the
+*	gzip trailer (modulo 4GB) is used as the initial size of outData.
+*	Concatenated gzip members (e.g. from cat a.gz b.gz) are decompressed one
+*	after another, as gunzip does.  Anything else following a member fails.
+*/
+bool StorageAccess::InflateData(
+	const std::vector<uint8_t>&	inData,
+	std::vector<uint8_t>&		outData)
+{
+	z_stream	stream;
+	memset(&stream, 0, sizeof(stream));
+	bool	success = inflateInit2(&stream, 15 + 16) == Z_OK;
+	if (success)
+	{
+		const uint8_t*	trailer = &inData[inData.size() - 4];
+		size_t	dataSize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+		size_t	outLength = 0;	// inflateReset clears stream.total_out
+		outData.resize(dataSize && dataSize <= 0x40000000 ? dataSize : 0x100000);
+		stream.next_in = (Bytef*)inData.data();
+		stream.avail_in = (uInt)inData.size();
+		int	result;
+		do
+		{
+			if (outLength == outData.size())
+			{
+				outData.resize(outData.size() * 2);
+			}
+			stream.next_out = &outData[outLength];
+			stream.avail_out = (uInt)(outData.size() - outLength);
+			result = inflate(&stream, Z_NO_FLUSH);
+			outLength = stream.next_out - outData.data();
+			if (result == Z_STREAM_END &&
+				stream.avail_in >= 2 &&
+				stream.next_in[0] == 0x1F &&
+				stream.next_in[1] == 0x8B)
+			{
+				result = inflateReset(&stream);	// Another member follows
+			}
+		} while (result == Z_OK);
+		success = result == Z_STREAM_END &&
+					stream.avail_in == 0;
+		outData.resize(outLength);
+		inflateEnd(&stream);
+	}
+	return(success);
+}
+
+/********************************** Begin *************************************/
 bool StorageAccess::Begin(void)
 {
 	// Mount the filesystem.
@@ -463,9 +3883,39 @@ bool StorageAccess::Begin(void)
 	return true;
 }
 
+/********************************* BeginJob ***********************************/
+/*
+*	Resets the job progress and cancellation before a build or export runs on
+*	a worker thread.  CancelJob may then be called from any thread.  Adding
+*	files and writing exports check for cancellation between chunks of work
+*	and fail when it's set.  A cancelled export file is removed.
+*/
+void StorageAccess::BeginJob(void)
+{
+	mJobCancelled = false;
+	mJobFilesAdded = 0;
+	mJobBytesAdded = 0;
+	mJobBlocksExported = 0;
+	mJobBlocksToExport = 0;
+	mJobBytesWritten = 0;
+}
+
+/****************************** GetJobProgress ********************************/
+void StorageAccess::GetJobProgress(
+	SJobProgress&	outProgress) const
+{
+	outProgress.filesAdded = mJobFilesAdded;
+	outProgress.bytesAdded = mJobBytesAdded;
+	outProgress.blocksExported = mJobBlocksExported;
+	outProgress.blocksToExport = mJobBlocksToExport;
+	outProgress.bytesWritten = mJobBytesWritten;
+	outProgress.cancelled = mJobCancelled;
+}
+
 /****************************** ClearBlockMap *********************************/
 void StorageAccess::ClearBlockMap(void)
 {
+	EndDelta();
 	BlockMap::iterator	itr = mBlockMap.begin();
 	BlockMap::iterator	itrEnd = mBlockMap.end();
 	for (; itr != itrEnd; ++itr)
@@ -487,17 +3937,43 @@ DSTATUS StorageAccess::GetDiskStatus(void)
 }
 
 /***************************** InitializeDisk *********************************/
+/*
+*	The block size and volume size come from the user defaults unless an image
+*	was loaded (see MountImage), in which case the block map isn't empty and
+*	the image's sizes are kept.  Format always starts with an empty block map.
+*/
 DSTATUS StorageAccess::InitializeDisk(void)
 {
-	NSNumber*	blockSize = [[NSUserDefaults standardUserDefaults] objectForKey:@"blockSize"];
-	mBlockSize = blockSize.intValue;
+	if (mBlockMap.empty())
+	{
+		NSNumber*	blockSize = [[NSUserDefaults standardUserDefaults] objectForKey:@"blockSize"];
+		mBlockSize = blockSize.intValue;
+		NSNumber*	volumeSize = [[NSUserDefaults standardUserDefaults] objectForKey:@"volumeSize"];
+		mVolumeSize = volumeSize.intValue * 0x100000;
+	}
 	NSNumber*	pageSize = [[NSUserDefaults standardUserDefaults] objectForKey:@"pageSize"];
 	mPageSize = pageSize.intValue;
-	NSNumber*	volumeSize = [[NSUserDefaults standardUserDefaults] objectForKey:@"volumeSize"];
-	mVolumeSize = volumeSize.intValue * 0x100000;
+	NSNumber*	eraseUnitLayout = [[NSUserDefaults standardUserDefaults] objectForKey:@"eraseUnitLayout"];
+	mEraseUnitLayout = eraseUnitLayout.boolValue;
 #ifdef DEBUG
 	fprintf(stderr, "InitializeDisk mBlockSize = %d, mPageSize = %d, mVolumeSize = %d\n", mBlockSize, mPageSize, mVolumeSize);
 #endif
+	/*
+	*	FatFs is configured for variable sector sizes from FF_MIN_SS to
+	*	FF_MAX_SS (512 to 4096).  The block size must be a power of 2 within
+	*	this range.  4096 matches the 4KB erase sector of the W25Q NOR Flash
+	*	parts.
+	*/
+	if (mBlockSize < FF_MIN_SS ||
+		mBlockSize > FF_MAX_SS ||
+		(mBlockSize & (mBlockSize - 1)) != 0)
+	{
+#ifdef DEBUG
+		fprintf(stderr, "InitializeDisk - unsupported block size %d\n", mBlockSize);
+#endif
+		mBlockSize = 0;
+		return(STA_NOINIT);
+	}
 	return(0);
 }
 
@@ -615,7 +4091,7 @@ DRESULT StorageAccess::DiskIoctl(
 			*	f_mkfs function and it attempts to align data area on the erase
 			*	block boundary. Required at FF_USE_MKFS == 1
 			*/
-			*(DWORD*)inBuffer = mPageSize/mBlockSize;
+			*(DWORD*)inBuffer = mPageSize > mBlockSize ? mPageSize/mBlockSize : 1;
 			break;
 		}
 		case CTRL_TRIM:
@@ -0,0 +1,178 @@
+/*******************************************************************************
+	License
+	****************************************************************************
+	This program is free software; you can redistribute it
+	and/or modify it under the terms of the GNU General
+	Public License as published by the Free Software
+	Foundation; either version 3 of the License, or
+	(at your option) any later version.
+ 
+	This program is distributed in the hope that it will
+	be useful, but WITHOUT ANY WARRANTY; without even the
+	implied warranty of MERCHANTABILITY or FITNESS FOR A
+	PARTICULAR PURPOSE. See the GNU General Public
+	License for more details.
+ 
+	Licence can be viewed at
+	http://www.gnu.org/licenses/gpl-3.0.txt
+//
+	Please maintain this license information along with authorship
+	and copyright notices in any redistribution of this code
+*******************************************************************************/
+//
+//
+//  DeviceWriteTest.mm
+//  FatFsToHexTests
+//
+//  Builds a volume and writes it with StorageAccess::WriteToDevice to a file
+//  standing in for the device, then checks the file against the block map.
+//  The file starts out filled with a pattern so that the blocks that must
+//  be left as is can be told from the blocks written.  It tests the macOS
+//  path of WriteToDevice (F_NOCACHE), see the Makefile.
+//
+//  usage: DeviceWriteTest [block size]
+//
+#import <Foundation/Foundation.h>
+#include "StorageAccess.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+static const uint8_t	kPriorData = 0xA5;	// The device's content before the write
+
+/******************************** MakeDevice **********************************/
+/*
+*	Creates the file standing in for the device, inLength bytes of
+*	kPriorData.
+*/
+static bool MakeDevice(
+	const char*	inPath,
+	size_t		inLength)
+{
+	std::vector<uint8_t>	data(inLength, kPriorData);
+	FILE*	file = fopen(inPath, "wb");
+	bool	success = file != NULL &&
+					fwrite(data.data(), 1, inLength, file) == inLength;
+	if (file)
+	{
+		success = fclose(file) == 0 && success;
+	}
+	return(success);
+}
+
+/******************************* CheckDevice **********************************/
+/*
+*	Each used block must match the block map.  Unused blocks must still be
+*	kPriorData, or zeros up to the end of the image when inZeroUnused.  The
+*	file must not have been truncated or extended.
+*/
+static bool CheckDevice(
+	const char*	inPath,
+	size_t		inLength,
+	bool		inZeroUnused)
+{
+	StorageAccess*	storageAccess = StorageAccess::GetInstance();
+	uint32_t	blockSize = storageAccess->GetBlockSize();
+	uint32_t	imageBlocks = storageAccess->GetHighestBlockIndex() + 1;
+	std::vector<uint8_t>	data(inLength + 1);
+	FILE*	file = fopen(inPath, "rb");
+	size_t	fileLength = file ? fread(data.data(), 1, data.size(), file) : 0;
+	if (file)
+	{
+		fclose(file);
+	}
+	if (fileLength != inLength)
+	{
+		fprintf(stderr, "%s is %zu bytes, expected %zu\n", inPath, fileLength, inLength);
+		return(false);
+	}
+	std::vector<uint8_t>	unused(blockSize);
+	for (uint32_t blockIndex = 0; blockIndex < inLength / blockSize; blockIndex++)
+	{
+		const uint8_t*	expected = storageAccess->GetBlock(blockIndex);
+		if (!expected)
+		{
+			memset(unused.data(), inZeroUnused && blockIndex < imageBlocks ? 0 : kPriorData, blockSize);
+			expected = unused.data();
+		}
+		if (memcmp(&data[(size_t)blockIndex * blockSize], expected, blockSize))
+		{
+			fprintf(stderr, "%s block %u doesn't match\n", inPath, blockIndex);
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/************************************ main ************************************/
+int main(
+	int		argc,
+	char**	argv)
+{
+	@autoreleasepool
+	{
+		int	blockSize = argc > 1 ? atoi(argv[1]) : 512;
+		[[NSUserDefaults standardUserDefaults] registerDefaults:@{
+			@"blockSize" : @(blockSize),
+			@"pageSize" : @4096,
+			@"volumeSize" : @8}];
+		char	dirPath[] = "/tmp/DeviceWriteTestXXXXXX";
+		if (!mkdtemp(dirPath))
+		{
+			perror("mkdtemp");
+			return(1);
+		}
+		std::string	sourcePath = std::string(dirPath) + "/source.bin";
+		std::string	devicePath = std::string(dirPath) + "/device.img";
+		/*
+		*	A file with runs of zeros and data, so that some blocks are used
+		*	and the rest of the volume is left unused.
+		*/
+		FILE*	file = fopen(sourcePath.c_str(), "wb");
+		for (int i = 0; file && i < 300000; i++)
+		{
+			fputc(i % 7 ? 0 : (uint8_t)i, file);
+		}
+		bool	success = file != NULL && fclose(file) == 0;
+		StorageAccess::Create();
+		StorageAccess*	storageAccess = StorageAccess::GetInstance();
+		char	dosName[20];
+		success = success &&
+					storageAccess->Format() &&
+					storageAccess->AddFile(sourcePath.c_str(), "a.bin", dosName);
+		if (!success)
+		{
+			fprintf(stderr, "Unable to build the volume\n");
+		}
+		/*
+		*	Used blocks written over prior data, unused blocks left as is.
+		*	The device is larger than the image, and the part past the end
+		*	of the image must not be touched.
+		*/
+		size_t	deviceLength = (size_t)(storageAccess->GetHighestBlockIndex() + 1) * storageAccess->GetBlockSize() + 0x10000;
+		for (int zeroUnused = 0; success && zeroUnused < 2; zeroUnused++)
+		{
+			success = MakeDevice(devicePath.c_str(), deviceLength) &&
+						storageAccess->WriteToDevice(devicePath.c_str(), zeroUnused, true) &&
+						CheckDevice(devicePath.c_str(), deviceLength, zeroUnused);
+			printf("%s unused blocks %s\n", success ? "ok  " : "FAIL", zeroUnused ? "zeroed" : "kept");
+		}
+		// A new file is created and written up to the end of the image
+		unlink(devicePath.c_str());
+		if (success)
+		{
+			success = storageAccess->WriteToDevice(devicePath.c_str(), true, true) &&
+						CheckDevice(devicePath.c_str(),
+							(size_t)(storageAccess->GetHighestBlockIndex() + 1) * storageAccess->GetBlockSize(), true);
+			printf("%s new file\n", success ? "ok  " : "FAIL");
+		}
+		StorageAccess::Release();
+		unlink(sourcePath.c_str());
+		unlink(devicePath.c_str());
+		rmdir(dirPath);
+		return(success ? 0 : 1);
+	}
+}
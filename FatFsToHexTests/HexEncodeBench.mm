@@ -0,0 +1,182 @@
+/*******************************************************************************
+	License
+	****************************************************************************
+	This program is free software; you can redistribute it
+	and/or modify it under the terms of the GNU General
+	Public License as published by the Free Software
+	Foundation; either version 3 of the License, or
+	(at your option) any later version.
+ 
+	This program is distributed in the hope that it will
+	be useful, but WITHOUT ANY WARRANTY; without even the
+	implied warranty of MERCHANTABILITY or FITNESS FOR A
+	PARTICULAR PURPOSE. See the GNU General Public
+	License for more details.
+ 
+	Licence can be viewed at
+	http://www.gnu.org/licenses/gpl-3.0.txt
+//
+	Please maintain this license information along with authorship
+	and copyright notices in any redistribution of this code
+*******************************************************************************/
+//
+//  HexEncodeBench.mm
+//  FatFsToHexTests
+//
+//  Times StorageAccess's hex record encoder against the original nibble at a
+//  time encoder, after checking that both produce the same records.
+//
+//  usage: HexEncodeBench [megabytes]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+// StorageAccess.mm
+size_t ToIntelHexLine(
+	const uint8_t*	inData,
+	uint8_t			inDataLen,
+	uint16_t		inAddress,
+	uint8_t			inRecordType,
+	char*			inLineBuffer);
+
+static const uint8_t	kRecordTypeData = 0;
+static const uint8_t	kRecordTypeExLinAddr = 4;
+static const char		kHexChars[] = "0123456789ABCDEF";
+
+/***************************** RefInt8ToHexStr ********************************/
+static char* RefInt8ToHexStr(
+	uint8_t	inNum,
+	char*	inBuffer)
+{
+	char*	bufPtr = &inBuffer[1];
+	for (; bufPtr >= inBuffer; bufPtr--)
+	{
+		*bufPtr =  kHexChars[inNum & 0xF];
+		inNum >>= 4;
+	}
+	return(&inBuffer[2]);
+}
+
+/**************************** RefToIntelHexLine *******************************/
+/*
+*	The encoder as it was before the lookup table and SIMD conversion.
+*/
+static size_t RefToIntelHexLine(
+	const uint8_t*	inData,
+	uint8_t			inDataLen,
+	uint16_t		inAddress,
+	uint8_t			inRecordType,
+	char*			inLineBuffer)
+{
+	uint8_t	checksum = inDataLen;
+	uint8_t	thisByte = 0;
+
+	inLineBuffer[0] = ':';
+	char* nextHexBytePtr = RefInt8ToHexStr(inDataLen, &inLineBuffer[1]);
+	if (inRecordType != kRecordTypeExLinAddr)
+	{
+		thisByte = inAddress >> 8;
+		nextHexBytePtr = RefInt8ToHexStr(thisByte, nextHexBytePtr);
+		checksum += thisByte;
+		thisByte = inAddress & 0xFF;
+		nextHexBytePtr = RefInt8ToHexStr(thisByte, nextHexBytePtr);
+		checksum += thisByte;
+		nextHexBytePtr = RefInt8ToHexStr(inRecordType, nextHexBytePtr);
+		checksum += inRecordType;
+		for (uint8_t i = 0; i < inDataLen; i++)
+		{
+			thisByte = inData[i];
+			nextHexBytePtr = RefInt8ToHexStr(thisByte, nextHexBytePtr);
+			checksum += thisByte;
+		}
+	} else
+	{
+		nextHexBytePtr = RefInt8ToHexStr(0, nextHexBytePtr);
+		nextHexBytePtr = RefInt8ToHexStr(0, nextHexBytePtr);
+		nextHexBytePtr = RefInt8ToHexStr(kRecordTypeExLinAddr, nextHexBytePtr);
+		checksum += kRecordTypeExLinAddr;
+		thisByte = inAddress >> 8;
+		nextHexBytePtr = RefInt8ToHexStr(thisByte, nextHexBytePtr);
+		checksum += thisByte;
+		thisByte = inAddress & 0xFF;
+		nextHexBytePtr = RefInt8ToHexStr(thisByte, nextHexBytePtr);
+		checksum += thisByte;
+	}
+	nextHexBytePtr = RefInt8ToHexStr(-checksum, nextHexBytePtr);
+	*(nextHexBytePtr++) = '\n';
+	*nextHexBytePtr = 0;
+	return(nextHexBytePtr - inLineBuffer);
+}
+
+/********************************* TimeEncoder ********************************/
+/*
+*	Returns the input rate of inEncoder in MB/s, encoding all of inData as
+*	records of inRecordLength bytes.
+*/
+typedef size_t (*HexLineEncoder)(const uint8_t*, uint8_t, uint16_t, uint8_t, char*);
+static double TimeEncoder(
+	HexLineEncoder					inEncoder,
+	const std::vector<uint8_t>&		inData,
+	uint8_t							inRecordLength)
+{
+	char	line[600];
+	size_t	dataLength = inData.size() - 256;
+	volatile size_t	totalLength = 0;	// So the encoding isn't optimized away
+	std::chrono::steady_clock::time_point	startTime = std::chrono::steady_clock::now();
+	for (size_t offset = 0; offset < dataLength; offset += inRecordLength)
+	{
+		totalLength += inEncoder(&inData[offset], inRecordLength, (uint16_t)offset, kRecordTypeData, line);
+	}
+	double	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	return(dataLength / seconds / 1e6);
+}
+
+/************************************ main ************************************/
+int main(
+	int		argc,
+	char**	argv)
+{
+	size_t	megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 32;
+	std::vector<uint8_t>	data((megabytes << 20) + 256);
+	srandom(1);
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = (uint8_t)random();
+	}
+	/*
+	*	Every record length and type at random offsets must match the
+	*	reference byte for byte.
+	*/
+	char	line[600];
+	char	refLine[600];
+	for (uint32_t recordLength = 0; recordLength <= 255; recordLength++)
+	{
+		for (uint8_t recordType = kRecordTypeData; recordType <= kRecordTypeExLinAddr; recordType++)
+		{
+			size_t	offset = random() % (data.size() - 256);
+			const uint8_t*	recordData = recordType == kRecordTypeExLinAddr ? NULL : &data[offset];
+			uint8_t	dataLength = recordType == kRecordTypeExLinAddr ? 2 : (uint8_t)recordLength;
+			size_t	lineLength = ToIntelHexLine(recordData, dataLength, (uint16_t)offset, recordType, line);
+			size_t	refLineLength = RefToIntelHexLine(recordData, dataLength, (uint16_t)offset, recordType, refLine);
+			if (lineLength != refLineLength ||
+				memcmp(line, refLine, lineLength + 1))
+			{
+				fprintf(stderr, "Mismatch, record length %u type %u\n%s%s", recordLength, recordType, refLine, line);
+				return(1);
+			}
+		}
+	}
+	static const uint8_t	kRecordLengths[] = {16, 32, 64, 255};
+	for (size_t i = 0; i < sizeof(kRecordLengths); i++)
+	{
+		double	refRate = TimeEncoder(RefToIntelHexLine, data, kRecordLengths[i]);
+		double	rate = TimeEncoder(ToIntelHexLine, data, kRecordLengths[i]);
+		printf("%3u byte records: %7.0f MB/s, reference %6.0f MB/s, %.1fx\n",
+			kRecordLengths[i], rate, refRate, rate / refRate);
+	}
+	return(0);
+}
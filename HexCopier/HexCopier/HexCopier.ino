@@ -40,6 +40,11 @@
 *	filling it with nulls.
 *	- Once a block is full OR the address changes to a new block, then write the
 *	current block to the device.
+*	- When the FatFs sector size (SECTOR_SIZE) is larger than the block buffer,
+*	any blocks of the current sector not contained in the hex are written as
+*	nulls.
+*	- A null run record (type 0x10, a FatFsToHex extension) writes the current
+*	block, then writes nulls to the run of blocks it describes.
 *
 */
 #include <SPI.h>
@@ -78,7 +83,12 @@ enum EIntelHexRecordType
 	eRecordTypeExSegAddr,	// 2
 	eRecordTypeStSegAddr,	// 3
 	eRecordTypeExLinAddr,	// 4
-	eRecordTypeStLinAddr	// 5
+	eRecordTypeStLinAddr,	// 5
+	/*
+	*	FatFsToHex extension.  The 4 data bytes are the big endian length of a
+	*	run of null blocks starting at the record's address.
+	*/
+	eRecordTypeNullRun = 0x10
 };
 
 enum EIntelHexStatus
@@ -89,6 +99,16 @@ enum EIntelHexStatus
 };
 
 const uint32_t	kBlockSize = 512;
+/*
+*	SECTOR_SIZE must match the block size the FatFs image was created with (512
+*	to 4096.)  The RAM buffer remains kBlockSize because of the 328p's 2KB of
+*	RAM.  A 4KB sector matches the W25Q erase sector size.
+*/
+#ifndef SECTOR_SIZE
+#define SECTOR_SIZE	512
+#endif
+const uint32_t	kSectorSize = SECTOR_SIZE;
+const uint32_t	kBlocksPerSector = kSectorSize/kBlockSize;
 static uint8_t	sBuffer[kBlockSize];
 static bool		sVerifyAfterWrite = true;
 static bool		sEraseBeforeWrite;
@@ -102,7 +122,17 @@ static uint8_t	sHexFileBuffer[kHexFileBufferSize];
 static uint8_t*	sHexFileBufferPtr;
 static uint8_t*	sHexFileEOBPtr;
 
-#define MAX_HEX_LINE_LEN	45
+/*
+*	HEX_RECORD_LEN is the number of data bytes per hex record, and must match
+*	the record length of the FatFsToHex target profile used to create FLASH.HEX
+*	("SD copier" = 64.)  Larger records reduce the size of the hex file, but
+*	each data byte adds 2 bytes to the line buffer.  The 2 extra characters
+*	allow for a CR LF line ending.
+*/
+#ifndef HEX_RECORD_LEN
+#define HEX_RECORD_LEN	64
+#endif
+#define MAX_HEX_LINE_LEN	(13 + (HEX_RECORD_LEN * 2))
 static uint8_t	sLineBuffer[MAX_HEX_LINE_LEN];
 static uint8_t*	sLineBufferPtr;
 static uint8_t*	sEndOfLineBufferPtr;
@@ -315,6 +345,92 @@ bool WriteBlock(
 	return(success);
 }
 
+/****************************** WriteNullBlocks *******************************/
+/*
+*	Writes nulls to blocks inFromIndex up to but not including inToIndex.
+*/
+bool WriteNullBlocks(
+	uint32_t	inFromIndex,
+	uint32_t	inToIndex)
+{
+	bool	success = true;
+	if (inFromIndex < inToIndex)
+	{
+		uint8_t*	nullBlock = ClearBuffer();
+		for (; success && inFromIndex < inToIndex; inFromIndex++)
+		{
+			success = WriteBlock(nullBlock, inFromIndex);
+		}
+		if (!success)
+		{
+			Serial.print(F("?Failed writing null block\n"));
+		}
+	}
+	return(success);
+}
+
+/****************************** FillSectorGaps ********************************/
+/*
+*	The hex only contains the non-null lines of a sector.  When the sector is
+*	larger than the block buffer, the blocks of the sector skipped by the hex
+*	must be written as nulls.  Blocks between sectors are not accessed by FatFs
+*	and are left as is.  inNewBlockIndex of 0xFFFFFFFF means the end of the
+*	data, in which case only the rest of the current sector is filled.
+*/
+bool FillSectorGaps(
+	uint32_t	inCurrentBlockIndex,
+	uint32_t	inNewBlockIndex)
+{
+	bool	success = true;
+	if (kBlocksPerSector > 1)
+	{
+		uint32_t	newSectorStart = inNewBlockIndex - (inNewBlockIndex % kBlocksPerSector);
+		if (inCurrentBlockIndex != 0xFFFFFFFF)
+		{
+			uint32_t	currentSectorEnd = inCurrentBlockIndex - (inCurrentBlockIndex % kBlocksPerSector) + kBlocksPerSector;
+			if (inNewBlockIndex < currentSectorEnd)
+			{
+				return(WriteNullBlocks(inCurrentBlockIndex+1, inNewBlockIndex));
+			}
+			success = WriteNullBlocks(inCurrentBlockIndex+1, currentSectorEnd);
+		}
+		if (success &&
+			inNewBlockIndex != 0xFFFFFFFF)
+		{
+			success = WriteNullBlocks(newSectorStart, inNewBlockIndex);
+		}
+	}
+	return(success);
+}
+
+/******************************* WriteNullRun *********************************/
+/*
+*	Writes the current block (if any) followed by inLength bytes of nulls
+*	starting at inAddress.  On return there is no current block data, and
+*	ioCurrentBlockIndex is the last block of the run.
+*/
+bool WriteNullRun(
+	uint32_t	inAddress,
+	uint32_t	inLength,
+	uint32_t&	ioCurrentBlockIndex,
+	uint8_t*&	ioData)
+{
+	uint32_t	runStartIndex = inAddress / kBlockSize;
+	uint32_t	runEndIndex = runStartIndex + (inLength / kBlockSize);
+	bool	success = inLength != 0 &&
+			(inAddress % kBlockSize) == 0 &&
+			(inLength % kBlockSize) == 0 &&
+			WriteBlock(ioData, ioCurrentBlockIndex) &&
+			FillSectorGaps(ioCurrentBlockIndex, runStartIndex) &&
+			WriteNullBlocks(runStartIndex, runEndIndex);
+	if (success)
+	{
+		ioCurrentBlockIndex = runEndIndex - 1;
+		ioData = NULL;
+	}
+	return(success);
+}
+
 /****************************** HexAsciiToBin *********************************/
 // Assumes 0-9, A-Z (uppercase)
 uint8_t	HexAsciiToBin(
@@ -408,6 +524,7 @@ void HexCopy(void)
 	uint32_t	address = 0;
 	uint32_t	currentBlockIndex = 0xFFFFFFFF;
 	uint32_t	baseAddress = 0;
+	uint32_t	runLength = 0;
 	uint8_t		recordType = eRecordTypeData;
 	uint8_t		checksum = 0;
 	uint8_t		hiLow = 1;
@@ -482,7 +599,8 @@ void HexCopy(void)
 								*/
 								if (currentBlockIndex != newBlockIndex)
 								{
-									if (WriteBlock(data, currentBlockIndex))
+									if (WriteBlock(data, currentBlockIndex) &&
+										FillSectorGaps(currentBlockIndex, newBlockIndex))
 									{
 										currentBlockIndex = newBlockIndex;
 										data = ClearBuffer();
@@ -493,6 +611,15 @@ void HexCopy(void)
 										break;
 									}
 								}
+								/*
+								*	A record must fit within the block buffer.
+								*/
+								if ((address % kBlockSize) + byteCount > kBlockSize)
+								{
+									Serial.print(F("?Record spans a block\n"));
+									status = eError;
+									break;
+								}
 								dataPtr = &data[address % kBlockSize];
 							} else if (recordType == eRecordTypeExLinAddr)
 							{
@@ -502,6 +629,14 @@ void HexCopy(void)
 									Serial.print(F("?byteCount for RecordTypeExLinAddr not 2\n"));
 									status = eError;
 								}
+							} else if (recordType == eRecordTypeNullRun)
+							{
+								runLength = 0;
+								if (byteCount != 4)
+								{
+									Serial.print(F("?byteCount for RecordTypeNullRun not 4\n"));
+									status = eError;
+								}
 							} else if (recordType == eRecordTypeEOF)
 							{
 								state++;	// Skip eGetData
@@ -515,6 +650,9 @@ void HexCopy(void)
 							if (recordType == eRecordTypeData)
 							{
 								dataPtr[dataIndex] = thisByte;
+							} else if (recordType == eRecordTypeNullRun)
+							{
+								runLength = (runLength << 8) + thisByte;
 							} else
 							{
 								address = (address << 8) + thisByte;
@@ -533,6 +671,15 @@ void HexCopy(void)
 								if (recordType == eRecordTypeExLinAddr)
 								{
 									baseAddress = address << 16;
+								} else if (recordType == eRecordTypeNullRun)
+								{
+									if (!WriteNullRun(baseAddress + address, runLength,
+											currentBlockIndex, data))
+									{
+										Serial.print(F("?Failed writing null run\n"));
+										status = eError;
+										break;
+									}
 								} else if (recordType == eRecordTypeEOF)
 								{
 									status = eDone;
@@ -555,6 +702,7 @@ void HexCopy(void)
 	if (status == eDone)
 	{
 		WriteBlock(data, currentBlockIndex);
+		FillSectorGaps(currentBlockIndex, 0xFFFFFFFF);
 		Serial.print(F("Success!\n"));
 	}
 	// Clean out the rest of the serial buffer, if any
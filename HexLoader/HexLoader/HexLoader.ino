@@ -34,6 +34,13 @@
 *	- respond with *
 *	- loop till end hex command hit.
 *
+*	A W (or w) starts a pipelined hex download.  The response is the line
+*	credit, a single digit, followed by the *.  The host may then have up to the
+*	credit of lines in flight, with each * returning the credit of the oldest.
+*
+*	A B (or b) starts a binary download, see BinaryDownload.  The response and
+*	the * for each packet processed are the same as for W.
+*
 *	At any time if anything other than a line start is received when expected 
 *	or an invalid character, respond with a ? follwed by an error message.
 *
@@ -42,9 +49,15 @@
 *	filling it with nulls.
 *	- Once a block is full OR the address changes to a new block, then write the
 *	current block to the device.
+*	- When the FatFs sector size (SECTOR_SIZE) is larger than the block buffer,
+*	any blocks of the current sector not contained in the hex are written as
+*	nulls.
+*	- A null run record (type 0x10, a FatFsToHex extension) writes the current
+*	block, then writes nulls to the run of blocks it describes.
 *
 */
 #include <SPI.h>
+#include <util/crc16.h>
 
 const uint8_t SdChipSelect = 10;
 
@@ -80,7 +93,12 @@ enum EIntelHexRecordType
 	eRecordTypeExSegAddr,	// 2
 	eRecordTypeStSegAddr,	// 3
 	eRecordTypeExLinAddr,	// 4
-	eRecordTypeStLinAddr	// 5
+	eRecordTypeStLinAddr,	// 5
+	/*
+	*	FatFsToHex extension.  The 4 data bytes are the big endian length of a
+	*	run of null blocks starting at the record's address.
+	*/
+	eRecordTypeNullRun = 0x10
 };
 
 enum EIntelHexStatus
@@ -91,14 +109,65 @@ enum EIntelHexStatus
 };
 
 const uint32_t	kBlockSize = 512;
+/*
+*	SECTOR_SIZE must match the block size the FatFs image was created with (512
+*	to 4096.)  The RAM buffer remains kBlockSize because of the 328p's 2KB of
+*	RAM.  A 4KB sector matches the W25Q erase sector size.
+*/
+#ifndef SECTOR_SIZE
+#define SECTOR_SIZE	512
+#endif
+const uint32_t	kSectorSize = SECTOR_SIZE;
+const uint32_t	kBlocksPerSector = kSectorSize/kBlockSize;
 #ifndef USE_SD
 static uint8_t	sBuffer[kBlockSize];
 static bool		sVerifyAfterWrite = true;
 static bool		sEraseBeforeWrite;
 static uint32_t	sCurrent64KBlk;
 #endif
-#define MAX_HEX_LINE_LEN	45
+/*
+*	HEX_RECORD_LEN is the number of data bytes per hex record, and must match
+*	the record length of the FatFsToHex target profile ("ATmega serial" = 16.)
+*	The host sends a line only after the previous line was processed (or within
+*	the pipelined line credit), but a line must still fit in the 64 byte serial
+*	ring buffer, so the maximum is 26.  The 2 extra characters allow for a CR LF
+*	line ending.
+*/
+#ifndef HEX_RECORD_LEN
+#define HEX_RECORD_LEN	16
+#endif
+#define MAX_HEX_LINE_LEN	(13 + (HEX_RECORD_LEN * 2))
+/*
+*	The line credit is the line being processed plus the number of lines that
+*	fit in the serial ring buffer while it's processed (a block write or 64KB
+*	erase.)  For the default 64 byte buffer and 16 byte records this is 2, so
+*	the next line is always waiting when a line has been processed.
+*/
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE	64
+#endif
+#define LINE_CREDIT	((SERIAL_RX_BUFFER_SIZE / MAX_HEX_LINE_LEN) + 1)
+const uint8_t	kLineCredit = LINE_CREDIT > 9 ? 9 : LINE_CREDIT;
 static uint8_t	sLineBuffer[MAX_HEX_LINE_LEN];
+
+/*
+*	Binary block packets, see BinaryDownload.  Except for the end packet, the
+*	type is followed by the big endian index of the first 512 byte block.
+*/
+enum EBlockPacketType
+{
+	ePacketData		= 'D',	// + 16 bit offset in the block + the data from the offset
+	ePacketNullRun	= 'N',	// + 32 bit count of null blocks
+	ePacketEnd		= 'E',
+	ePacketCompressed = 'Z'	// As ePacketData, with the data compressed
+};
+const uint8_t	kMaxPacketHeaderLen = 9;
+/*
+*	A packet frame is larger than the serial ring buffer, and a block write
+*	or 64KB erase takes longer than the ring buffer takes to fill, so only one
+*	packet can be in flight.
+*/
+const uint8_t	kPacketCredit = 1;
 static uint8_t*	sLineBufferPtr;
 static uint8_t*	sEndOfLineBufferPtr;
 
@@ -164,6 +233,16 @@ void loop()
 		case 'H':	// Erase before write (default)
 			HexDownload();
 			break;
+		case 'w':
+		case 'W':	// Pipelined
+			Serial.write('0' + kLineCredit);
+			HexDownload();
+			break;
+		case 'b':
+		case 'B':	// Binary
+			Serial.write('0' + kPacketCredit);
+			BinaryDownload();
+			break;
 	#else
 		case 'H':	// Erase before write
 			sEraseBeforeWrite = true;
@@ -180,6 +259,28 @@ void loop()
 			sEraseBeforeWrite = false;
 			HexDownload();
 			break;
+		case 'W':	// Pipelined, erase before write
+			sEraseBeforeWrite = true;
+			sCurrent64KBlk = 0xF0000000;
+			Serial.write('0' + kLineCredit);
+			HexDownload();
+			break;
+		case 'w':	// Pipelined, don't erase before write
+			sEraseBeforeWrite = false;
+			Serial.write('0' + kLineCredit);
+			HexDownload();
+			break;
+		case 'B':	// Binary, erase before write
+			sEraseBeforeWrite = true;
+			sCurrent64KBlk = 0xF0000000;
+			Serial.write('0' + kPacketCredit);
+			BinaryDownload();
+			break;
+		case 'b':	// Binary, don't erase before write
+			sEraseBeforeWrite = false;
+			Serial.write('0' + kPacketCredit);
+			BinaryDownload();
+			break;
 		case 'E':
 			FullErase();
 			break;
@@ -314,6 +415,92 @@ bool WriteBlock(
 	return(success);
 }
 
+/****************************** WriteNullBlocks *******************************/
+/*
+*	Writes nulls to blocks inFromIndex up to but not including inToIndex.
+*/
+bool WriteNullBlocks(
+	uint32_t	inFromIndex,
+	uint32_t	inToIndex)
+{
+	bool	success = true;
+	if (inFromIndex < inToIndex)
+	{
+		uint8_t*	nullBlock = ClearBuffer();
+		for (; success && inFromIndex < inToIndex; inFromIndex++)
+		{
+			success = WriteBlock(nullBlock, inFromIndex);
+		}
+		if (!success)
+		{
+			Serial.print("?Failed writing null block\n");
+		}
+	}
+	return(success);
+}
+
+/****************************** FillSectorGaps ********************************/
+/*
+*	The hex only contains the non-null lines of a sector.  When the sector is
+*	larger than the block buffer, the blocks of the sector skipped by the hex
+*	must be written as nulls.  Blocks between sectors are not accessed by FatFs
+*	and are left as is.  inNewBlockIndex of 0xFFFFFFFF means the end of the
+*	data, in which case only the rest of the current sector is filled.
+*/
+bool FillSectorGaps(
+	uint32_t	inCurrentBlockIndex,
+	uint32_t	inNewBlockIndex)
+{
+	bool	success = true;
+	if (kBlocksPerSector > 1)
+	{
+		uint32_t	newSectorStart = inNewBlockIndex - (inNewBlockIndex % kBlocksPerSector);
+		if (inCurrentBlockIndex != 0xFFFFFFFF)
+		{
+			uint32_t	currentSectorEnd = inCurrentBlockIndex - (inCurrentBlockIndex % kBlocksPerSector) + kBlocksPerSector;
+			if (inNewBlockIndex < currentSectorEnd)
+			{
+				return(WriteNullBlocks(inCurrentBlockIndex+1, inNewBlockIndex));
+			}
+			success = WriteNullBlocks(inCurrentBlockIndex+1, currentSectorEnd);
+		}
+		if (success &&
+			inNewBlockIndex != 0xFFFFFFFF)
+		{
+			success = WriteNullBlocks(newSectorStart, inNewBlockIndex);
+		}
+	}
+	return(success);
+}
+
+/******************************* WriteNullRun *********************************/
+/*
+*	Writes the current block (if any) followed by inLength bytes of nulls
+*	starting at inAddress.  On return there is no current block data, and
+*	ioCurrentBlockIndex is the last block of the run.
+*/
+bool WriteNullRun(
+	uint32_t	inAddress,
+	uint32_t	inLength,
+	uint32_t&	ioCurrentBlockIndex,
+	uint8_t*&	ioData)
+{
+	uint32_t	runStartIndex = inAddress / kBlockSize;
+	uint32_t	runEndIndex = runStartIndex + (inLength / kBlockSize);
+	bool	success = inLength != 0 &&
+			(inAddress % kBlockSize) == 0 &&
+			(inLength % kBlockSize) == 0 &&
+			WriteBlock(ioData, ioCurrentBlockIndex) &&
+			FillSectorGaps(ioCurrentBlockIndex, runStartIndex) &&
+			WriteNullBlocks(runStartIndex, runEndIndex);
+	if (success)
+	{
+		ioCurrentBlockIndex = runEndIndex - 1;
+		ioData = NULL;
+	}
+	return(success);
+}
+
 /****************************** HexAsciiToBin *********************************/
 // Assumes 0-9, A-Z (uppercase)
 uint8_t	HexAsciiToBin(
@@ -393,6 +580,7 @@ void HexDownload(void)
 	uint32_t	address = 0;
 	uint32_t	currentBlockIndex = 0xFFFFFFFF;
 	uint32_t	baseAddress = 0;
+	uint32_t	runLength = 0;
 	uint8_t		recordType = eRecordTypeData;
 	uint8_t		checksum = 0;
 	uint8_t		hiLow = 1;
@@ -467,7 +655,8 @@ void HexDownload(void)
 								*/
 								if (currentBlockIndex != newBlockIndex)
 								{
-									if (WriteBlock(data, currentBlockIndex))
+									if (WriteBlock(data, currentBlockIndex) &&
+										FillSectorGaps(currentBlockIndex, newBlockIndex))
 									{
 										currentBlockIndex = newBlockIndex;
 										data = ClearBuffer();
@@ -478,6 +667,15 @@ void HexDownload(void)
 										break;
 									}
 								}
+								/*
+								*	A record must fit within the block buffer.
+								*/
+								if ((address % kBlockSize) + byteCount > kBlockSize)
+								{
+									Serial.print("?Record spans a block\n");
+									status = eError;
+									break;
+								}
 								dataPtr = &data[address % kBlockSize];
 							} else if (recordType == eRecordTypeExLinAddr)
 							{
@@ -487,6 +685,14 @@ void HexDownload(void)
 									Serial.print("?byteCount for RecordTypeExLinAddr not 2\n");
 									status = eError;
 								}
+							} else if (recordType == eRecordTypeNullRun)
+							{
+								runLength = 0;
+								if (byteCount != 4)
+								{
+									Serial.print("?byteCount for RecordTypeNullRun not 4\n");
+									status = eError;
+								}
 							} else if (recordType == eRecordTypeEOF)
 							{
 								state++;	// Skip eGetData
@@ -500,6 +706,9 @@ void HexDownload(void)
 							if (recordType == eRecordTypeData)
 							{
 								dataPtr[dataIndex] = thisByte;
+							} else if (recordType == eRecordTypeNullRun)
+							{
+								runLength = (runLength << 8) + thisByte;
 							} else
 							{
 								address = (address << 8) + thisByte;
@@ -518,6 +727,15 @@ void HexDownload(void)
 								if (recordType == eRecordTypeExLinAddr)
 								{
 									baseAddress = address << 16;
+								} else if (recordType == eRecordTypeNullRun)
+								{
+									if (!WriteNullRun(baseAddress + address, runLength,
+											currentBlockIndex, data))
+									{
+										Serial.print("?Failed writing null run\n");
+										status = eError;
+										break;
+									}
 								} else if (recordType == eRecordTypeEOF)
 								{
 									status = eDone;
@@ -540,12 +758,242 @@ void HexDownload(void)
 	if (status == eDone)
 	{
 		WriteBlock(data, currentBlockIndex);
+		FillSectorGaps(currentBlockIndex, 0xFFFFFFFF);
 		Serial.print("* success!\n");
 	}
+	FlushSerialInput();
+}
+
+/***************************** FlushSerialInput *******************************/
+void FlushSerialInput(void)
+{
 	// Clean out the rest of the serial buffer, if any
 	delay(1000);
 	while (Serial.available())
 	{
 		Serial.read();
 	}
+}
+
+/********************************* GetByte ************************************/
+/*
+*	Binary equivalent of GetChar, returns -1 on timeout.
+*/
+int16_t GetByte(void)
+{
+	uint32_t	timeout = millis() + 1000;
+	while (!Serial.available())
+	{
+		if (millis() < timeout)continue;
+		return(-1);
+	}
+	return(Serial.read());
+}
+
+/****************************** BinaryDownload ********************************/
+/*
+*	Receives COBS framed binary packets, each terminated by a null.  A decoded
+*	packet is the packet type, its parameters and data, followed by the big
+*	endian CRC-16/CCITT-FALSE of the packet.
+*
+*	A data packet carries one block from its offset in the block to its last
+*	non-null byte, the rest of the block is zeroed.  The packet is decoded
+*	directly into the block buffer, so no packet buffer is needed.  The last
+*	2 bytes decoded are held back until the next byte arrives because at the
+*	end of the frame they're the CRC rather than data.
+*
+*	A compressed packet is decoded into the block buffer the same way.  The
+*	compression is a small LZ77 whose only window is the block itself:
+*	0LLLLLLL			L + 1 literal bytes follow
+*	1LLLLLLD DDDDDDDD	copy L + 3 bytes from D + 1 bytes back in the block
+*	The bytes before the packet's offset are part of the window as nulls.
+*
+*	The block is written once its packet's CRC checks out, and only then is
+*	the * sent, so no data arrives while writing.  The host sends a packet for
+*	every block of a sector, null blocks as null runs, because the sector gaps
+*	can't be filled without overwriting the block buffer.  A stop (S) from the
+*	host is seen as a timeout or a bad packet.
+*/
+void BinaryDownload(void)
+{
+	uint8_t		status = eProcessing;
+	uint32_t	currentBlockIndex = 0xFFFFFFFF;
+	uint8_t*	data = NULL;
+	const char*	error = NULL;
+	
+	Serial.write('*');	// Tell the host the mode change was successful
+	while(status == eProcessing)
+	{
+		uint8_t		header[kMaxPacketHeaderLen] = {0};
+		uint8_t		headerLen = 1;
+		uint16_t	packetIndex = 0;	// Of the next byte past the held bytes
+		uint16_t	crc = 0xFFFF;
+		uint16_t	held = 0;
+		uint8_t		heldCount = 0;
+		uint16_t	offset = 0;
+		uint8_t		code = 0;
+		uint8_t		remaining = 0;
+		uint8_t		literals = 0;		// Literal bytes remaining
+		uint8_t		matchToken = 0;		// Waiting for the match distance
+		int16_t		thisByte;
+		
+		// Skip any delimiters preceding the frame
+		do
+		{
+			thisByte = GetByte();
+		} while (thisByte == 0);
+		
+		for (; thisByte > 0 && error == NULL; thisByte = GetByte())
+		{
+			/*
+			*	Decode COBS.  Each code byte is followed by code - 1 data
+			*	bytes.  Unless the code is 0xFF, a null follows the data bytes
+			*	when more of the frame follows.
+			*/
+			uint8_t	decoded;
+			if (remaining == 0)
+			{
+				bool	nullFollows = code != 0 && code != 0xFF;
+				code = thisByte;
+				remaining = code - 1;
+				if (!nullFollows)
+				{
+					continue;
+				}
+				decoded = 0;
+			} else
+			{
+				decoded = thisByte;
+				remaining--;
+			}
+			if (heldCount < 2)
+			{
+				held = (held << 8) + decoded;
+				heldCount++;
+				continue;
+			}
+			uint8_t	packetByte = held >> 8;
+			held = (held << 8) + decoded;
+			crc = _crc_xmodem_update(crc, packetByte);
+			if (packetIndex < headerLen)
+			{
+				header[packetIndex] = packetByte;
+				if (packetIndex == 0)
+				{
+					headerLen = (packetByte == ePacketData || packetByte == ePacketCompressed) ? 7 :
+									(packetByte == ePacketNullRun ? 9 : 1);
+				} else if (packetIndex == 6 &&
+					headerLen == 7)
+				{
+					offset = ((uint16_t)header[5] << 8) + header[6];
+					data = ClearBuffer();
+				}
+			} else if (header[0] == ePacketData &&
+				offset < kBlockSize)
+			{
+				data[offset++] = packetByte;
+			} else if (header[0] == ePacketCompressed)
+			{
+				if (literals)
+				{
+					literals--;
+					if (offset < kBlockSize)
+					{
+						data[offset++] = packetByte;
+					} else
+					{
+						error = "?Packet too long\n";
+					}
+				} else if (matchToken)
+				{
+					uint16_t	distance = (((uint16_t)(matchToken & 1) << 8) + packetByte) + 1;
+					uint8_t		length = ((matchToken >> 1) & 0x3F) + 3;
+					matchToken = 0;
+					if (distance <= offset &&
+						offset + length <= kBlockSize)
+					{
+						for (; length; length--, offset++)
+						{
+							data[offset] = data[offset - distance];
+						}
+					} else
+					{
+						error = "?Bad match\n";
+					}
+				} else if (packetByte & 0x80)
+				{
+					matchToken = packetByte;
+				} else
+				{
+					literals = packetByte + 1;
+				}
+			} else
+			{
+				error = "?Packet too long\n";
+			}
+			packetIndex++;
+		}
+		if (error == NULL)
+		{
+			if (thisByte < 0)
+			{
+				error = "?Rx Timeout\n";
+			} else if (remaining ||
+				heldCount < 2 ||
+				packetIndex < headerLen ||
+				literals ||
+				matchToken ||
+				held != crc)
+			{
+				error = "?Bad packet\n";
+			} else
+			{
+				uint32_t	blockIndex = ((uint32_t)header[1] << 24) + ((uint32_t)header[2] << 16) +
+											((uint32_t)header[3] << 8) + header[4];
+				switch (header[0])
+				{
+					case ePacketData:
+					case ePacketCompressed:
+						if (WriteBlock(data, blockIndex))
+						{
+							currentBlockIndex = blockIndex;
+						} else
+						{
+							error = "?Failed writing data\n";
+						}
+						break;
+					case ePacketNullRun:
+					{
+						uint32_t	blockCount = ((uint32_t)header[5] << 24) + ((uint32_t)header[6] << 16) +
+													((uint32_t)header[7] << 8) + header[8];
+						data = NULL;
+						if (!WriteNullRun(blockIndex * kBlockSize, blockCount * kBlockSize,
+								currentBlockIndex, data))
+						{
+							error = "?Failed writing null run\n";
+						}
+						break;
+					}
+					case ePacketEnd:
+						status = eDone;
+						break;
+					default:
+						error = "?Unsupported type\n";
+						break;
+				}
+			}
+		}
+		if (error)
+		{
+			Serial.print(error);
+			status = eError;
+			break;
+		}
+		Serial.write('*');
+	}
+	if (status == eDone)
+	{
+		Serial.print("* success!\n");
+	}
+	FlushSerialInput();
 }
\ No newline at end of file